@@ -2,12 +2,17 @@
 #define _9CC_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 typedef struct Type Type;
 typedef struct Node Node;
 typedef struct Token Token;
 typedef struct LVar LVar;
+typedef struct Ident Ident;
+typedef struct Function Function;
+typedef struct CompileOptions CompileOptions;
 
 typedef enum {
     TK_RESERVED,  // 記号
@@ -27,6 +32,15 @@ struct Token {
     int32_t val;     // kindがTK_NUMの場合、その数値
     char *str;       // トークン文字列
     int64_t len;     // トークン長
+    Ident *ident;    // kindがTK_IDENTの場合、インターンされた識別子
+};
+
+// インターンされた識別子。同じ綴りなら同じIdentになる。
+struct Ident {
+    char *name;    // NUL終端された名前
+    int32_t len;
+    int32_t id;    // 識別子ごとに一意な番号
+    uint32_t hash;
 };
 
 typedef enum {
@@ -50,36 +64,59 @@ typedef enum {
     ND_BLOCK,
     ND_ADDR,   // &
     ND_DEREF,  // *
+    ND_SHL,    // lhs << val (2のべき乗の乗算)
+    ND_SAR,    // lhs / 2^val (0方向に丸める算術右シフト)
+    ND_INLINE,  // インライン展開した関数呼び出し
 } NodeKind;
 
 // 抽象構文木のノードの型
+// kindごとに使うフィールドだけをunionに重ねて持つ。new_node()はkindに
+// 必要な大きさしか確保しないので、kindに対応しないフィールドは読まないこと。
 struct Node {
     NodeKind kind;  // ノードの型
+    int32_t val;    // ND_NUMの値、ND_SHL/ND_SARのシフト量
     Type *ty;       // Type, e.g. int or pointer to int
+    Node *next;     // 文や引数のリスト
 
-    Node *lhs;       // 左辺
-    Node *rhs;       // 右辺
-    int32_t val;     // kindがND_NUMの場合のみ使う
-    int32_t offset;  // kindがND_LVARの場合のみ使う
+    union {
+        // 二項演算、ND_ASSIGN, ND_RETURN, ND_ADDR, ND_DEREF, ND_SHL, ND_SAR
+        struct {
+            Node *lhs;  // 左辺
+            Node *rhs;  // 右辺
+        };
 
-    // if
-    Node *cond;
-    Node *then;
-    Node *els;
+        // ND_IF, ND_WHILE, ND_FOR
+        struct {
+            Node *cond;
+            Node *then;
+            union {
+                Node *els;   // ND_IF
+                Node *init;  // ND_FOR
+            };
+            Node *inc;  // ND_FOR
+        };
 
-    // for
-    Node *init;
-    Node *inc;
+        // ND_BLOCK
+        Node *body;
 
-    // Block
-    Node *body;
-    Node *next;
+        // ND_FUNCALL
+        struct {
+            char *symbolname;
+            Node *args;
+            const char *call_begin;  // 呼び出しのソース上の範囲 (inline.c)
+            const char *call_end;
+        };
 
-    // Function call
-    char *symbolname;
-    Node *args;
+        // ND_INLINE。inlinedの中のreturnは関数ではなくこのノードから抜ける
+        struct {
+            Node *inlined;     // 引数の代入と、関数本体の文の列
+            LVar *ret;         // returnの値を受け取る変数
+            Function *callee;  // 展開した関数
+        };
 
-    LVar *lvar;  // Used if kind == ND_VAR
+        // ND_LVAR
+        LVar *lvar;
+    };
 };
 
 // ローカル変数の型
@@ -88,10 +125,28 @@ struct LVar {
     char *name;      // 変数の名前
     int32_t offset;  // RBPからのオフセット
     Type *ty;        // Type
+    Ident *ident;    // 変数の名前のIdent
+    int32_t vreg;    // レジスタに昇格した場合の仮想レジスタ番号 (ir.c)
+
+    // 変数を使うソース上の範囲。ループ内で使う場合はループ全体を含む。
+    // 範囲が重ならない変数はスタックのスロットを共有できる。
+    const char *use_begin;
+    const char *use_end;
 };
 
+// のぞき穴最適化の書き換えパターン (peephole.c)
+typedef enum {
+    PH_LEA_LOAD,      // lea rax, [rbp-N]; mov rax, [rax] -> mov rax, [rbp-N]
+    PH_OPERAND,       // push rax; mov rax, X; mov rdi, rax; pop rax -> mov rdi, X
+    PH_IMM_OPERAND,   // mov rdi, imm; add rax, rdi -> add rax, imm
+    PH_MEM_OPERAND,   // mov rdi, [rbp-N]; add rax, rdi -> add rax, [rbp-N]
+    PH_PUSH_POP,      // push rax; ...; pop rdi -> mov rdi, rax; ...
+    PH_MOV_RETARGET,  // mov rax, X; mov rdi, rax -> mov rdi, X
+    PH_STORE_DIRECT,  // lea rdi, [rbp-N]; ...; mov [rdi], rax -> ...; mov [rbp-N], rax
+    NUM_PEEPHOLE_RULES,
+} PeepholeRule;
+
 // 関数
-typedef struct Function Function;
 struct Function {
     Function *next;
     char *name;
@@ -99,6 +154,8 @@ struct Function {
     LVar *locals;
     int64_t stack_size;
     LVar *params;
+    bool addr_taken;  // 関数内で&を使っている
+    int32_t peephole_counts[NUM_PEEPHOLE_RULES];  // パターンごとの書き換え回数
 };
 
 typedef enum {
@@ -109,6 +166,8 @@ typedef enum {
 
 struct Type {
     TypeKind kind;
+    int32_t size;   // sizeof
+    int32_t align;  // alignment
 
     // Pointer
     Type *base;
@@ -124,10 +183,474 @@ struct Type {
 
 extern Type *ty_int;
 
-void set_user_input(char *input);
+//
+// arena.c
+//
+
+// arena_new()で個数を数えるオブジェクトの種類
+typedef enum {
+    OBJ_TOKEN,
+    OBJ_NODE,
+    OBJ_LVAR,
+    OBJ_TYPE,
+    NUM_OBJ_KINDS,
+} ObjKind;
+
+typedef struct {
+    size_t num_allocs;               // 確保した回数
+    size_t used_bytes;               // 確保したバイト数
+    size_t reserved_bytes;           // チャンクとして確保したバイト数
+    size_t num_objs[NUM_OBJ_KINDS];  // arena_new()で確保した種類ごとの個数
+} ArenaStats;
+
+void *arena_alloc(size_t size);
+void *arena_new(ObjKind kind, size_t size);
+char *arena_strndup(const char *s, size_t n);
+ArenaStats arena_stats(void);
+uint64_t arena_generation(void);
+void arena_free_all(void);
+
+//
+// intern.c
+//
+
+Ident *intern(const char *s, int32_t len);
+int32_t num_idents(void);
+
+//
+// symtab.c
+//
+
+void enter_scope(void);
+void leave_scope(void);
+LVar *find_var(Ident *ident);
+void declare_var(LVar *var, bool fn_scope);
+int32_t align_to(int32_t n, int32_t align);
+void assign_lvar_offsets(Function *fn);
+
+//
+// emit.c
+//
+
+void emit_set_fd(int fd);
+void emit_set_comments(bool on);
+bool emit_comments_enabled(void);
+void emitf(const char *fmt, ...);
+void emit_bytes(const char *s, size_t n);
+void emit_flush(void);
+void emit_close(void);
+void emit_begin_capture(void);
+char *emit_end_capture(size_t *len);
+// 関数1つのコードを生成する。generate_function()かgenerate_function_regalloc()
+typedef void (*FunctionGen)(Function *fn, const CompileOptions *opts);
+
+void emit_capture_functions(Function **fns, int64_t n, const CompileOptions *opts, FunctionGen gen, char **out,
+                            size_t *len);
+void emit_functions(Function *fns, const CompileOptions *opts, FunctionGen gen);
+size_t emit_bytes_written(void);
+char *format_int(char *p, int64_t val);
+
+//
+// pool.c
+//
+
+typedef void (*TaskFn)(void *arg, int64_t index);
+void run_parallel(int32_t nthreads, int64_t ntasks, TaskFn fn, void *arg);
+
+//
+// stats.c
+//
+
+// --statsで時間を計るコンパイルのフェーズ
+typedef enum {
+    PHASE_TOKENIZE,
+    PHASE_PARSE,
+    PHASE_INLINE,
+    PHASE_FOLD,
+    PHASE_LOOP_OPT,
+    PHASE_ADD_TYPE,
+    PHASE_CODEGEN,
+    PHASE_ASSEMBLE,  // -cの組み込みアセンブラ
+    NUM_PHASES,
+} Phase;
+
+typedef struct {
+    int64_t ns[NUM_PHASES];          // フェーズごとの経過時間
+    size_t alloc_bytes[NUM_PHASES];  // フェーズごとにアリーナに確保したバイト数
+    int64_t last_ns;                 // 前の区切りの時刻
+    size_t last_bytes;               // 前の区切りでのアリーナの使用量
+    const char *cache;               // --cacheで"hit"か"miss"。NULLならキャッシュを使っていない
+    int64_t cache_ns;                // キャッシュを探してエントリを書き出すまでの時間
+    int32_t fns_reused;              // --incrementalでキャッシュから使い回した関数の数
+    int32_t fns_compiled;            // --incrementalでコンパイルし直した関数の数
+} PhaseStats;
+
+void stats_start(PhaseStats *st);
+void stats_phase(PhaseStats *st, Phase phase);
+int64_t stats_now_ns(void);
+void print_stats_json(FILE *out, const char *input, const char *backend, const PhaseStats *st, size_t asm_bytes);
+
+//
+// ir.c
+//
+
+typedef struct IR IR;
+typedef struct BasicBlock BasicBlock;
+typedef struct IRFunc IRFunc;
+
+typedef enum {
+    IR_IMM,        // dst = imm
+    IR_MOV,        // dst = a
+    IR_ADD,        // dst = a + b
+    IR_SUB,        // dst = a - b
+    IR_MUL,        // dst = a * b
+    IR_DIV,        // dst = a / b
+    IR_EQ,         // dst = a == b
+    IR_NE,         // dst = a != b
+    IR_LT,         // dst = a < b
+    IR_LE,         // dst = a <= b
+    IR_SHL,        // dst = a << imm
+    IR_SAR,        // dst = a / 2^imm
+    IR_ARG,        // dst = imm番目の引数レジスタ
+    IR_LEA,        // dst = &var
+    IR_LOAD,       // dst = *a
+    IR_STORE,      // *a = b
+    IR_LOAD_VAR,   // dst = var (メモリ上のローカル変数)
+    IR_STORE_VAR,  // var = a (メモリ上のローカル変数)
+    IR_CALL,       // dst = name(args...)
+    IR_TAILCALL,   // return name(args...) (フレームを片付けてjmpする)
+    IR_RET,        // return a (a < 0なら返り値なし)
+    IR_JMP,        // goto then
+    IR_BR,         // if (a) goto then; else goto els;
+    IR_PHI,        // dst = φ(args[i] from from[i]) (SSA形式の間だけ現れる)
+} IROp;
+
+// 仮想レジスタに対する三番地コード
+struct IR {
+    IR *next;
+    IROp op;
+    int32_t dst;  // 定義する仮想レジスタ、なければ-1
+    int32_t a;
+    int32_t b;
+    int64_t imm;
+    LVar *var;
+
+    // Function call, φ
+    char *name;
+    int32_t *args;
+    int32_t nargs;
+    BasicBlock **from;  // φ: args[i]がどの先行ブロックから来るか
+
+    // Branch
+    BasicBlock *then;
+    BasicBlock *els;
+};
+
+struct BasicBlock {
+    BasicBlock *next;  // レイアウト順で次のブロック
+    int32_t id;
+    IR *first;
+    IR *last;
+
+    // 先行ブロック (ssa.c)
+    BasicBlock **preds;
+    int32_t npreds;
+};
+
+struct IRFunc {
+    Function *fn;
+    BasicBlock *blocks;
+    int32_t num_vregs;
+    bool mem_locals;  // アドレスを取られるのでローカル変数をスタックに置く
+};
+
+IRFunc *lower_function(Function *fn, const CompileOptions *opts);
+bool ir_is_terminator(const IR *ir);
+int32_t ir_use_slots(IR *ir, int32_t **out);
+int32_t ir_uses(const IR *ir, int32_t *out);
+int32_t ir_max_uses(const IR *ir);
+int32_t ir_successors(const BasicBlock *bb, BasicBlock **out);
+void dump_ir(IRFunc *irf, FILE *out);
+
+//
+// ssa.c
+//
+
+void optimize_ir(IRFunc *irf, const CompileOptions *opts);
+
+//
+// peephole.c
+//
+
+// スタックマシン版が出力する命令。テキストにする前にのぞき穴最適化をかける
+typedef enum {
+    REG_RAX,
+    REG_RDI,
+    REG_RSI,
+    REG_RDX,
+    REG_RCX,
+    REG_R8,
+    REG_R9,
+    REG_RBP,
+    REG_RSP,
+    REG_AL,
+} Reg;
+
+typedef enum {
+    OPND_NONE,
+    OPND_REG,    // reg
+    OPND_IMM,    // val
+    OPND_MEM,    // [reg+val]
+    OPND_LABEL,  // .L<name>.<関数名>.<val>。nameがNULLなら.L.return.<関数名>
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    Reg reg;
+    int64_t val;
+    const char *name;
+} Operand;
+
+typedef enum {
+    I_NOP,      // 消した命令
+    I_COMMENT,  // text (emitf()の書式) をnameかdst.valで出力する
+    I_LABEL,    // dst:
+    I_MOV,
+    I_MOVZB,
+    I_LEA,
+    I_PUSH,
+    I_POP,
+    I_ADD,
+    I_SUB,
+    I_IMUL,
+    I_CQO,
+    I_IDIV,
+    I_CMP,
+    I_SETE,
+    I_SETNE,
+    I_SETL,
+    I_SETLE,
+    I_SHL,
+    I_SAR,
+    I_SHR,
+    I_JMP,
+    I_JE,
+    I_JNE,
+    I_JL,
+    I_JLE,
+    I_JG,
+    I_JGE,
+    I_CALL,     // call text
+    I_TAILJMP,  // jmp text (末尾呼び出し)
+} InsnOp;
+
+typedef struct {
+    InsnOp op;
+    Operand dst;
+    Operand src;
+    const char *text;
+    const char *name;
+    int32_t depth;  // push/popの後にスタックに積んである値の数 (コメント用)
+    int32_t seq;    // 生成順の通し番号
+} Insn;
+
+int32_t peephole(Insn *insns, int32_t n, int32_t *counts);
+extern const char *peephole_rule_names[];
+
+//
+// tailcall.c
+//
+
+typedef enum {
+    TAIL_NONE,
+    TAIL_SELF,     // 関数の先頭へ戻るループにする
+    TAIL_SIBLING,  // フレームを片付けてjmpする
+} TailCall;
+
+TailCall tail_call_kind(const Function *fn, const Node *ret, const CompileOptions *opts);
+bool has_self_tail_call(const Function *fn, const CompileOptions *opts);
+
+//
+// inline.c
+//
+
+int32_t inline_functions(Function *fns, int32_t budget, FILE *report);
+
+//
+// loop.c
+//
+
+// ループ最適化で書き換えた数
+typedef struct {
+    int32_t hoisted;   // ループの前に出した不変式
+    int32_t reduced;   // 加算に置き換えた誘導変数の乗算
+    int32_t unrolled;  // 展開したループ
+} LoopStats;
+
+LoopStats optimize_loops(Function *fns, int32_t unroll);
+
+//
+// regalloc.c
+//
+
+// 仮想レジスタの割り当て先。regが負ならスタック上の[rbp-slot]
+typedef struct {
+    int32_t reg;
+    int32_t slot;
+} Location;
+
+typedef struct {
+    Location *locs;         // 仮想レジスタごとの割り当て先
+    int32_t num_spills;     // スピルスロット数
+    uint32_t used_callee;   // 使用したcallee-savedレジスタのビットマスク
+} RegAlloc;
+
+extern const char *reg_names[];
+extern const int32_t num_alloc_regs;
+RegAlloc *allocate_registers(IRFunc *irf);
+
+//
+// lib9cc.c
+//
+
+// コンパイルのオプション。IRのダンプ以外の報告は標準エラー出力に書く
+struct CompileOptions {
+    bool regalloc;
+    bool peephole;    // スタックマシン版でのぞき穴最適化をする
+    bool tail_calls;  // 末尾呼び出しをjmpに、自己再帰をループにする
+    bool asm_comments;
+    FILE *ir_dump;  // 最適化したIRのダンプの出力先。NULLならダンプしない
+    bool fold_stats;
+    bool loop_opt;
+    bool loop_stats;
+    int32_t unroll;  // ループの展開係数。1なら展開しない
+    bool inline_report;
+    int32_t inline_budget;    // 展開する関数の大きさの上限。負ならインライン展開しない
+    int32_t codegen_threads;  // 1つの翻訳単位のコード生成に使うスレッド数
+};
+
+typedef struct CC9Context CC9Context;
+
+// cc9_compile()の出力先。dataはmallocした領域で、足りなければreallocで広げる
+typedef struct {
+    char *data;  // NUL終端する
+    size_t len;
+    size_t cap;
+} CC9Buffer;
+
+FILE *error_stream(void);
+_Noreturn void error_exit(void);
+CompileOptions default_compile_options(void);
+void optimize(Function *fns, const CompileOptions *opts, PhaseStats *phases);
+Function *compile(char *text, const CompileOptions *opts, PhaseStats *phases);
+CC9Context *cc9_new(const CompileOptions *opts);
+void cc9_free(CC9Context *ctx);
+bool cc9_compile(CC9Context *ctx, const char *src, size_t len, CC9Buffer *out);
+void cc9_add_symbol(CC9Context *ctx, const char *name, void *addr);
+bool cc9_run(CC9Context *ctx, const char *src, size_t len, int64_t *result);
+const char *cc9_error(const CC9Context *ctx);
+
+//
+// cache.c
+//
+
+// 128ビットのFNV-1aハッシュ
+typedef unsigned __int128 Hash128;
+
+#define HASH128_INIT (((Hash128)0x6c62272e07bb0142ULL << 64) | 0x62b821756295c58dULL)
+
+// キャッシュのキー。エントリのファイル名になる128ビットのハッシュの16進
+typedef struct {
+    char name[33];
+} CacheKey;
+
+Hash128 hash128(Hash128 h, const void *p, size_t n);
+Hash128 hash_options(Hash128 h, const CompileOptions *opts);
+CacheKey cache_key_of(Hash128 h);
+CacheKey cache_key(const char *src, size_t len, const CompileOptions *opts);
+bool cache_fetch(const char *dir, const CacheKey *key, int out_fd, size_t *bytes);
+char *cache_map(const char *dir, const CacheKey *key, size_t *size);
+void cache_unmap(char *p, size_t size);
+int cache_create(const char *dir, char *tmp_path);
+void cache_commit(const char *dir, const CacheKey *key, int fd, const char *tmp_path, int out_fd);
+void cache_store(const char *dir, const CacheKey *key, const char *data, size_t len);
+void cache_evict(const char *dir, size_t max_bytes);
+void cache_counts(int64_t *hits, int64_t *misses);
+
+//
+// asm.c
+//
+
+// オブジェクトのシンボル。.Lでない関数名のラベルと、callやjmpで参照した関数名
+typedef struct {
+    char *name;
+    int64_t offset;  // .text内の位置
+    int64_t size;
+    bool defined;    // このオブジェクトで定義している
+    bool global;     // .globalで公開している
+} ObjSymbol;
+
+// callとjmpのrel32の再配置。値はシンボルの位置 - (offset + 4)
+typedef struct {
+    int64_t offset;  // rel32の.text内の位置
+    int32_t sym;     // symsの番号
+} ObjReloc;
+
+// アセンブルした.textとシンボル、再配置
+typedef struct {
+    uint8_t *text;
+    size_t len;
+    size_t cap;
+    ObjSymbol *syms;
+    int32_t nsyms;
+    int32_t syms_cap;
+    ObjReloc *relocs;
+    int32_t nrelocs;
+    int32_t relocs_cap;
+} Object;
+
+void assemble(const char *src, size_t len, Object *obj);
+void free_object(Object *obj);
+
+//
+// elf.c
+//
+
+void write_elf(int fd, const Object *obj);
+
+//
+// jit.c
+//
+
+// --runで定義のない関数の呼び出し先にするホストの関数
+typedef struct {
+    const char *name;
+    void *addr;
+} JitSymbol;
+
+int64_t jit_run(const Object *obj, const JitSymbol *host, int32_t nhost);
+
+//
+// incremental.c
+//
+
+void compile_incremental(char *text, const CompileOptions *opts, const char *cache_dir, PhaseStats *phases);
+
+void error(const char *fmt, ...);
+void error_at(const char *loc, const char *fmt, ...);
+void set_user_input(const char *filename, char *input);
 Token *tokenize(char *p);
+size_t node_size(NodeKind kind);
 Function *parse(Token *token_in);
-void generate_code(Function *Function);
+Function *parse_function(Token *tok);
+void generate_code(Function *fns, const CompileOptions *opts);
+void generate_function(Function *fn, const CompileOptions *opts);
+void generate_code_regalloc(Function *fns, const CompileOptions *opts);
+void generate_function_regalloc(Function *fn, const CompileOptions *opts);
+int32_t fold_constants(Function *fns);
+Node *new_node(const NodeKind kind);
+Node *new_binary(const NodeKind kind, Node *lhs, Node *rhs);
+Node *new_num(const int32_t val);
 
 bool is_integer(Type *ty);
 Type *copy_type(Type *ty);
@@ -0,0 +1,93 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// コンパイル1回分の寿命を持つバンプポインタ式アロケータ。
+// Token, Node, LVar, Typeなどは個別に解放せず、arena_free_all()でまとめて解放する。
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+typedef struct Chunk Chunk;
+struct Chunk {
+    Chunk *next;
+    size_t size;  // dataの大きさ
+    size_t used;
+    _Alignas(ARENA_ALIGN) char data[];
+};
+
+static _Thread_local Chunk *s_chunks;
+static _Thread_local ArenaStats s_stats;
+static _Thread_local uint64_t s_generation = 1;  // arena_free_all()のたびに増える
+
+static Chunk *new_chunk(size_t size) {
+    // callocなので確保した領域はゼロ初期化済み
+    Chunk *chunk = calloc(1, sizeof(Chunk) + size);
+    if (!chunk) {
+        error("arena: out of memory");
+    }
+    chunk->size = size;
+    s_stats.reserved_bytes += size;
+    return chunk;
+}
+
+// ゼロ初期化された領域を確保する
+void *arena_alloc(size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (!s_chunks || s_chunks->size - s_chunks->used < size) {
+        if (size > ARENA_CHUNK_SIZE / 4) {
+            // 大きな領域は専用のチャンクにし、現在のチャンクの残りを無駄にしない
+            Chunk *chunk = new_chunk(size);
+            chunk->used = size;
+            if (s_chunks) {
+                chunk->next = s_chunks->next;
+                s_chunks->next = chunk;
+            } else {
+                s_chunks = chunk;
+            }
+            s_stats.num_allocs++;
+            s_stats.used_bytes += size;
+            return chunk->data;
+        }
+        Chunk *chunk = new_chunk(ARENA_CHUNK_SIZE);
+        chunk->next = s_chunks;
+        s_chunks = chunk;
+    }
+    void *p = s_chunks->data + s_chunks->used;
+    s_chunks->used += size;
+    s_stats.num_allocs++;
+    s_stats.used_bytes += size;
+    return p;
+}
+
+// 種類ごとの個数を数えながら確保する
+void *arena_new(ObjKind kind, size_t size) {
+    s_stats.num_objs[kind]++;
+    return arena_alloc(size);
+}
+
+char *arena_strndup(const char *s, size_t n) {
+    char *p = arena_alloc(n + 1);
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+ArenaStats arena_stats(void) { return s_stats; }
+
+// アリーナ上のデータを指すキャッシュが、解放済みかどうかを判定するのに使う
+uint64_t arena_generation(void) { return s_generation; }
+
+void arena_free_all(void) {
+    for (Chunk *chunk = s_chunks; chunk;) {
+        Chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    s_chunks = NULL;
+    s_stats = (ArenaStats){};
+    s_generation++;
+}
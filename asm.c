@@ -0,0 +1,529 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// 9ccが出力するIntel記法のアセンブリを機械語にする組み込みのアセンブラ。
+//
+// 対象はcodegen.cとcodegen_reg.cが使う命令だけで、push/pop/mov/lea/add/sub/cmp/imul/
+// idiv/cqo/shl/sar/shr/setcc/movzb/jmp/jcc/call/retと、オペランドはレジスタ、
+// 即値、[reg+disp]のメモリ。ほかは.global, .intel_syntaxとラベルしか書かない。
+// 関数内の.Lラベルへの分岐はここで解決し、関数名へのcallとjmpは
+// リンカかJITが解決するよう再配置として残す。分岐は常にrel32で書く。
+
+typedef enum {
+    ASM_NONE,
+    ASM_REG,
+    ASM_REG8,
+    ASM_IMM,
+    ASM_MEM,
+    ASM_SYM,
+} AsmOperandKind;
+
+typedef struct {
+    AsmOperandKind kind;
+    int32_t reg;  // レジスタの番号、ASM_MEMならベースレジスタ
+    int64_t val;  // 即値、ASM_MEMなら変位
+    const char *name;
+    int32_t len;
+} AsmOperand;
+
+// ラベル。.Lラベルへの位置が決まる前の参照はfixupsにためて最後に埋める
+typedef struct {
+    int64_t offset;  // -1なら未定義
+} Label;
+
+typedef struct {
+    int64_t pos;  // rel32を書いた位置
+    Ident *label;
+    const char *line;
+} Fixup;
+
+typedef struct {
+    Object *obj;
+    Label *labels;  // Identの番号で引く
+    int32_t labels_cap;
+    int32_t *syms;  // Identの番号からobj->symsの番号。-1ならまだない
+    Fixup *fixups;
+    int32_t nfixups;
+    int32_t fixups_cap;
+    int32_t last_fn;   // 最後に定義した関数のシンボル。-1ならまだない
+    const char *line;  // エラー表示用の処理中の行
+    int32_t line_len;
+} Asm;
+
+static const char *s_reg64[16] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                                  "r8",  "r9",  "r10", "r11", "r12", "r13", "r14", "r15"};
+static const char *s_reg8[16] = {"al",  "cl",  "dl",   "bl",   "spl",  "bpl",  "sil",  "dil",
+                                 "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"};
+
+static void asm_error(Asm *a, const char *msg) {
+    error("asm: %s: %.*s", msg, a->line_len, a->line);
+}
+
+static void out(Asm *a, const void *p, size_t n) {
+    Object *obj = a->obj;
+    if (obj->cap - obj->len < n) {
+        size_t cap = obj->cap ? obj->cap : 4096;
+        while (cap - obj->len < n) {
+            cap *= 2;
+        }
+        obj->text = realloc(obj->text, cap);
+        obj->cap = cap;
+    }
+    memcpy(obj->text + obj->len, p, n);
+    obj->len += n;
+}
+
+static void out8(Asm *a, uint8_t b) { out(a, &b, 1); }
+
+static void out32(Asm *a, int32_t v) { out(a, &v, 4); }
+
+static bool is_int8(int64_t v) { return INT8_MIN <= v && v <= INT8_MAX; }
+
+static bool is_int32(int64_t v) { return INT32_MIN <= v && v <= INT32_MAX; }
+
+static int32_t find_reg(const char *const *names, const char *p, int32_t len) {
+    for (int32_t i = 0; i < 16; i++) {
+        if ((int32_t)strlen(names[i]) == len && !memcmp(names[i], p, len)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static AsmOperand parse_operand(Asm *a, const char *p, const char *end) {
+    while (p < end && *p == ' ') {
+        p++;
+    }
+    while (end > p && end[-1] == ' ') {
+        end--;
+    }
+    if (end - p > 10 && !memcmp(p, "QWORD PTR ", 10)) {
+        p += 10;
+    }
+    AsmOperand op = {.name = p, .len = end - p};
+    if (p == end) {
+        asm_error(a, "オペランドがありません");
+    }
+    if (*p == '[') {
+        const char *q = p + 1;
+        while (q < end && *q != '+' && *q != '-' && *q != ']') {
+            q++;
+        }
+        op.kind = ASM_MEM;
+        op.reg = find_reg(s_reg64, p + 1, q - p - 1);
+        if (op.reg < 0 || end[-1] != ']') {
+            asm_error(a, "メモリオペランドを読めません");
+        }
+        if (*q != ']') {
+            char *num_end;
+            op.val = strtoll(q, &num_end, 10);
+            if (num_end != end - 1) {
+                asm_error(a, "変位を読めません");
+            }
+        }
+        return op;
+    }
+    if (*p == '-' || ('0' <= *p && *p <= '9')) {
+        char *num_end;
+        op.kind = ASM_IMM;
+        op.val = strtoll(p, &num_end, 10);
+        if (num_end != end) {
+            asm_error(a, "即値を読めません");
+        }
+        return op;
+    }
+    if ((op.reg = find_reg(s_reg64, p, end - p)) >= 0) {
+        op.kind = ASM_REG;
+        return op;
+    }
+    if ((op.reg = find_reg(s_reg8, p, end - p)) >= 0) {
+        op.kind = ASM_REG8;
+        return op;
+    }
+    op.kind = ASM_SYM;
+    return op;
+}
+
+// opcode (0x0Fで始まる2バイトなら0x0Fxx) とModR/Mを書く。regはModR/Mのreg欄で、
+// レジスタ番号か/digitの拡張オペコード。wならREX.Wを付ける
+static void encode_rm(Asm *a, int32_t opcode, int32_t reg, const AsmOperand *rm, bool w) {
+    int32_t base = rm->reg;
+    uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (base >> 3);
+    // spl, bpl, sil, dilはREXがないとah, ch, dh, bhになる
+    if (rex != 0x40 || (rm->kind == ASM_REG8 && 4 <= base && base < 8)) {
+        out8(a, rex);
+    }
+    if (opcode > 0xff) {
+        out8(a, opcode >> 8);
+    }
+    out8(a, opcode);
+
+    if (rm->kind == ASM_REG || rm->kind == ASM_REG8) {
+        out8(a, 0xc0 | (reg & 7) << 3 | (base & 7));
+        return;
+    }
+    // rbpとr13は変位なしを表せず、rspとr12はSIBが要る
+    int32_t mod = rm->val == 0 && (base & 7) != 5 ? 0 : is_int8(rm->val) ? 1 : 2;
+    out8(a, mod << 6 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == 4) {
+        out8(a, 0x24);
+    }
+    if (mod == 1) {
+        out8(a, rm->val);
+    } else if (mod == 2) {
+        if (!is_int32(rm->val)) {
+            asm_error(a, "変位が32ビットに収まりません");
+        }
+        out32(a, rm->val);
+    }
+}
+
+static bool is_rm(const AsmOperand *op) { return op->kind == ASM_REG || op->kind == ASM_MEM; }
+
+// Identの番号で引く表をidが入るまで広げる
+static void reserve_ident(Asm *a, Ident *id) {
+    if (id->id >= a->labels_cap) {
+        int32_t cap = a->labels_cap;
+        a->labels_cap = num_idents() * 2;
+        a->labels = realloc(a->labels, sizeof(Label) * a->labels_cap);
+        a->syms = realloc(a->syms, sizeof(int32_t) * a->labels_cap);
+        for (int32_t i = cap; i < a->labels_cap; i++) {
+            a->labels[i].offset = -1;
+            a->syms[i] = -1;
+        }
+    }
+}
+
+// 関数名のシンボルの番号を返す。なければ未定義のシンボルとして足す
+static int32_t symbol(Asm *a, const char *name, int32_t len) {
+    Object *obj = a->obj;
+    Ident *id = intern(name, len);
+    reserve_ident(a, id);
+    if (a->syms[id->id] < 0) {
+        if (obj->nsyms == obj->syms_cap) {
+            obj->syms_cap = obj->syms_cap ? obj->syms_cap * 2 : 64;
+            obj->syms = realloc(obj->syms, sizeof(ObjSymbol) * obj->syms_cap);
+        }
+        a->syms[id->id] = obj->nsyms;
+        obj->syms[obj->nsyms++] = (ObjSymbol){.name = id->name, .offset = -1};
+    }
+    return a->syms[id->id];
+}
+
+static Label *label(Asm *a, Ident *id) {
+    reserve_ident(a, id);
+    return &a->labels[id->id];
+}
+
+static bool is_local(const char *name) { return name[0] == '.' && name[1] == 'L'; }
+
+// callやjmpの後のrel32を書く。.Lラベルなら後で埋め、関数名なら再配置を残す。
+// 9ccは間接分岐を書かないので、raxのような関数名もレジスタとは読まない
+static void branch_target(Asm *a, const AsmOperand *target) {
+    if (target->kind == ASM_MEM || target->kind == ASM_IMM) {
+        asm_error(a, "分岐先はラベルしか書けません");
+    }
+    if (target->len >= 2 && is_local(target->name)) {
+        if (a->nfixups == a->fixups_cap) {
+            a->fixups_cap = a->fixups_cap ? a->fixups_cap * 2 : 256;
+            a->fixups = realloc(a->fixups, sizeof(Fixup) * a->fixups_cap);
+        }
+        a->fixups[a->nfixups++] = (Fixup){a->obj->len, intern(target->name, target->len), a->line};
+        out32(a, 0);
+        return;
+    }
+    Object *obj = a->obj;
+    if (obj->nrelocs == obj->relocs_cap) {
+        obj->relocs_cap = obj->relocs_cap ? obj->relocs_cap * 2 : 64;
+        obj->relocs = realloc(obj->relocs, sizeof(ObjReloc) * obj->relocs_cap);
+    }
+    obj->relocs[obj->nrelocs++] = (ObjReloc){obj->len, symbol(a, target->name, target->len)};
+    out32(a, 0);
+}
+
+typedef struct {
+    char name[6];
+    uint8_t cc;  // Jcc/SETccの条件コード
+} Cond;
+
+static const Cond s_conds[] = {
+    {"e", 0x4}, {"ne", 0x5}, {"l", 0xc}, {"ge", 0xd}, {"le", 0xe}, {"g", 0xf},
+};
+
+static int32_t find_cond(const char *p, int32_t len) {
+    for (int32_t i = 0; i < (int32_t)(sizeof(s_conds) / sizeof(s_conds[0])); i++) {
+        if ((int32_t)strlen(s_conds[i].name) == len && !memcmp(s_conds[i].name, p, len)) {
+            return s_conds[i].cc;
+        }
+    }
+    return -1;
+}
+
+// add, sub, cmpの/digit
+static int32_t alu_digit(const char *m, int32_t len) {
+    if (len == 3 && !memcmp(m, "add", 3)) {
+        return 0;
+    }
+    if (len == 3 && !memcmp(m, "sub", 3)) {
+        return 5;
+    }
+    if (len == 3 && !memcmp(m, "cmp", 3)) {
+        return 7;
+    }
+    return -1;
+}
+
+// shl, shr, sarの/digit
+static int32_t shift_digit(const char *m, int32_t len) {
+    if (len == 3 && !memcmp(m, "shl", 3)) {
+        return 4;
+    }
+    if (len == 3 && !memcmp(m, "shr", 3)) {
+        return 5;
+    }
+    if (len == 3 && !memcmp(m, "sar", 3)) {
+        return 7;
+    }
+    return -1;
+}
+
+static bool is_mnemonic(const char *m, int32_t len, const char *name) {
+    return (int32_t)strlen(name) == len && !memcmp(m, name, len);
+}
+
+static void encode(Asm *a, const char *m, int32_t mlen, AsmOperand *ops, int32_t nops) {
+    AsmOperand *x = &ops[0];
+    AsmOperand *y = &ops[1];
+    int32_t digit;
+    int32_t cc;
+
+    if (nops == 0) {
+        if (is_mnemonic(m, mlen, "ret")) {
+            out8(a, 0xc3);
+            return;
+        }
+        if (is_mnemonic(m, mlen, "cqo")) {
+            out8(a, 0x48);
+            out8(a, 0x99);
+            return;
+        }
+    } else if (nops == 1) {
+        if ((is_mnemonic(m, mlen, "push") || is_mnemonic(m, mlen, "pop")) && x->kind == ASM_REG) {
+            if (x->reg >= 8) {
+                out8(a, 0x41);
+            }
+            out8(a, (m[1] == 'u' ? 0x50 : 0x58) + (x->reg & 7));
+            return;
+        }
+        if (is_mnemonic(m, mlen, "idiv") && is_rm(x)) {
+            encode_rm(a, 0xf7, 7, x, true);
+            return;
+        }
+        if (is_mnemonic(m, mlen, "call")) {
+            out8(a, 0xe8);
+            branch_target(a, x);
+            return;
+        }
+        if (is_mnemonic(m, mlen, "jmp")) {
+            out8(a, 0xe9);
+            branch_target(a, x);
+            return;
+        }
+        if (m[0] == 'j' && (cc = find_cond(m + 1, mlen - 1)) >= 0) {
+            out8(a, 0x0f);
+            out8(a, 0x80 | cc);
+            branch_target(a, x);
+            return;
+        }
+        if (mlen > 3 && !memcmp(m, "set", 3) && (cc = find_cond(m + 3, mlen - 3)) >= 0 && x->kind == ASM_REG8) {
+            encode_rm(a, 0x0f90 | cc, 0, x, false);
+            return;
+        }
+    } else if (nops == 2) {
+        if (is_mnemonic(m, mlen, "mov")) {
+            if (is_rm(x) && y->kind == ASM_REG) {
+                encode_rm(a, 0x89, y->reg, x, true);
+                return;
+            }
+            if (x->kind == ASM_REG && y->kind == ASM_MEM) {
+                encode_rm(a, 0x8b, x->reg, y, true);
+                return;
+            }
+            if (x->kind == ASM_REG && y->kind == ASM_IMM && !is_int32(y->val)) {
+                out8(a, 0x48 | (x->reg >> 3));
+                out8(a, 0xb8 + (x->reg & 7));
+                out(a, &y->val, 8);
+                return;
+            }
+            if (is_rm(x) && y->kind == ASM_IMM && is_int32(y->val)) {
+                encode_rm(a, 0xc7, 0, x, true);
+                out32(a, y->val);
+                return;
+            }
+        }
+        if (is_mnemonic(m, mlen, "lea") && x->kind == ASM_REG && y->kind == ASM_MEM) {
+            encode_rm(a, 0x8d, x->reg, y, true);
+            return;
+        }
+        if (is_mnemonic(m, mlen, "movzb") && x->kind == ASM_REG && y->kind == ASM_REG8) {
+            encode_rm(a, 0x0fb6, x->reg, y, true);
+            return;
+        }
+        if ((digit = alu_digit(m, mlen)) >= 0) {
+            int32_t base = digit << 3;  // add 0x00, sub 0x28, cmp 0x38
+            if (is_rm(x) && y->kind == ASM_REG) {
+                encode_rm(a, base + 1, y->reg, x, true);
+                return;
+            }
+            if (x->kind == ASM_REG && y->kind == ASM_MEM) {
+                encode_rm(a, base + 3, x->reg, y, true);
+                return;
+            }
+            if (is_rm(x) && y->kind == ASM_IMM && is_int32(y->val)) {
+                encode_rm(a, is_int8(y->val) ? 0x83 : 0x81, digit, x, true);
+                if (is_int8(y->val)) {
+                    out8(a, y->val);
+                } else {
+                    out32(a, y->val);
+                }
+                return;
+            }
+        }
+        if (is_mnemonic(m, mlen, "imul") && x->kind == ASM_REG && is_rm(y)) {
+            encode_rm(a, 0x0faf, x->reg, y, true);
+            return;
+        }
+        if ((digit = shift_digit(m, mlen)) >= 0 && is_rm(x) && y->kind == ASM_IMM) {
+            encode_rm(a, 0xc1, digit, x, true);
+            out8(a, y->val);
+            return;
+        }
+    } else if (nops == 3) {
+        AsmOperand *z = &ops[2];
+        if (is_mnemonic(m, mlen, "imul") && x->kind == ASM_REG && is_rm(y) && z->kind == ASM_IMM &&
+            is_int32(z->val)) {
+            encode_rm(a, is_int8(z->val) ? 0x6b : 0x69, x->reg, y, true);
+            if (is_int8(z->val)) {
+                out8(a, z->val);
+            } else {
+                out32(a, z->val);
+            }
+            return;
+        }
+    }
+    asm_error(a, "対応していない命令です");
+}
+
+// ラベルの定義。関数名ならシンボルにする
+static void define_label(Asm *a, const char *name, int32_t len) {
+    Ident *id = intern(name, len);
+    Label *l = label(a, id);
+    if (l->offset >= 0) {
+        asm_error(a, "ラベルが重複しています");
+    }
+    l->offset = a->obj->len;
+    if (!is_local(id->name)) {
+        // 関数の大きさは次の関数の先頭までとする
+        int32_t i = symbol(a, name, len);
+        if (a->last_fn >= 0) {
+            a->obj->syms[a->last_fn].size = a->obj->len - a->obj->syms[a->last_fn].offset;
+        }
+        a->obj->syms[i].offset = a->obj->len;
+        a->obj->syms[i].defined = true;
+        a->last_fn = i;
+    }
+}
+
+static void assemble_line(Asm *a, const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    if (p == end) {
+        return;
+    }
+    if (end[-1] == ':') {
+        define_label(a, p, end - 1 - p);
+        return;
+    }
+    const char *m = p;
+    while (p < end && *p != ' ') {
+        p++;
+    }
+    int32_t mlen = p - m;
+    if (*m == '.') {
+        if (mlen == 7 && !memcmp(m, ".global", 7)) {
+            AsmOperand name = parse_operand(a, p, end);
+            int32_t i = symbol(a, name.name, name.len);
+            a->obj->syms[i].global = true;
+            return;
+        }
+        if (mlen == 13 && !memcmp(m, ".intel_syntax", 13)) {
+            return;
+        }
+        asm_error(a, "対応していない疑似命令です");
+    }
+
+    AsmOperand ops[3];
+    int32_t nops = 0;
+    while (p < end) {
+        const char *q = ++p;
+        while (q < end && *q != ',') {
+            q++;
+        }
+        if (nops == 3) {
+            asm_error(a, "オペランドが多すぎます");
+        }
+        ops[nops++] = parse_operand(a, p, q);
+        p = q;
+    }
+    encode(a, m, mlen, ops, nops);
+}
+
+// srcのlenバイトのアセンブリを機械語にしてobjに入れる
+void assemble(const char *src, size_t len, Object *obj) {
+    *obj = (Object){};
+    Asm a = {.obj = obj, .last_fn = -1};
+    const char *end = src + len;
+    for (const char *p = src; p < end;) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol) {
+            eol = end;
+        }
+        a.line = p;
+        a.line_len = eol - p;
+        const char *comment = memchr(p, '#', eol - p);
+        assemble_line(&a, p, comment ? comment : eol);
+        p = eol + 1;
+    }
+
+    for (int32_t i = 0; i < a.nfixups; i++) {
+        Fixup *f = &a.fixups[i];
+        int64_t target = a.labels[f->label->id].offset;
+        if (target < 0) {
+            a.line = f->line;
+            a.line_len = strcspn(f->line, "\n");
+            asm_error(&a, "未定義のラベルです");
+        }
+        int32_t rel = target - (f->pos + 4);
+        memcpy(obj->text + f->pos, &rel, 4);
+    }
+    if (a.last_fn >= 0) {
+        obj->syms[a.last_fn].size = obj->len - obj->syms[a.last_fn].offset;
+    }
+    free(a.labels);
+    free(a.syms);
+    free(a.fixups);
+}
+
+void free_object(Object *obj) {
+    free(obj->text);
+    free(obj->syms);
+    free(obj->relocs);
+}
@@ -0,0 +1,202 @@
+// AST のメモリ量と走査時間を、kindごとにペイロードを持つ現在のNodeと
+// 全フィールドを持つ以前のNodeレイアウトとで比較する。
+//
+//   usage: ast_bench [num_statements]   (デフォルトは100万文)
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../9cc.h"
+
+// 変更前のNodeと同じレイアウト
+typedef struct LegacyNode LegacyNode;
+struct LegacyNode {
+    NodeKind kind;
+    Type *ty;
+    LegacyNode *lhs;
+    LegacyNode *rhs;
+    int32_t val;
+    int32_t offset;
+    LegacyNode *cond;
+    LegacyNode *then;
+    LegacyNode *els;
+    LegacyNode *init;
+    LegacyNode *inc;
+    LegacyNode *body;
+    LegacyNode *next;
+    char *symbolname;
+    LegacyNode *args;
+    LVar *lvar;
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *generate_source(long n) {
+    static const char *stmts[] = {
+        "x = x + 3 * y - 1;",
+        "if (x < y) y = y + 1; else z = z - 1;",
+        "for (i = 0; i < 2; i = i + 1) z = z + i;",
+        "while (z == 5) z = add(x, y);",
+    };
+    size_t cap = 64 + n * 48;
+    char *buf = malloc(cap);
+    char *p = buf;
+    p += sprintf(p, "main() { x = 1; y = 2; z = 3; i = 0;\n");
+    for (long i = 0; i < n; i++) {
+        p += sprintf(p, "%s\n", stmts[i % 4]);
+    }
+    sprintf(p, "return x; }\n");
+    return buf;
+}
+
+static size_t s_num_nodes;
+static size_t s_compact_bytes;
+
+static LegacyNode *to_legacy(Node *node) {
+    if (!node) {
+        return NULL;
+    }
+    s_num_nodes++;
+    s_compact_bytes += node_size(node->kind);
+
+    LegacyNode *ln = arena_alloc(sizeof(LegacyNode));
+    ln->kind = node->kind;
+    ln->ty = node->ty;
+    switch (node->kind) {
+        case ND_NUM:
+            ln->val = node->val;
+            break;
+        case ND_LVAR:
+            ln->lvar = node->lvar;
+            ln->offset = node->lvar->offset;
+            ln->symbolname = node->lvar->name;
+            break;
+        case ND_IF:
+            ln->cond = to_legacy(node->cond);
+            ln->then = to_legacy(node->then);
+            ln->els = to_legacy(node->els);
+            break;
+        case ND_WHILE:
+        case ND_FOR:
+            if (node->kind == ND_FOR) {
+                ln->init = to_legacy(node->init);
+                ln->inc = to_legacy(node->inc);
+            }
+            ln->cond = to_legacy(node->cond);
+            ln->then = to_legacy(node->then);
+            break;
+        case ND_BLOCK: {
+            LegacyNode head = {};
+            LegacyNode *cur = &head;
+            for (Node *n = node->body; n; n = n->next) {
+                cur = cur->next = to_legacy(n);
+            }
+            ln->body = head.next;
+            break;
+        }
+        case ND_FUNCALL: {
+            LegacyNode head = {};
+            LegacyNode *cur = &head;
+            for (Node *n = node->args; n; n = n->next) {
+                cur = cur->next = to_legacy(n);
+            }
+            ln->args = head.next;
+            ln->symbolname = node->symbolname;
+            break;
+        }
+        default:
+            ln->lhs = to_legacy(node->lhs);
+            ln->rhs = to_legacy(node->rhs);
+            ln->val = node->val;
+            break;
+    }
+    return ln;
+}
+
+// 変更前のadd_type()と同じく、全ての子フィールドをたどる
+static uint64_t walk_legacy(LegacyNode *node) {
+    if (!node) {
+        return 0;
+    }
+    uint64_t h = node->kind + (uint64_t)node->val;
+    h += walk_legacy(node->lhs);
+    h += walk_legacy(node->rhs);
+    h += walk_legacy(node->cond);
+    h += walk_legacy(node->then);
+    h += walk_legacy(node->els);
+    h += walk_legacy(node->init);
+    h += walk_legacy(node->inc);
+    for (LegacyNode *n = node->body; n; n = n->next) h += walk_legacy(n);
+    for (LegacyNode *n = node->args; n; n = n->next) h += walk_legacy(n);
+    return h;
+}
+
+static uint64_t walk_compact(Node *node) {
+    if (!node) {
+        return 0;
+    }
+    uint64_t h = node->kind + (uint64_t)node->val;
+    switch (node->kind) {
+        case ND_NUM:
+        case ND_LVAR:
+            break;
+        case ND_IF:
+            h += walk_compact(node->cond) + walk_compact(node->then) + walk_compact(node->els);
+            break;
+        case ND_WHILE:
+        case ND_FOR:
+            if (node->kind == ND_FOR) {
+                h += walk_compact(node->init) + walk_compact(node->inc);
+            }
+            h += walk_compact(node->cond) + walk_compact(node->then);
+            break;
+        case ND_BLOCK:
+            for (Node *n = node->body; n; n = n->next) h += walk_compact(n);
+            break;
+        case ND_FUNCALL:
+            for (Node *n = node->args; n; n = n->next) h += walk_compact(n);
+            break;
+        default:
+            h += walk_compact(node->lhs) + walk_compact(node->rhs);
+            break;
+    }
+    return h;
+}
+
+int main(int argc, char **argv) {
+    long n = argc > 1 ? atol(argv[1]) : 1000000;
+    char *src = generate_source(n);
+    set_user_input("<bench>", src);
+    Function *fn = parse(tokenize(src));
+    LegacyNode *legacy = to_legacy(fn->body);
+
+    const int iters = 5;
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+    double t0 = now();
+    for (int i = 0; i < iters; i++) h1 += walk_legacy(legacy);
+    double t1 = now();
+    for (int i = 0; i < iters; i++) h2 += walk_compact(fn->body);
+    double t2 = now();
+    if (h1 != h2) {
+        fprintf(stderr, "checksum mismatch: %llu != %llu\n", (unsigned long long)h1, (unsigned long long)h2);
+        return 1;
+    }
+
+    size_t legacy_bytes = s_num_nodes * sizeof(LegacyNode);
+    printf("statements:       %ld\n", n);
+    printf("nodes:            %zu\n", s_num_nodes);
+    printf("legacy AST:       %zu bytes (%zu bytes/node)\n", legacy_bytes, sizeof(LegacyNode));
+    printf("compact AST:      %zu bytes (%.1f bytes/node)\n", s_compact_bytes, (double)s_compact_bytes / s_num_nodes);
+    printf("legacy traverse:  %.2f ms\n", (t1 - t0) * 1000 / iters);
+    printf("compact traverse: %.2f ms\n", (t2 - t1) * 1000 / iters);
+    arena_free_all();
+    return 0;
+}
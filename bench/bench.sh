@@ -0,0 +1,95 @@
+#!/bin/bash -eu
+# 大きな生成プログラムでコンパイルの速さと生成したコードの速さを測り、gcc -O0と比べる。
+# bench/gen_program.cで同じプログラムを9cc向けとC向けに生成し、9cc (両バックエンド)
+# とgcc -O0でアセンブリまでのコンパイル時間を1回、実行時間を3回のうち最短で測る。
+# 終了コードが全て一致することも確かめる。
+#
+#   usage: bench/bench.sh [path/to/9cc] [path/to/gen_program] [--quick]
+#
+#   --quickなら各プログラムの大きさを1/10にする
+#
+#   expr    深さ5000の式の入れ子と平衡した式の木
+#   stmts   10万文の関数
+#   funcs   5000個の関数
+#   calls   5000段の呼び出しの連鎖
+
+cd "$(dirname "$0")/.."
+cc9=$(realpath "${1:-./9cc}")
+gen=$(realpath "${2:-bench/gen_program}")
+div=1
+if [ "${3:-}" = --quick ]; then
+    div=10
+fi
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# コンパイラが暴走しても計測を続けられるように、時間とメモリを制限する
+limit() {
+    (ulimit -v $((4 * 1024 * 1024)) && timeout 600 "$@")
+}
+
+now() { date +%s%N; }
+
+# 3回実行して最短の時間をミリ秒で出力する。終了コードは$tmp/statusに書く
+run() {
+    best=
+    for _ in 1 2 3; do
+        start=$(now)
+        set +e
+        "$1"
+        echo $? >"$tmp/status"
+        set -e
+        ms=$((($(now) - start) / 1000000))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+            best=$ms
+        fi
+    done
+    echo "$best"
+}
+
+printf '%-6s %8s %9s  %-14s %10s %10s %10s %8s %5s\n' program lines tokens compiler "compile ms" "klines/s" "ktokens/s" "run ms" exit
+#        shape  size   reps
+for spec in "expr   5000   20000" \
+            "stmts  100000 20" \
+            "funcs  5000   100" \
+            "calls  5000   100"; do
+    set -- $spec
+    shape=$1
+    size=$(($2 / div))
+    reps=$3
+    "$gen" "$shape" "$size" "$reps" >"$tmp/$shape.c"
+    "$gen" --c "$shape" "$size" "$reps" >"$tmp/${shape}_gcc.c"
+    lines=$(wc -l <"$tmp/$shape.c")
+    tokens=$("$cc9" --stats -o /dev/null "$tmp/$shape.c" 2>&1 | grep -o '"tokens":[0-9]*' | cut -d: -f2)
+
+    expected=
+    for compiler in 9cc 9cc-regalloc gcc-O0; do
+        src=$tmp/$shape.c
+        case $compiler in
+            9cc) cmd=("$cc9" -o "$tmp/out.s" "$src") ;;
+            9cc-regalloc) cmd=("$cc9" --regalloc -o "$tmp/out.s" "$src") ;;
+            gcc-O0)
+                src=$tmp/${shape}_gcc.c
+                cmd=(gcc -O0 -w -S -o "$tmp/out.s" "$src")
+                ;;
+        esac
+        start=$(now)
+        if ! limit "${cmd[@]}" 2>/dev/null; then
+            printf '%-6s %8d %9d  %-14s %10s\n' "$shape" "$lines" "$tokens" "$compiler" failed
+            continue
+        fi
+        ms=$((($(now) - start) / 1000000))
+        cc -static -o "$tmp/out" "$tmp/out.s" 2>/dev/null
+        run_ms=$(run "$tmp/out")
+        status=$(cat "$tmp/status")
+        if [ -z "$expected" ]; then
+            expected=$status
+        elif [ "$status" != "$expected" ]; then
+            echo "$shape ($compiler): exit status $expected expected, but got $status"
+            exit 1
+        fi
+        # gccの行数とトークン数は宣言の分だけ多いが、同じプログラムなので9cc向けの数で割る
+        awk -v s="$shape" -v l="$lines" -v t="$tokens" -v c="$compiler" -v ms="$ms" -v r="$run_ms" -v e="$status" \
+            'BEGIN { sec = (ms ? ms : 1) / 1000; printf "%-6s %8d %9d  %-14s %10d %10.1f %10.1f %8d %5d\n", s, l, t, c, ms, l / sec / 1000, t / sec / 1000, r, e }'
+    done
+done
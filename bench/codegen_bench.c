@@ -0,0 +1,97 @@
+// コード生成だけの時間を、生成した大きなプログラムで測る。
+// 出力は/dev/nullに捨て、デバッグコメントの有無と両バックエンドを比べる。
+// 後半は関数ごとの並列コード生成を1/2/4/8スレッドで測る。
+//
+//   usage: codegen_bench [num_statements]   (デフォルトは100万文)
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../9cc.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 100文ごとに関数を分ける
+static char *generate_source(long n) {
+    static const char *stmts[] = {
+        "x = x + 3 * y - 1;",
+        "if (x < y) y = y + 1; else z = z - 1;",
+        "for (i = 0; i < 2; i = i + 1) z = z + i;",
+        "while (z == 5) z = add(x, y);",
+    };
+    size_t cap = 64 + n * 48 + (n / 100 + 1) * 64;
+    char *buf = malloc(cap);
+    char *p = buf;
+    for (long i = 0; i < n; i++) {
+        if (i % 100 == 0) {
+            p += sprintf(p, "f%ld(x, y) { z = 3; i = 0;\n", i / 100);
+        }
+        p += sprintf(p, "%s\n", stmts[i % 4]);
+        if (i % 100 == 99 || i == n - 1) {
+            p += sprintf(p, "return x; }\n");
+        }
+    }
+    sprintf(p, "main() { return 0; }\n");
+    return buf;
+}
+
+static void run(const char *label, Function *fns, bool regalloc, bool comments, int32_t nthreads) {
+    emit_set_comments(comments);
+    size_t before = emit_bytes_written();
+    CompileOptions opts = default_compile_options();
+    opts.codegen_threads = nthreads;
+    double t0 = now();
+    if (regalloc) {
+        generate_code_regalloc(fns, &opts);
+    } else {
+        generate_code(fns, &opts);
+    }
+    double t1 = now();
+    double mb = (emit_bytes_written() - before) / 1e6;
+    printf("%-28s %8.2f ms  %7.1f MB  %7.1f MB/s\n", label, (t1 - t0) * 1000, mb, mb / (t1 - t0));
+}
+
+int main(int argc, char **argv) {
+    long n = argc > 1 ? atol(argv[1]) : 1000000;
+    char *src = generate_source(n);
+    set_user_input("<bench>", src);
+    Function *fns = parse(tokenize(src));
+    fold_constants(fns);
+    for (Function *fn = fns; fn; fn = fn->next) {
+        add_type(fn->body);
+    }
+
+    int fd = open("/dev/null", O_WRONLY);
+    if (fd < 0) {
+        perror("/dev/null");
+        return 1;
+    }
+    emit_set_fd(fd);
+
+    printf("statements: %ld\n", n);
+    run("stack, with comments", fns, false, true, 1);
+    run("stack, --no-asm-comments", fns, false, false, 1);
+    run("regalloc, with comments", fns, true, true, 1);
+    run("regalloc, --no-asm-comments", fns, true, false, 1);
+
+    for (int32_t nthreads = 1; nthreads <= 8; nthreads *= 2) {
+        char label[64];
+        snprintf(label, sizeof(label), "stack, -j %d", nthreads);
+        run(label, fns, false, true, nthreads);
+    }
+    for (int32_t nthreads = 1; nthreads <= 8; nthreads *= 2) {
+        char label[64];
+        snprintf(label, sizeof(label), "regalloc, -j %d", nthreads);
+        run(label, fns, true, true, nthreads);
+    }
+    arena_free_all();
+    return 0;
+}
@@ -0,0 +1,198 @@
+// ベンチマーク用の大きなプログラムを生成する。同じプログラムを9cc向けと、
+// 変数と関数を long で宣言したC向け (--c) の2通りで書けるので、gcc -O0 と比べられる。
+// 値は途中で4096の剰余に丸めるので、オーバーフローせずどちらでも同じ終了コードになる。
+//
+//   usage: gen_program [--c] <shape> <size> [reps]
+//
+//   expr   深さsizeの括弧の入れ子と長さsizeの左結合の連鎖、深さ8の平衡した式の木
+//   stmts  size文からなる1つの関数
+//   funcs  20文ずつのsize個の関数。mainが全て呼ぶ
+//   calls  次の関数を呼ぶsize個の関数の連鎖
+//
+// mainは各関数をreps回 (デフォルトは100回) 呼び、結果の下位8ビットを返す。
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *s_vars[] = {"a", "b", "c", "d", "e", "g", "h"};
+#define NUM_VARS 7
+
+static bool s_c;  // C向けに宣言を付ける
+static uint64_t s_rand = 88172645463325252ULL;
+
+static uint32_t rnd(uint32_t n) {
+    s_rand ^= s_rand << 13;
+    s_rand ^= s_rand >> 7;
+    s_rand ^= s_rand << 17;
+    return s_rand % n;
+}
+
+static const char *var(void) { return s_vars[rnd(NUM_VARS)]; }
+
+// 葉が2^depth個の式の木。乗算は葉に定数を掛けるだけにして値の増え方を抑える
+static void tree(int depth) {
+    if (depth == 0) {
+        switch (rnd(3)) {
+            case 0:
+                printf("%u", rnd(10));
+                return;
+            case 1:
+                printf("%s * %u", var(), rnd(9) + 1);
+                return;
+            default:
+                printf("%s", var());
+                return;
+        }
+    }
+    printf("(");
+    tree(depth - 1);
+    printf(" %s ", rnd(2) ? "+" : "-");
+    tree(depth - 1);
+    printf(")");
+}
+
+// 一時変数tに式を入れ、4096の剰余に丸めて変数に代入する
+static void assign_tree(int depth) {
+    printf("    t = ");
+    tree(depth);
+    const char *v = var();
+    printf(";\n    %s = t - t / 4096 * 4096;\n", v);
+}
+
+static void stmt(void) {
+    switch (rnd(5)) {
+        case 0:
+        case 1:
+            assign_tree(3);
+            return;
+        case 2: {
+            const char *v = var();
+            const char *w = var();
+            printf("    if (%s < %s) %s = %s + %u; else %s = %s - %u;\n", v, w, v, v, rnd(9) + 1, w, w, rnd(9) + 1);
+            return;
+        }
+        case 3: {
+            const char *v = var();
+            printf("    for (i = 0; i < 3; i = i + 1) %s = %s + i * %u;\n", v, v, rnd(9) + 1);
+            return;
+        }
+        default: {
+            const char *v = var();
+            printf("    while (%s > 4096) %s = %s - 4096;\n", v, v, v);
+            return;
+        }
+    }
+}
+
+static void begin_function(int32_t id) {
+    if (s_c) {
+        printf("long f%d(long a, long b) {\n    long c, d, e, g, h, i, t;\n", id);
+    } else {
+        printf("f%d(a, b) {\n", id);
+    }
+    printf("    c = a + 1;\n    d = b - 2;\n    e = 3;\n    g = a;\n    h = b;\n");
+}
+
+static void end_function(void) { printf("    t = a + b + c + d + e + g + h;\n    return t - t / 4096 * 4096;\n}\n"); }
+
+// 括弧が右にsize段入れ子になった式と、左結合でsize個つながった式
+static void deep_exprs(int32_t size) {
+    printf("    t = ");
+    for (int32_t i = 0; i < size; i++) {
+        printf("(%s %s ", var(), rnd(2) ? "+" : "-");
+    }
+    printf("%s", var());
+    for (int32_t i = 0; i < size; i++) {
+        putchar(')');
+    }
+    printf(";\n    c = t - t / 4096 * 4096;\n    t = %s", var());
+    for (int32_t i = 1; i < size; i++) {
+        printf(i % 16 ? " %s %s" : "\n        %s %s", rnd(2) ? "+" : "-", var());
+    }
+    printf(";\n    d = t - t / 4096 * 4096;\n");
+}
+
+// mainはroots個の関数f0, f1, ...をreps回呼ぶ
+static void gen_main(int32_t roots, int32_t reps) {
+    if (s_c) {
+        printf("int main() {\n    long r, s;\n");
+    } else {
+        printf("main() {\n");
+    }
+    printf("    s = 0;\n    for (r = 0; r < %d; r = r + 1) {\n", reps);
+    for (int32_t i = 0; i < roots; i++) {
+        printf("        s = s + f%d(r, s);\n", i);
+    }
+    printf("        s = s - s / 4096 * 4096;\n    }\n    return s - s / 256 * 256;\n}\n");
+}
+
+static void prototypes(int32_t n) {
+    if (s_c) {
+        for (int32_t i = 0; i < n; i++) {
+            printf("long f%d(long a, long b);\n", i);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int i = 1;
+    if (i < argc && !strcmp(argv[i], "--c")) {
+        s_c = true;
+        i++;
+    }
+    if (argc - i < 2 || argc - i > 3 || atoi(argv[i + 1]) < 1) {
+        fprintf(stderr, "usage: gen_program [--c] <expr|stmts|funcs|calls> <size> [reps]\n");
+        return 1;
+    }
+    const char *shape = argv[i];
+    int32_t size = atoi(argv[i + 1]);
+    int32_t reps = argc - i == 3 ? atoi(argv[i + 2]) : 100;
+
+    if (!strcmp(shape, "expr")) {
+        begin_function(0);
+        deep_exprs(size);
+        for (int32_t j = 0; j < 50; j++) {
+            assign_tree(8);
+        }
+        end_function();
+        gen_main(1, reps);
+    } else if (!strcmp(shape, "stmts")) {
+        begin_function(0);
+        for (int32_t j = 0; j < size; j++) {
+            stmt();
+        }
+        end_function();
+        gen_main(1, reps);
+    } else if (!strcmp(shape, "funcs")) {
+        prototypes(size);
+        for (int32_t id = 0; id < size; id++) {
+            begin_function(id);
+            for (int32_t j = 0; j < 20; j++) {
+                stmt();
+            }
+            end_function();
+        }
+        gen_main(size, reps);
+    } else if (!strcmp(shape, "calls")) {
+        // 呼び出しの結果を使うので末尾呼び出しにはならず、スタックが深くなる
+        prototypes(size);
+        for (int32_t id = 0; id < size; id++) {
+            begin_function(id);
+            for (int32_t j = 0; j < 4; j++) {
+                stmt();
+            }
+            if (id + 1 < size) {
+                printf("    %s = f%d(%s, %s);\n", var(), id + 1, var(), var());
+            }
+            end_function();
+        }
+        gen_main(1, reps);
+    } else {
+        fprintf(stderr, "gen_program: unknown shape: %s\n", shape);
+        return 1;
+    }
+    return 0;
+}
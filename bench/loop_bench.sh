@@ -0,0 +1,61 @@
+#!/bin/bash -eu
+# ループ最適化の効果を、bench/loops/のループの多いプログラムで測る。
+# 各プログラムを--no-loop-optと最適化ありでコンパイルし、両方のバックエンドで
+# 実行時間 (3回のうち最短) を比べる。終了コードが一致することも確かめる。
+#
+#   usage: bench/loop_bench.sh [path/to/9cc] [--unroll <n> などの追加オプション...]
+#
+#   sum_mul     誘導変数の積と不変式を含む二重ループ
+#   matrix      添字から要素を作る、行列の積の形をした4重ループ
+#   countdown   減っていくループと、回数が定数の内側のループ
+#   poly        条件に不変式を含むwhileと、多項式の評価
+#   calls       関数呼び出しを含む、回数が定数の内側のループ
+
+cd "$(dirname "$0")/.."
+cc9=${1:-./9cc}
+shift || true
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# 3回実行して最短の時間をミリ秒で出力する。終了コードは$tmp/statusに書く
+run() {
+    best=
+    for _ in 1 2 3; do
+        start=$(date +%s%N)
+        set +e
+        "$1"
+        echo $? >"$tmp/status"
+        set -e
+        ms=$((($(date +%s%N) - start) / 1000000))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+            best=$ms
+        fi
+    done
+    echo "$best"
+}
+
+printf '%-12s %-9s %10s %10s %8s\n' program backend "off (ms)" "on (ms)" speedup
+for src in bench/loops/*.c; do
+    name=$(basename "$src" .c)
+    for backend in stack regalloc; do
+        flags=()
+        if [ "$backend" = regalloc ]; then
+            flags=(--regalloc)
+        fi
+        "$cc9" "${flags[@]}" --no-loop-opt -o "$tmp/off.s" "$src"
+        "$cc9" "${flags[@]}" "$@" -o "$tmp/on.s" "$src"
+        cc -static -o "$tmp/off" "$tmp/off.s"
+        cc -static -o "$tmp/on" "$tmp/on.s"
+
+        off=$(run "$tmp/off")
+        off_status=$(cat "$tmp/status")
+        on=$(run "$tmp/on")
+        on_status=$(cat "$tmp/status")
+        if [ "$off_status" != "$on_status" ]; then
+            echo "$name ($backend): exit status $off_status without loop optimizations, but $on_status with them"
+            exit 1
+        fi
+        awk -v n="$name" -v b="$backend" -v off="$off" -v on="$on" \
+            'BEGIN { printf "%-12s %-9s %10d %10d %7.2fx\n", n, b, off, on, off / (on ? on : 1) }'
+    done
+done
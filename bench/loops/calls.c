@@ -0,0 +1,12 @@
+f(x, y) { return x * 3 + y; }
+
+main() {
+    s = 0;
+    for (i = 0; i < 8000000; i = i + 1) {
+        for (j = 0; j < 4; j = j + 1) {
+            s = f(s, j * 2) - s * 2;
+        }
+        if (s > 1000000) s = s - 1000000;
+    }
+    return s - s / 256 * 256;
+}
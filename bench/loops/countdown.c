@@ -0,0 +1,10 @@
+main() {
+    x = 1;
+    for (i = 30000000; 0 < i; i = i - 1) {
+        for (j = 0; j < 3; j = j + 1) {
+            x = x + j;
+        }
+        if (x > 1000000) x = x - 1000000;
+    }
+    return x - x / 256 * 256;
+}
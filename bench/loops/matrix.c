@@ -0,0 +1,14 @@
+main() {
+    w = 64;
+    acc = 0;
+    for (rep = 0; rep < 40; rep = rep + 1) {
+        for (i = 0; i < 64; i = i + 1) {
+            for (j = 0; j < 64; j = j + 1) {
+                for (k = 0; k < 64; k = k + 1) {
+                    acc = acc + (i * w + k) * (k * w + j);
+                }
+            }
+        }
+    }
+    return acc - acc / 256 * 256;
+}
@@ -0,0 +1,12 @@
+main() {
+    a = 3;
+    b = 5;
+    s = 0;
+    t = 0;
+    while (t < a * b * 1000000) {
+        s = s + t * t * a + t * b + a * b;
+        if (s > 100000000) s = s - 100000000;
+        t = t + 1;
+    }
+    return s - s / 256 * 256;
+}
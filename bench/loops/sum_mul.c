@@ -0,0 +1,11 @@
+main() {
+    s = 0;
+    n = 7;
+    for (r = 0; r < 2000000; r = r + 1) {
+        for (i = 0; i < 16; i = i + 1) {
+            s = s + i * n + (n * 3 - 1);
+        }
+        s = s - r * 5;
+    }
+    return s - s / 256 * 256;
+}
@@ -0,0 +1,160 @@
+// tokenize()のスループットを、文字分類表+SIMD版と以前の実装とで比較する。
+//
+//   usage: tokenize_bench [megabytes]   (デフォルトは16MB)
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../9cc.h"
+
+Token *new_token(const TokenKind kind, Token *cur, char *str, const int32_t len);
+
+// 以前のtokenize()の実装
+static bool legacy_startswith(const char *s1, const char *s2) { return strncmp(s1, s2, strlen(s2)) == 0; }
+
+static bool legacy_is_ident1(const char c) { return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_'; }
+
+static bool legacy_is_ident2(const char c) { return legacy_is_ident1(c) || ('0' <= c && c <= '9'); }
+
+static bool legacy_consume_keyword_token(char **p, Token **cur) {
+    char keywords[][6] = {"return", "if", "else", "while", "for"};
+    TokenKind keywords_token[] = {TK_RETURN, TK_IF, TK_ELSE, TK_WHILE, TK_FOR};
+    int keywords_size[] = {6, 2, 4, 5, 3};
+    int num_keywords = sizeof(keywords_size) / sizeof(int);
+    for (int i = 0; i < num_keywords; i++) {
+        int keyword_len = keywords_size[i];
+        if (strncmp(*p, keywords[i], keyword_len) == 0 && !isalnum((*p)[keyword_len])) {
+            *cur = new_token(keywords_token[i], *cur, *p, keyword_len);
+            *p += keyword_len;
+            return true;
+        }
+    }
+    return false;
+}
+
+static Token *legacy_tokenize(char *p) {
+    Token head;
+    head.next = NULL;
+    Token *cur = &head;
+
+    while (*p) {
+        if (isspace(*p)) {
+            p++;
+            continue;
+        }
+        if (legacy_startswith(p, "==") || legacy_startswith(p, "!=") || legacy_startswith(p, "<=") ||
+            legacy_startswith(p, ">=")) {
+            cur = new_token(TK_RESERVED, cur, p, 2);
+            p += 2;
+            continue;
+        }
+        if (strchr("+-*/()<>;={},&", *p)) {
+            cur = new_token(TK_RESERVED, cur, p++, 1);
+            continue;
+        }
+        if (legacy_consume_keyword_token(&p, &cur)) {
+            continue;
+        }
+        if (legacy_is_ident1(*p)) {
+            char *start = p;
+            do {
+                p++;
+            } while (legacy_is_ident2(*p));
+            cur = new_token(TK_IDENT, cur, start, p - start);
+            continue;
+        }
+        if (isdigit(*p)) {
+            cur = new_token(TK_NUM, cur, p, 0);
+            char *start = p;
+            cur->val = strtol(p, &p, 10);
+            cur->len = p - start;
+            continue;
+        }
+        fprintf(stderr, "cannot tokenize: %.10s\n", p);
+        exit(1);
+    }
+    new_token(TK_EOF, cur, p, 0);
+    return head.next;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *generate_source(size_t size) {
+    static const char *lines[] = {
+        "    accumulated_value = accumulated_value + coefficient_table_index * 12345;\n",
+        "    if (loop_counter_variable <= upper_bound_limit) return helper_function(a, b, 42);\n",
+        "    while (remaining_iterations != 0) remaining_iterations = remaining_iterations - 1;\n",
+        "        for (i = 0; i < 1000000; i = i + 1) { total = total + i * i; }\n",
+        "\n",
+    };
+    char *buf = malloc(size + 128);
+    size_t len = 0;
+    for (int i = 0; len < size; i++) {
+        const char *line = lines[i % 5];
+        size_t n = strlen(line);
+        memcpy(buf + len, line, n);
+        len += n;
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+static size_t count_tokens(Token *tok) {
+    size_t n = 0;
+    for (; tok; tok = tok->next) n++;
+    return n;
+}
+
+int main(int argc, char **argv) {
+    size_t mb = argc > 1 ? (size_t)atol(argv[1]) : 16;
+    char *src = generate_source(mb << 20);
+    size_t len = strlen(src);
+    set_user_input("<bench>", src);
+
+    // 同じトークン列になることを確認する
+    Token *a = tokenize(src);
+    Token *b = legacy_tokenize(src);
+    for (; a && b; a = a->next, b = b->next) {
+        if (a->kind != b->kind || a->len != b->len || a->str != b->str || a->val != b->val) {
+            fprintf(stderr, "token mismatch at offset %td\n", a->str - src);
+            return 1;
+        }
+    }
+    if (a || b) {
+        fprintf(stderr, "token count mismatch\n");
+        return 1;
+    }
+    arena_free_all();
+
+    const int iters = 5;
+    double best_new = 1e9;
+    double best_legacy = 1e9;
+    size_t ntokens = 0;
+    for (int i = 0; i < iters; i++) {
+        double t0 = now();
+        ntokens = count_tokens(legacy_tokenize(src));
+        double t1 = now();
+        arena_free_all();
+        double t2 = now();
+        tokenize(src);
+        double t3 = now();
+        arena_free_all();
+        if (t1 - t0 < best_legacy) best_legacy = t1 - t0;
+        if (t3 - t2 < best_new) best_new = t3 - t2;
+    }
+
+    double mbytes = len / (1024.0 * 1024.0);
+    printf("input:   %.1f MB, %zu tokens\n", mbytes, ntokens);
+    printf("legacy:  %8.1f MB/s\n", mbytes / best_legacy);
+    printf("current: %8.1f MB/s (%.2fx)\n", mbytes / best_new, best_legacy / best_new);
+    return 0;
+}
@@ -0,0 +1,298 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "9cc.h"
+
+// コンパイル結果のディスク上のキャッシュ (--cache <dir>)。
+//
+// キーはソースのバイト列、コンパイラの実行ファイル、出力を変えるオプションの
+// 128ビットFNV-1aハッシュで、エントリは<dir>/<キーの16進>.sにアセンブリを
+// そのまま置く。当たればトークナイズからコード生成までを飛ばし、エントリを
+// sendfile(2)で出力にコピーする。外れたらキャッシュのディレクトリの一時ファイルに
+// 生成してからrename(2)で置くので、並行するビルドが書きかけのエントリを読むことはない。
+//
+// エントリの更新時刻を最後に使った時刻とし、当たるたびに更新する。新しいエントリを
+// 置いた後でcache_evict()を呼ぶと、合計が上限を超えた分を古いものから消す。
+// --incrementalの関数ごとのエントリ (incremental.c) も同じディレクトリに置く。
+
+#define FNV128_PRIME (((Hash128)1 << 88) | 0x13b)
+
+// 書きかけのまま残った一時ファイルは、これより古ければ消す
+#define STALE_TMP_SEC 3600
+
+static atomic_int_fast64_t s_hits;
+static atomic_int_fast64_t s_misses;
+
+// hにpのnバイトを足したFNV-1aハッシュ
+Hash128 hash128(Hash128 h, const void *p, size_t n) {
+    const uint8_t *s = p;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ s[i]) * FNV128_PRIME;
+    }
+    return h;
+}
+
+// コンパイラの実行ファイルと、optsのうち出力を変えるものをhに足す。
+// コンパイラを作り直せば実行ファイルの大きさか更新時刻が変わり、キーも変わる。
+// コード生成のスレッド数は出力を変えないのでキーに含めない
+Hash128 hash_options(Hash128 h, const CompileOptions *opts) {
+    struct stat st = {};
+    stat("/proc/self/exe", &st);
+    char buf[256];
+    int n = snprintf(buf, sizeof(buf),
+                     "9cc %lld %lld.%09ld regalloc=%d comments=%d loop_opt=%d unroll=%d inline=%d peephole=%d "
+                     "tail_calls=%d\n",
+                     (long long)st.st_size, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, opts->regalloc,
+                     opts->asm_comments, opts->loop_opt, opts->unroll, opts->inline_budget, opts->peephole,
+                     opts->tail_calls);
+    return hash128(h, buf, n);
+}
+
+CacheKey cache_key_of(Hash128 h) {
+    CacheKey key;
+    snprintf(key.name, sizeof(key.name), "%016llx%016llx", (unsigned long long)(h >> 64), (unsigned long long)h);
+    return key;
+}
+
+CacheKey cache_key(const char *src, size_t len, const CompileOptions *opts) {
+    return cache_key_of(hash128(hash_options(HASH128_INIT, opts), src, len));
+}
+
+// in_fdのoffsetからsizeバイトをout_fdに書く。sendfile(2)を使えない出力ならread/writeでコピーする
+static bool copy_fd(int in_fd, int out_fd, size_t size) {
+    off_t offset = 0;
+    while ((size_t)offset < size) {
+        ssize_t n = sendfile(out_fd, in_fd, &offset, size - offset);
+        if (n > 0) {
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            break;
+        }
+        return false;
+    }
+    char buf[64 * 1024];
+    while ((size_t)offset < size) {
+        ssize_t n = pread(in_fd, buf, sizeof(buf), offset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        for (ssize_t w = 0; w < n;) {
+            ssize_t m = write(out_fd, buf + w, n - w);
+            if (m < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                error("cache: write failed: %s", strerror(errno));
+            }
+            w += m;
+        }
+        offset += n;
+    }
+    return true;
+}
+
+static void entry_path(char *path, const char *dir, const CacheKey *key) {
+    snprintf(path, PATH_MAX, "%s/%s.s", dir, key->name);
+}
+
+// エントリを開いてfdを返し、大きさを*sizeに入れる。なければ-1を返す
+static int open_entry(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    // クラッシュで中身が書かれなかったエントリは空になりうる。空のアセンブリは出力しないので外れとする
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    // 最後に使った時刻を更新する。他のユーザーのエントリなら更新できなくてもよい
+    futimens(fd, NULL);
+    *size = st.st_size;
+    return fd;
+}
+
+// 当たればエントリをout_fdに書き、そのバイト数を*bytesに入れて真を返す
+bool cache_fetch(const char *dir, const CacheKey *key, int out_fd, size_t *bytes) {
+    char path[PATH_MAX];
+    entry_path(path, dir, key);
+    int fd = open_entry(path, bytes);
+    if (fd < 0) {
+        s_misses++;
+        return false;
+    }
+    bool ok = copy_fd(fd, out_fd, *bytes);
+    close(fd);
+    if (!ok) {
+        error("cache: %s を書き出せません: %s", path, strerror(errno));
+    }
+    s_hits++;
+    return true;
+}
+
+// エントリをmmapして返す。なければNULLを返す。マップした後でエントリが
+// 消されても中身は読めるので、全て読み終えてからcache_unmap()すればよい
+char *cache_map(const char *dir, const CacheKey *key, size_t *size) {
+    char path[PATH_MAX];
+    entry_path(path, dir, key);
+    int fd = open_entry(path, size);
+    if (fd < 0) {
+        return NULL;
+    }
+    char *p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+void cache_unmap(char *p, size_t size) { munmap(p, size); }
+
+// エントリを書く一時ファイルを作ってfdを返し、名前をtmp_pathに入れる。
+// キャッシュのディレクトリを使えなければ-1を返す
+int cache_create(const char *dir, char *tmp_path) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    snprintf(tmp_path, PATH_MAX, "%s/.tmp.XXXXXX", dir);
+    int fd = mkstemp(tmp_path);
+    if (fd >= 0) {
+        fchmod(fd, 0644);
+    }
+    return fd;
+}
+
+typedef struct {
+    char *name;
+    off_t size;
+    struct timespec mtime;
+} Entry;
+
+static int compare_mtime(const void *a, const void *b) {
+    const Entry *x = a;
+    const Entry *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec) {
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    }
+    return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : x->mtime.tv_nsec > y->mtime.tv_nsec;
+}
+
+// 合計がmax_bytesを超えていれば、最後に使った時刻の古いエントリから消す。
+// 同時に消しているプロセスがあってもよいように、消せなかったエントリは無視する
+void cache_evict(const char *dir, size_t max_bytes) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+    Entry *entries = NULL;
+    int32_t n = 0;
+    int32_t cap = 0;
+    size_t total = 0;
+    time_t now = time(NULL);
+    char path[PATH_MAX];
+    for (struct dirent *de; (de = readdir(d));) {
+        bool tmp = !strncmp(de->d_name, ".tmp.", 5);
+        size_t len = strlen(de->d_name);
+        if (!tmp && (len != sizeof(((CacheKey *)0)->name) + 1 || strcmp(de->d_name + len - 2, ".s"))) {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(dirfd(d), de->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (tmp) {
+            if (now - st.st_mtim.tv_sec > STALE_TMP_SEC) {
+                snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+                unlink(path);
+            }
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            entries = realloc(entries, sizeof(Entry) * cap);
+        }
+        entries[n++] = (Entry){strdup(de->d_name), st.st_size, st.st_mtim};
+        total += st.st_size;
+    }
+    closedir(d);
+
+    if (total > max_bytes) {
+        qsort(entries, n, sizeof(Entry), compare_mtime);
+        for (int32_t i = 0; i < n && total > max_bytes; i++) {
+            snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+            if (unlink(path) == 0) {
+                total -= entries[i].size;
+            }
+        }
+    }
+    for (int32_t i = 0; i < n; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+// cache_create()の一時ファイルに生成し終えたアセンブリをエントリとして置き、out_fdに書く。
+// fdは閉じる
+void cache_commit(const char *dir, const CacheKey *key, int fd, const char *tmp_path, int out_fd) {
+    char path[PATH_MAX];
+    entry_path(path, dir, key);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !copy_fd(fd, out_fd, st.st_size)) {
+        error("cache: %s を書き出せません: %s", tmp_path, strerror(errno));
+    }
+    close(fd);
+    // 同じキーなら中身も同じなので、並行するビルドのエントリを置き換えてよい
+    if (rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+    }
+}
+
+// dataのlenバイトをエントリとして置く。置けなければ何もしない
+void cache_store(const char *dir, const CacheKey *key, const char *data, size_t len) {
+    char tmp_path[PATH_MAX];
+    int fd = cache_create(dir, tmp_path);
+    if (fd < 0) {
+        return;
+    }
+    for (size_t w = 0; w < len;) {
+        ssize_t n = write(fd, data + w, len - w);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            unlink(tmp_path);
+            return;
+        }
+        w += n;
+    }
+    close(fd);
+    char path[PATH_MAX];
+    entry_path(path, dir, key);
+    if (rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+    }
+}
+
+void cache_counts(int64_t *hits, int64_t *misses) {
+    *hits = s_hits;
+    *misses = s_misses;
+}
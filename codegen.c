@@ -3,27 +3,160 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "9cc.h"
 
-static char *argreg[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+static Reg argreg[] = {REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9};
+static const char *reg_str[] = {
+    [REG_RAX] = "rax", [REG_RDI] = "rdi", [REG_RSI] = "rsi", [REG_RDX] = "rdx", [REG_RCX] = "rcx",
+    [REG_R8] = "r8",   [REG_R9] = "r9",   [REG_RBP] = "rbp", [REG_RSP] = "rsp", [REG_AL] = "al",
+};
 
-static int s_depth;
-static Function *s_current_fn;
+// 飛び先がまだ決まっていないジャンプの列。先頭のジャンプの添字で表し、空なら-1。
+// 各ジャンプのdst.valに次のジャンプの添字を入れてつなぎ、飛び先のラベルを
+// 出すときにpatch_jumps()でまとめて埋める。&&や||は列をつなげれば作れる
+typedef int32_t JumpList;
 
-static void push(void) {
-    s_depth++;
-    printf("  push rax # size: %d\n", s_depth);
+#define NO_JUMPS (-1)
+
+// 式の評価の途中。子を評価するときは子のフレームを積んでいったん抜け、
+// 子が終わったらstepの段階から続ける
+typedef struct {
+    const Node *node;
+    const Node *arg;  // ND_FUNCALL: 次に評価する引数
+    int32_t step;
+    int32_t nargs;  // ND_FUNCALL: 評価した引数の数
+    bool lval;      // 値ではなくアドレスをraxに入れる
+} GenFrame;
+
+// 関数1つ分のコード生成の状態。関数ごとに別スレッドで生成できるよう、大域変数に置かない
+typedef struct {
+    Function *fn;
+    const CompileOptions *opts;
+    int depth;  // スタックに積んだ値の数
+    int label;  // ラベルの通し番号。関数ごとに1から振る
+    JumpList *ret_jumps;  // インライン展開した本体の中ならreturnのジャンプの列
+    bool self_tail;       // 関数の先頭へ戻る末尾呼び出しを出した
+
+    // 関数本体の命令列。のぞき穴最適化をかけてから出力する
+    Insn *insns;
+    int32_t ninsns;
+    int32_t cap;
+
+    // コメントは最適化の邪魔にならないよう別の列に置き、seqが同じ命令の前に出す
+    bool comments;
+    Insn *notes;
+    int32_t nnotes;
+    int32_t notes_cap;
+    int32_t seq;  // 次に追加する命令の通し番号
+
+    // 式の評価のスタック。深い式でもCのスタックを使い切らない
+    GenFrame *frames;
+    int32_t nframes;
+    int32_t frames_cap;
+} GenCtx;
+
+static Operand reg(Reg r) { return (Operand){OPND_REG, r, 0, NULL}; }
+static Operand imm(int64_t val) { return (Operand){OPND_IMM, REG_RAX, val, NULL}; }
+static Operand mem(Reg base, int64_t disp) { return (Operand){OPND_MEM, base, disp, NULL}; }
+static Operand label(const char *name, int64_t id) { return (Operand){OPND_LABEL, REG_RAX, id, name}; }
+static const Operand none;
+
+// 命令列とコメント列はスレッドごとにアリーナ上に置き、関数をまたいで使い回す。
+// 関数ごとにmallocすると大きな関数でmmapと解放を繰り返して遅い
+static _Thread_local Insn *s_insns;
+static _Thread_local int32_t s_insns_cap;
+static _Thread_local Insn *s_notes;
+static _Thread_local int32_t s_notes_cap;
+static _Thread_local GenFrame *s_frames;
+static _Thread_local int32_t s_frames_cap;
+static _Thread_local uint64_t s_generation;
+
+// 列の末尾に空きを1つ作って返す
+static Insn *append(Insn **list, int32_t *len, int32_t *cap) {
+    if (*len == *cap) {
+        *cap = *cap ? *cap * 2 : 1024;
+        Insn *p = arena_alloc(sizeof(Insn) * *cap);
+        if (*len > 0) {
+            memcpy(p, *list, sizeof(Insn) * *len);
+        }
+        *list = p;
+    }
+    return &(*list)[(*len)++];
 }
 
-static void pop(char *arg) {
-    s_depth--;
-    printf("  pop %s # size: %d\n", arg, s_depth);
+static Insn *add_insn(GenCtx *ctx, InsnOp op, Operand dst, Operand src) {
+    Insn *in = append(&ctx->insns, &ctx->ninsns, &ctx->cap);
+    in->op = op;
+    in->dst = dst;
+    in->src = src;
+    in->text = NULL;
+    in->seq = ctx->seq++;
+    return in;
 }
 
-int count(void) {
-    static int i = 1;
-    return i++;
+static Insn *add_note(GenCtx *ctx, const char *fmt) {
+    Insn *in = append(&ctx->notes, &ctx->nnotes, &ctx->notes_cap);
+    in->op = I_COMMENT;
+    in->dst = none;
+    in->text = fmt;
+    in->name = NULL;
+    in->seq = ctx->seq;
+    return in;
+}
+
+static void ins1(GenCtx *ctx, InsnOp op, Operand dst) { add_insn(ctx, op, dst, none); }
+static void ins2(GenCtx *ctx, InsnOp op, Operand dst, Operand src) { add_insn(ctx, op, dst, src); }
+
+// コメント。fmtはemitf()の書式で、引数は%sか%dを1つまで取る
+static void comment(GenCtx *ctx, const char *fmt) {
+    if (ctx->comments) {
+        add_note(ctx, fmt);
+    }
+}
+
+static void comment_s(GenCtx *ctx, const char *fmt, const char *arg) {
+    if (ctx->comments) {
+        add_note(ctx, fmt)->name = arg;
+    }
+}
+
+static void comment_d(GenCtx *ctx, const char *fmt, int arg) {
+    if (ctx->comments) {
+        add_note(ctx, fmt)->dst = imm(arg);
+    }
+}
+
+static void push(GenCtx *ctx) {
+    ctx->depth++;
+    add_insn(ctx, I_PUSH, reg(REG_RAX), none)->depth = ctx->depth;
+}
+
+static void pop(GenCtx *ctx, Reg r) {
+    ctx->depth--;
+    add_insn(ctx, I_POP, reg(r), none)->depth = ctx->depth;
+}
+
+static int count(GenCtx *ctx) { return ++ctx->label; }
+
+static void add_jump(GenCtx *ctx, InsnOp op, JumpList *list) {
+    add_insn(ctx, op, (Operand){.kind = OPND_NONE, .val = *list}, none);
+    *list = ctx->ninsns - 1;
+}
+
+static void patch_jumps(GenCtx *ctx, JumpList list, Operand target) {
+    while (list != NO_JUMPS) {
+        Insn *in = &ctx->insns[list];
+        list = in->dst.val;
+        in->dst = target;
+    }
+}
+
+// ラベルを置き、そこへ飛ぶジャンプの飛び先を埋める
+static void place_label(GenCtx *ctx, Operand target, JumpList list) {
+    patch_jumps(ctx, list, target);
+    ins1(ctx, I_LABEL, target);
 }
 
 // エラーを報告するための関数
@@ -31,281 +164,649 @@ int count(void) {
 void error(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    FILE *out = error_stream();
+    vfprintf(out, fmt, ap);
+    fprintf(out, "\n");
+    va_end(ap);
+    error_exit();
+}
+static void gen_expr(GenCtx *ctx, const Node *node);
+static void gen_stmt(GenCtx *ctx, const Node *node);
+
+// 引数を左から評価してスタックに積み、その個数を返す
+static int gen_args(GenCtx *ctx, const Node *node) {
+    int nargs = 0;
+    comment_s(ctx, "#   args %s {\n", node->symbolname);
+    for (Node *n = node->args; n; n = n->next) {
+        comment_d(ctx, "#   gen arg id %d {\n", nargs + 1);
+        gen_expr(ctx, n);
+        push(ctx);
+        nargs++;
+        comment_d(ctx, "#   } gen arg id %d\n", nargs + 1);
+    }
+    return nargs;
+}
+
+// return f(...)。自分自身なら引数を仮引数の領域に書いて本体の先頭へ戻り、
+// そうでなければ引数をレジスタに入れ、フレームを片付けてから飛ぶ
+static void gen_tail_call(GenCtx *ctx, const Node *node, TailCall kind) {
+    comment_s(ctx, "# tail call %s {\n", node->symbolname);
+    int nargs = gen_args(ctx, node);
+    if (kind == TAIL_SELF) {
+        LVar *params[6];
+        int i = 0;
+        for (LVar *var = ctx->fn->params; var; var = var->next) {
+            params[i++] = var;
+        }
+        for (i = nargs - 1; i >= 0; i--) {
+            pop(ctx, REG_RAX);
+            ins2(ctx, I_MOV, mem(REG_RBP, -params[i]->offset), reg(REG_RAX));
+        }
+        ins1(ctx, I_JMP, label("body", 0));
+        ctx->self_tail = true;
+    } else {
+        for (int i = nargs - 1; i >= 0; i--) {
+            pop(ctx, argreg[i]);
+        }
+        ins2(ctx, I_MOV, reg(REG_RSP), reg(REG_RBP));
+        add_insn(ctx, I_POP, reg(REG_RBP), none)->depth = ctx->depth;
+        ins2(ctx, I_MOV, reg(REG_RAX), imm(0));
+        add_insn(ctx, I_TAILJMP, none, none)->text = node->symbolname;
+    }
+    comment_s(ctx, "#   } args %s\n", node->symbolname);
+    comment_s(ctx, "# } tail call %s\n", node->symbolname);
+}
+
+// 二項演算の左辺をrax、右辺をrdiに入れる
+static void gen_operands(GenCtx *ctx, const Node *node) {
+    gen_expr(ctx, node->lhs);
+    push(ctx);
+    gen_expr(ctx, node->rhs);
+    ins2(ctx, I_MOV, reg(REG_RDI), reg(REG_RAX));
+    pop(ctx, REG_RAX);
+}
+
+// 比較の結果がsenseのときに飛ぶ条件ジャンプ
+static InsnOp jcc(NodeKind kind, bool sense) {
+    switch (kind) {
+        case ND_EQ:
+            return sense ? I_JE : I_JNE;
+        case ND_NE:
+            return sense ? I_JNE : I_JE;
+        case ND_LT:
+            return sense ? I_JL : I_JGE;
+        case ND_LE:
+            return sense ? I_JLE : I_JG;
+        default:
+            error("cannot be reached : %s (%d)", __FILE__, __LINE__);
+            return I_JMP;
+    }
 }
-void gen(const Node *node);
 
-void gen_lval_addr(const Node *node) {
-    if (node->kind != ND_LVAR && node->kind != ND_DEREF) {
+// 条件nodeの真偽がsenseと一致したら飛ぶジャンプを出してjumpsにつなぎ、そうでなければ次へ進む。
+// 比較はsetccで0/1にせず、cmpのフラグで直接分岐する
+static void gen_branch(GenCtx *ctx, const Node *node, bool sense, JumpList *jumps) {
+    switch (node->kind) {
+        case ND_NUM:
+            if ((node->val != 0) == sense) {
+                add_jump(ctx, I_JMP, jumps);
+            }
+            return;
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE:
+            gen_operands(ctx, node);
+            ins2(ctx, I_CMP, reg(REG_RAX), reg(REG_RDI));
+            add_jump(ctx, jcc(node->kind, sense), jumps);
+            return;
+        default:
+            gen_expr(ctx, node);
+            ins2(ctx, I_CMP, reg(REG_RAX), imm(0));
+            add_jump(ctx, sense ? I_JNE : I_JE, jumps);
+            return;
     }
-    char *debug_name = node->symbolname ? node->symbolname : "deref";
-    printf("# left val %s{\n", debug_name);
+}
+
+// 二項演算。左辺をrax、右辺をrdiに入れてある
+static void gen_binary(GenCtx *ctx, const Node *node) {
     switch (node->kind) {
-        case ND_LVAR:
-            printf("  lea rax, [rbp-%d]\n", node->offset);
+        case ND_ADD:
+            ins2(ctx, I_ADD, reg(REG_RAX), reg(REG_RDI));
             break;
-        case ND_DEREF:
-            gen(node->lhs);
+        case ND_SUB:
+            ins2(ctx, I_SUB, reg(REG_RAX), reg(REG_RDI));
+            break;
+        case ND_MUL:
+            ins2(ctx, I_IMUL, reg(REG_RAX), reg(REG_RDI));
+            break;
+        case ND_DIV:
+            ins1(ctx, I_CQO, none);
+            ins1(ctx, I_IDIV, reg(REG_RDI));
             break;
+        case ND_EQ:
+            comment(ctx, "# == {\n");
+            ins2(ctx, I_CMP, reg(REG_RAX), reg(REG_RDI));
+            ins1(ctx, I_SETE, reg(REG_AL));
+            ins2(ctx, I_MOVZB, reg(REG_RAX), reg(REG_AL));
+            comment(ctx, "# } ==\n");
+            break;
+        case ND_NE:
+            comment(ctx, "# != {\n");
+            ins2(ctx, I_CMP, reg(REG_RAX), reg(REG_RDI));
+            ins1(ctx, I_SETNE, reg(REG_AL));
+            ins2(ctx, I_MOVZB, reg(REG_RAX), reg(REG_AL));
+            comment(ctx, "# != }\n");
+            break;
+        case ND_LT:
+            comment(ctx, "# < {\n");
+            ins2(ctx, I_CMP, reg(REG_RAX), reg(REG_RDI));
+            ins1(ctx, I_SETL, reg(REG_AL));
+            ins2(ctx, I_MOVZB, reg(REG_RAX), reg(REG_AL));
+            comment(ctx, "# } <\n");
+            break;
+        case ND_LE:
+            comment(ctx, "# <= {\n");
+            ins2(ctx, I_CMP, reg(REG_RAX), reg(REG_RDI));
+            ins1(ctx, I_SETLE, reg(REG_AL));
+            ins2(ctx, I_MOVZB, reg(REG_RAX), reg(REG_AL));
+            comment(ctx, "# <= {\n");
+            break;
+        default:
+            error("cannot be reached : %s (%d)", __FILE__, __LINE__);
+    }
+}
+
+static GenFrame *push_frame(GenCtx *ctx, const Node *node, bool lval) {
+    if (ctx->nframes == ctx->frames_cap) {
+        ctx->frames_cap = ctx->frames_cap ? ctx->frames_cap * 2 : 256;
+        GenFrame *p = arena_alloc(sizeof(GenFrame) * ctx->frames_cap);
+        if (ctx->nframes > 0) {
+            memcpy(p, ctx->frames, sizeof(GenFrame) * ctx->nframes);
+        }
+        ctx->frames = p;
+    }
+    GenFrame *f = &ctx->frames[ctx->nframes++];
+    *f = (GenFrame){.node = node, .lval = lval};
+    return f;
+}
+
+static void gen_var_addr(GenCtx *ctx, const LVar *var) {
+    comment_s(ctx, "# left val %s{\n", var->name);
+    ins2(ctx, I_LEA, reg(REG_RAX), mem(REG_RBP, -var->offset));
+    comment_s(ctx, "# } left val %s\n", var->name);
+}
+
+// 代入の左辺のアドレスを求める段階を1つ進め、終わったら真を返す
+static bool gen_addr_step(GenCtx *ctx, GenFrame *f, int32_t step) {
+    const Node *node = f->node;
+    switch (node->kind) {
+        case ND_LVAR:
+            gen_var_addr(ctx, node->lvar);
+            return true;
+        case ND_DEREF:
+            if (step == 0) {
+                comment_s(ctx, "# left val %s{\n", "deref");
+                push_frame(ctx, node->lhs, false);
+                return false;
+            }
+            comment_s(ctx, "# } left val %s\n", "deref");
+            return true;
         default:
             error("代入の左辺値が変数でもDEREFでもありません: %d", node->kind);
-            break;
+            return true;
     }
-    printf("# } left val %s\n", debug_name);
 }
 
-void gen(const Node *node) {
-    if (node == NULL) {
-        error("node is NULL");
+// 式の評価を1段階進め、終わったら真を返す。子のフレームを積んだらfはもう使えない
+static bool gen_step(GenCtx *ctx, GenFrame *f) {
+    const Node *node = f->node;
+    int32_t step = f->step++;
+    if (f->lval) {
+        return gen_addr_step(ctx, f, step);
     }
     switch (node->kind) {
         case ND_NUM:
-            printf("  mov rax, %d\n", node->val);
-            return;
+            ins2(ctx, I_MOV, reg(REG_RAX), imm(node->val));
+            return true;
         case ND_ADDR:
-            printf("# addr {\n");
-            gen_lval_addr(node->lhs);
-            printf("# } addr\n");
-            return;
+            if (step == 0) {
+                comment(ctx, "# addr {\n");
+                push_frame(ctx, node->lhs, true);
+                return false;
+            }
+            comment(ctx, "# } addr\n");
+            return true;
         case ND_DEREF:
-            printf("# deref {\n");
-            gen(node->lhs);
-            printf("  mov rax, [rax]\n");
-            printf("# } deref\n");
-            return;
+            if (step == 0) {
+                comment(ctx, "# deref {\n");
+                push_frame(ctx, node->lhs, false);
+                return false;
+            }
+            ins2(ctx, I_MOV, reg(REG_RAX), mem(REG_RAX, 0));
+            comment(ctx, "# } deref\n");
+            return true;
         case ND_LVAR:
-            printf("# local var %s {\n", node->symbolname);
-            gen_lval_addr(node);
-            printf("  mov rax, [rax]\n");
-            printf("# } local var %s\n", node->symbolname);
-            return;
+            comment_s(ctx, "# local var %s {\n", node->lvar->name);
+            gen_var_addr(ctx, node->lvar);
+            ins2(ctx, I_MOV, reg(REG_RAX), mem(REG_RAX, 0));
+            comment_s(ctx, "# } local var %s\n", node->lvar->name);
+            return true;
         case ND_FUNCALL:
-            printf("# func %s {\n", node->symbolname);
-            int nargs = 0;
-            printf("#   args %s {\n", node->symbolname);
-            for (Node *n = node->args; n; n = n->next) {
-                printf("#   gen arg id %d {\n", nargs + 1);
-                gen(n);
-                push();
-                nargs++;
-                printf("#   } gen arg id %d\n", nargs + 1);
+            // 引数を1つずつ評価して積み、最後にレジスタに下ろして呼ぶ
+            if (step == 0) {
+                comment_s(ctx, "# func %s {\n", node->symbolname);
+                comment_s(ctx, "#   args %s {\n", node->symbolname);
+                f->arg = node->args;
+            } else {
+                push(ctx);
+                f->nargs++;
+                comment_d(ctx, "#   } gen arg id %d\n", f->nargs + 1);
             }
-            for (int i = nargs - 1; i >= 0; i--) {
-                printf("#   push arg id %d {\n", i + 1);
-                pop(argreg[i]);
-                printf("#   } push arg id %d\n", i + 1);
+            if (f->arg) {
+                const Node *arg = f->arg;
+                f->arg = arg->next;
+                comment_d(ctx, "#   gen arg id %d {\n", f->nargs + 1);
+                push_frame(ctx, arg, false);
+                return false;
             }
-
-            printf("#   } args %s\n", node->symbolname);
-            printf("  mov rax, 0\n");
-            printf("  call %s\n", node->symbolname);
-            printf("# } func %s\n", node->symbolname);
-            return;
+            for (int i = f->nargs - 1; i >= 0; i--) {
+                comment_d(ctx, "#   push arg id %d {\n", i + 1);
+                pop(ctx, argreg[i]);
+                comment_d(ctx, "#   } push arg id %d\n", i + 1);
+            }
+            comment_s(ctx, "#   } args %s\n", node->symbolname);
+            ins2(ctx, I_MOV, reg(REG_RAX), imm(0));
+            add_insn(ctx, I_CALL, none, none)->text = node->symbolname;
+            comment_s(ctx, "# } func %s\n", node->symbolname);
+            return true;
         case ND_ASSIGN:
-            printf("# assign {\n");
-            gen_lval_addr(node->lhs);
-            push();
-            gen(node->rhs);
-            pop("rdi");
-            printf("  mov [rdi], rax\n");
-            printf("# } assign\n");
-            return;
+            switch (step) {
+                case 0:
+                    comment(ctx, "# assign {\n");
+                    push_frame(ctx, node->lhs, true);
+                    return false;
+                case 1:
+                    push(ctx);
+                    push_frame(ctx, node->rhs, false);
+                    return false;
+                default:
+                    pop(ctx, REG_RDI);
+                    ins2(ctx, I_MOV, mem(REG_RDI, 0), reg(REG_RAX));
+                    comment(ctx, "# } assign\n");
+                    return true;
+            }
+        case ND_SHL:
+            if (step == 0) {
+                push_frame(ctx, node->lhs, false);
+                return false;
+            }
+            ins2(ctx, I_SHL, reg(REG_RAX), imm(node->val));
+            return true;
+        case ND_SAR:
+            if (step == 0) {
+                push_frame(ctx, node->lhs, false);
+                return false;
+            }
+            // 負数は2^val-1を足してから右シフトし、0方向に丸める
+            ins2(ctx, I_MOV, reg(REG_RDI), reg(REG_RAX));
+            ins2(ctx, I_SAR, reg(REG_RDI), imm(63));
+            ins2(ctx, I_SHR, reg(REG_RDI), imm(64 - node->val));
+            ins2(ctx, I_ADD, reg(REG_RAX), reg(REG_RDI));
+            ins2(ctx, I_SAR, reg(REG_RAX), imm(node->val));
+            return true;
         case ND_RETURN:
-            printf("# return {\n");
-            gen(node->lhs);
-            printf("  jmp .L.return.%s\n", s_current_fn->name);
-            printf("# } return\n");
+        case ND_INLINE:
+        case ND_IF:
+        case ND_WHILE:
+        case ND_FOR:
+        case ND_BLOCK:
+            // 文の入れ子はソースの括弧の深さまでなので再帰でよい
+            gen_stmt(ctx, node);
+            return true;
+        default:
+            // 二項演算。gen_operands()と同じ順に評価する
+            switch (step) {
+                case 0:
+                    push_frame(ctx, node->lhs, false);
+                    return false;
+                case 1:
+                    push(ctx);
+                    push_frame(ctx, node->rhs, false);
+                    return false;
+                default:
+                    ins2(ctx, I_MOV, reg(REG_RDI), reg(REG_RAX));
+                    pop(ctx, REG_RAX);
+                    gen_binary(ctx, node);
+                    return true;
+            }
+    }
+}
+
+// 式の値をraxに入れる。式の木は深くなりうるので、再帰せずにctx->framesで後行順にたどる
+static void gen_expr(GenCtx *ctx, const Node *node) {
+    if (node == NULL) {
+        error("node is NULL");
+    }
+    int32_t base = ctx->nframes;
+    push_frame(ctx, node, false);
+    while (ctx->nframes > base) {
+        if (gen_step(ctx, &ctx->frames[ctx->nframes - 1])) {
+            ctx->nframes--;
+        }
+    }
+}
+
+static void gen_stmt(GenCtx *ctx, const Node *node) {
+    if (node == NULL) {
+        error("node is NULL");
+    }
+    switch (node->kind) {
+        case ND_RETURN:
+            if (!ctx->ret_jumps && tail_call_kind(ctx->fn, node, ctx->opts) != TAIL_NONE) {
+                gen_tail_call(ctx, node->lhs, tail_call_kind(ctx->fn, node, ctx->opts));
+                return;
+            }
+            comment(ctx, "# return {\n");
+            gen_expr(ctx, node->lhs);
+            if (ctx->ret_jumps) {
+                add_jump(ctx, I_JMP, ctx->ret_jumps);
+            } else {
+                ins1(ctx, I_JMP, label(NULL, 0));
+            }
+            comment(ctx, "# } return\n");
+            return;
+        case ND_INLINE: {
+            // 値はRAXに入れてreturnから合流点へ飛ぶ。最後の文のreturnは飛ばずに落ちる
+            int c = count(ctx);
+            JumpList *saved = ctx->ret_jumps;
+            JumpList exits = NO_JUMPS;
+            ctx->ret_jumps = &exits;
+            comment_s(ctx, "# inline %s {\n", node->callee->name);
+            for (Node *n = node->inlined; n; n = n->next) {
+                gen_stmt(ctx, !n->next && n->kind == ND_RETURN ? n->lhs : n);
+            }
+            ctx->ret_jumps = saved;
+            if (exits != NO_JUMPS) {
+                place_label(ctx, label("inline", c), exits);
+            }
+            comment_s(ctx, "# } inline %s\n", node->callee->name);
             return;
+        }
         case ND_IF: {
-            int c = count();
-            printf("# if {\n");
-            printf("#   cond {\n");
-            gen(node->cond);
-            printf("#   } cond\n");
-            printf("  cmp rax, 0\n");
+            int c = count(ctx);
+            JumpList skip = NO_JUMPS;
+            comment(ctx, "# if {\n");
+            comment(ctx, "#   cond {\n");
+            gen_branch(ctx, node->cond, false, &skip);
+            comment(ctx, "#   } cond\n");
+            comment(ctx, "#   then {\n");
+            gen_stmt(ctx, node->then);
+            comment(ctx, "#   } then\n");
             if (node->els) {
-                printf("  je  .Lelse%d\n", c);
-                printf("#   then {\n");
-                gen(node->then);
-                printf("#   } then\n");
-
-                printf("  je  .Lend%d\n", c);
-                printf(".Lelse%d:\n", c);
-                printf("#   { else\n");
-                gen(node->els);
-                printf("#  n } else\n");
-                printf(".Lend%d:\n", c);
+                ins1(ctx, I_JMP, label("end", c));
+                place_label(ctx, label("else", c), skip);
+                comment(ctx, "#   { else\n");
+                gen_stmt(ctx, node->els);
+                comment(ctx, "#  n } else\n");
+                ins1(ctx, I_LABEL, label("end", c));
             } else {
-                printf("  je  .Lend%d\n", c);
-                printf("#   then {\n");
-                gen(node->then);
-                printf("#   } then\n");
-                printf(".Lend%d:\n", c);
+                place_label(ctx, label("end", c), skip);
             }
-            printf("# } if\n");
+            comment(ctx, "# } if\n");
             return;
         }
         case ND_WHILE: {
-            int c = count();
-            printf("# while {\n");
-            printf(".Lbegin%d:\n", c);
-            gen(node->cond);
-            printf("  cmp rax, 0\n");
-            printf("  je  .Lend%d\n", c);
-            gen(node->then);
-            printf("  jmp .Lbegin%d\n", c);
-            printf(".Lend%d:\n", c);
-            printf("# } while\n");
+            // 条件を末尾に置き、1周ごとのジャンプを条件分岐1つにする
+            int c = count(ctx);
+            JumpList loop = NO_JUMPS;
+            comment(ctx, "# while {\n");
+            ins1(ctx, I_JMP, label("cond", c));
+            ins1(ctx, I_LABEL, label("begin", c));
+            gen_stmt(ctx, node->then);
+            ins1(ctx, I_LABEL, label("cond", c));
+            gen_branch(ctx, node->cond, true, &loop);
+            patch_jumps(ctx, loop, label("begin", c));
+            comment(ctx, "# } while\n");
             return;
         }
         case ND_FOR: {
-            int c = count();
-            printf("# for {\n");
+            int c = count(ctx);
+            JumpList loop = NO_JUMPS;
+            comment(ctx, "# for {\n");
             if (node->init) {
-                printf("#   init {\n");
-                gen(node->init);
-                printf("#   } init\n");
+                comment(ctx, "#   init {\n");
+                gen_expr(ctx, node->init);
+                comment(ctx, "#   } init\n");
             }
-            printf(".Lbegin%d:\n", c);
             if (node->cond) {
-                printf("#   cond {\n");
-                gen(node->cond);
-                printf("  cmp rax, 0\n");
-                printf("  je  .Lend%d\n", c);
-                printf("#   } cond\n");
+                ins1(ctx, I_JMP, label("cond", c));
             }
-            printf("#   then {\n");
-            gen(node->then);
-            printf("#   } then\n");
+            ins1(ctx, I_LABEL, label("begin", c));
+            comment(ctx, "#   then {\n");
+            gen_stmt(ctx, node->then);
+            comment(ctx, "#   } then\n");
             if (node->inc) {
-                printf("#   inc {\n");
-                gen(node->inc);
-                printf("#   } inc\n");
+                comment(ctx, "#   inc {\n");
+                gen_expr(ctx, node->inc);
+                comment(ctx, "#   } inc\n");
+            }
+            if (node->cond) {
+                ins1(ctx, I_LABEL, label("cond", c));
+                comment(ctx, "#   cond {\n");
+                gen_branch(ctx, node->cond, true, &loop);
+                comment(ctx, "#   } cond\n");
+                patch_jumps(ctx, loop, label("begin", c));
+            } else {
+                ins1(ctx, I_JMP, label("begin", c));
             }
-            printf("  jmp .Lbegin%d\n", c);
-            printf(".Lend%d:\n", c);
-            printf("# } for\n");
+            comment(ctx, "# } for\n");
             return;
         }
         case ND_BLOCK: {
-            printf("# block {\n");
+            comment(ctx, "# block {\n");
             for (Node *n = node->body; n; n = n->next) {
-                gen(n);
+                gen_stmt(ctx, n);
             }
-            printf("# } block\n");
+            comment(ctx, "# } block\n");
             return;
         }
         default:
-            // error("wrong type: %d, @ %s (%d)", node->kind, __FILE__, __LINE__);
+            gen_expr(ctx, node);
+            return;
     }
+}
 
-    gen(node->lhs);
-    push();
-    gen(node->rhs);
-    printf("  mov rdi, rax\n");
-    pop("rax");
+static const char *mnemonic[] = {
+    [I_MOV] = "mov",   [I_MOVZB] = "movzb", [I_LEA] = "lea",   [I_PUSH] = "push",  [I_POP] = "pop",
+    [I_ADD] = "add",   [I_SUB] = "sub",     [I_IMUL] = "imul", [I_CQO] = "cqo",    [I_IDIV] = "idiv",
+    [I_CMP] = "cmp",   [I_SETE] = "sete",   [I_SETNE] = "setne", [I_SETL] = "setl", [I_SETLE] = "setle",
+    [I_SHL] = "shl",   [I_SAR] = "sar",     [I_SHR] = "shr",   [I_JMP] = "jmp",    [I_JE] = "je ",
+    [I_JNE] = "jne",   [I_JL] = "jl ",      [I_JLE] = "jle",   [I_JG] = "jg ",     [I_JGE] = "jge",
+};
 
-    switch (node->kind) {
-        case ND_ADD:
-            printf("  add rax, rdi\n");
-            break;
-        case ND_SUB:
-            printf("  sub rax, rdi\n");
-            break;
-        case ND_MUL:
-            printf("  imul rax, rdi\n");
-            break;
-        case ND_DIV:
-            printf("  cqo\n");
-            printf("  idiv rdi\n");
-            break;
-        case ND_EQ:
-            printf("# == {\n");
-            printf("  cmp rax, rdi\n");
-            printf("  sete al\n");
-            printf("  movzb rax, al\n");
-            printf("# } ==\n");
-            break;
-        case ND_NE:
-            printf("# != {\n");
-            printf("  cmp rax, rdi\n");
-            printf("  setne al\n");
-            printf("  movzb rax, al\n");
-            printf("# != }\n");
-            break;
-        case ND_LT:
-            printf("# < {\n");
-            printf("  cmp rax, rdi\n");
-            printf("  setl al\n");
-            printf("  movzb rax, al\n");
-            printf("# } <\n");
-            break;
-        case ND_LE:
-            printf("# <= {\n");
-            printf("  cmp rax, rdi\n");
-            printf("  setle al\n");
-            printf("  movzb rax, al\n");
-            printf("# <= {\n");
-            break;
+// レジスタ、即値、メモリのオペランドをpに書き、末尾を返す
+static char *format_operand(char *p, const Operand *op) {
+    switch (op->kind) {
+        case OPND_REG:
+            return stpcpy(p, reg_str[op->reg]);
+        case OPND_IMM:
+            return format_int(p, op->val);
+        case OPND_MEM:
+            *p++ = '[';
+            p = stpcpy(p, reg_str[op->reg]);
+            if (op->val > 0) {
+                *p++ = '+';
+            }
+            if (op->val != 0) {
+                p = format_int(p, op->val);
+            }
+            *p++ = ']';
+            return p;
         default:
-            error("cannot be reached : %s (%d)", __FILE__, __LINE__);
+            return p;
     }
-    return;
 }
 
-// Round up `n` to the nearest multiple of `align`. For instance,
-// align_to(5, 8) returns 8 and align_to(11, 8) returns 16.
-static int align_to(int n, int align) { return (n + align - 1) / align * align; }
+static void print_label(GenCtx *ctx, const Operand *op) {
+    if (op->name) {
+        emitf(".L%s.%s.%ld", op->name, ctx->fn->name, op->val);
+    } else {
+        emitf(".L.return.%s", ctx->fn->name);
+    }
+}
 
-void assign_lvar_offsets(Function *prog) {
-    for (Function *fn = prog; fn; fn = fn->next) {
-        fn->stack_size = fn->locals ? align_to(fn->locals->offset, 16) : 0;
+static void print_insn(GenCtx *ctx, const Insn *in) {
+    char dst[48];
+    char src[48];
+    *format_operand(dst, &in->dst) = '\0';
+    *format_operand(src, &in->src) = '\0';
+    switch (in->op) {
+        case I_NOP:
+            return;
+        case I_COMMENT:
+            if (in->name) {
+                emitf(in->text, in->name);
+            } else {
+                emitf(in->text, (int)in->dst.val);
+            }
+            return;
+        case I_LABEL:
+            print_label(ctx, &in->dst);
+            emitf(":\n");
+            return;
+        case I_JMP:
+        case I_JE:
+        case I_JNE:
+        case I_JL:
+        case I_JLE:
+        case I_JG:
+        case I_JGE:
+            emitf("  %s ", mnemonic[in->op]);
+            print_label(ctx, &in->dst);
+            emitf("\n");
+            return;
+        case I_CALL:
+            emitf("  call %s\n", in->text);
+            return;
+        case I_TAILJMP:
+            emitf("  jmp %s\n", in->text);
+            return;
+        case I_PUSH:
+        case I_POP:
+            emitf("  %s %s # size: %d\n", mnemonic[in->op], dst, in->depth);
+            return;
+        case I_CQO:
+            emitf("  cqo\n");
+            return;
+        case I_IDIV:
+        case I_SETE:
+        case I_SETNE:
+        case I_SETL:
+        case I_SETLE:
+            emitf("  %s %s\n", mnemonic[in->op], dst);
+            return;
+        case I_IMUL:
+            if (in->src.kind == OPND_IMM) {
+                emitf("  imul %s, %s, %s\n", dst, dst, src);
+                return;
+            }
+            break;
+        default:
+            break;
     }
+    emitf("  %s %s, %s\n", mnemonic[in->op], dst, src);
 }
 
-void generate_code(Function *fns) {
-    assign_lvar_offsets(fns);
+void generate_function(Function *fn, const CompileOptions *opts) {
+    if (s_generation != arena_generation()) {
+        s_generation = arena_generation();
+        s_insns = s_notes = NULL;
+        s_insns_cap = s_notes_cap = 0;
+        s_frames = NULL;
+        s_frames_cap = 0;
+    }
+    GenCtx ctx = {
+        .fn = fn,
+        .opts = opts,
+        .insns = s_insns,
+        .cap = s_insns_cap,
+        .comments = emit_comments_enabled(),
+        .notes = s_notes,
+        .notes_cap = s_notes_cap,
+        .frames = s_frames,
+        .frames_cap = s_frames_cap,
+    };
+    assign_lvar_offsets(fn);
+    int num_locals = 0;
+    for (LVar *var = fn->locals; var; var = var->next) {
+        num_locals++;
+    }
 
-    // アセンブリの前半部分を出力
-    printf(".intel_syntax noprefix\n");
-    for (Function *fn = fns; fn; fn = fn->next) {
-        printf(".global %s\n", fn->name);
-        printf("%s:\n", fn->name);
+    // 本体を先に生成し、先頭へ戻る末尾呼び出しがあったらプロローグの後にラベルを置く
+    for (Node *n = fn->body; n; n = n->next) {
+        gen_stmt(&ctx, n);
+    }
+    if (opts->peephole) {
+        ctx.ninsns = peephole(ctx.insns, ctx.ninsns, fn->peephole_counts);
+    }
 
-        int num_locals = fn->locals ? fn->locals->offset / 8 : 0;
+    emitf(".global %s\n", fn->name);
+    emitf("%s:\n", fn->name);
 
-        // プロローグ
-        printf("# prologue {\n");
-        printf("  push rbp\n");
-        printf("  mov rbp, rsp\n");
-        printf("  sub rsp, %ld # num_lvar: %d\n", fn->stack_size, num_locals);
-        printf("# } prologue\n");
+    // プロローグ
+    emitf("# prologue {\n");
+    emitf("  push rbp\n");
+    emitf("  mov rbp, rsp\n");
+    emitf("  sub rsp, %ld # num_lvar: %d\n", fn->stack_size, num_locals);
+    emitf("# } prologue\n");
 
-        int i = 0;
-        for (LVar *lvar = fn->params; lvar; lvar = lvar->next) {
-            printf("  mov [rbp-%d], %s\n", lvar->offset, argreg[i++]);
+    int i = 0;
+    for (LVar *lvar = fn->params; lvar; lvar = lvar->next) {
+        emitf("  mov [rbp-%d], %s\n", lvar->offset, reg_str[argreg[i++]]);
+    }
+    if (ctx.self_tail) {
+        Operand body = label("body", 0);
+        print_label(&ctx, &body);
+        emitf(":\n");
+    }
+    int32_t k = 0;
+    for (int32_t j = 0; j < ctx.ninsns; j++) {
+        for (; k < ctx.nnotes && ctx.notes[k].seq <= ctx.insns[j].seq; k++) {
+            print_insn(&ctx, &ctx.notes[k]);
         }
+        print_insn(&ctx, &ctx.insns[j]);
+    }
+    for (; k < ctx.nnotes; k++) {
+        print_insn(&ctx, &ctx.notes[k]);
+    }
+    s_insns = ctx.insns;
+    s_insns_cap = ctx.cap;
+    s_notes = ctx.notes;
+    s_notes_cap = ctx.notes_cap;
+    s_frames = ctx.frames;
+    s_frames_cap = ctx.frames_cap;
 
-        s_current_fn = fn;
-        for (Node *n = fn->body; n; n = n->next) {
-            gen(n);
-        }
+    // エピローグ
+    // 最後の式の結果がRAXに残っているのでそれが返り値になる
+    emitf("# epilogue {\n");
+    emitf(".L.return.%s:\n", fn->name);
+    emitf("  mov rsp, rbp\n");
+    emitf("  pop rbp\n");
+    emitf("  ret\n");
+    emitf("# } epilogue\n");
 
-        // エピローグ
-        // 最後の式の結果がRAXに残っているのでそれが返り値になる
-        printf("# epilogue {\n");
-        printf(".L.return.%s:\n", fn->name);
-        printf("  mov rsp, rbp\n");
-        printf("  pop rbp\n");
-        printf("  ret\n");
-        printf("# } epilogue\n");
-
-        if (s_depth != 0) {
-            fprintf(stderr, "stack depth: got: %d, want: 0\n", s_depth);
-            fflush(stdout);
-            assert(s_depth == 0);
-        }
+    if (ctx.depth != 0) {
+        fprintf(stderr, "stack depth: got: %d, want: 0\n", ctx.depth);
+        emit_flush();
+        assert(ctx.depth == 0);
     }
-}
\ No newline at end of file
+}
+
+// opts->codegen_threadsが2以上なら関数ごとに並列に生成する
+void generate_code(Function *fns, const CompileOptions *opts) {
+    // アセンブリの前半部分を出力
+    emitf(".intel_syntax noprefix\n");
+    emit_functions(fns, opts, generate_function);
+    emit_flush();
+}
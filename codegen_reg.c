@@ -0,0 +1,373 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// レジスタ割り当て済みのIRからx86-64のアセンブリを出力する。
+// スタックマシン版 (codegen.c) と違い、式の途中結果をpush/popしない。
+
+static char *argreg[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+
+static _Thread_local IRFunc *s_irf;
+static _Thread_local RegAlloc *s_ra;
+static _Thread_local int32_t s_spill_base;  // スピル領域の開始オフセット
+static _Thread_local int32_t s_save_base;   // 呼び出し先保存レジスタの退避領域の開始オフセット
+
+static bool is_reg(int32_t v) { return s_ra->locs[v].reg >= 0; }
+
+// 仮想レジスタの割り当て先をオペランドの文字列にする
+static const char *loc(int32_t v) {
+    static _Thread_local char buf[4][32];
+    static _Thread_local int32_t i;
+    Location l = s_ra->locs[v];
+    if (l.reg >= 0) {
+        return reg_names[l.reg];
+    }
+    char *p = buf[i++ % 4];
+    char *end = stpcpy(p, "QWORD PTR [rbp-");
+    end = format_int(end, s_spill_base + (l.slot + 1) * 8);
+    strcpy(end, "]");
+    return p;
+}
+
+static bool same_loc(int32_t a, int32_t b) {
+    Location x = s_ra->locs[a];
+    Location y = s_ra->locs[b];
+    return x.reg == y.reg && x.slot == y.slot;
+}
+
+static void mov(const char *dst, const char *src) {
+    if (strcmp(dst, src)) {
+        emitf("  mov %s, %s\n", dst, src);
+    }
+}
+
+// 並列代入。ある転送先が他の転送元になっている間は後回しにし、
+// 循環していればraxに退避して崩す。
+typedef struct {
+    char dst[32];
+    char src[32];
+} Move;
+
+static void parallel_move(Move *moves, int32_t n) {
+    while (n > 0) {
+        bool progress = false;
+        for (int32_t i = 0; i < n && !progress; i++) {
+            bool blocked = false;
+            for (int32_t j = 0; j < n; j++) {
+                if (j != i && !strcmp(moves[j].src, moves[i].dst)) {
+                    blocked = true;
+                    break;
+                }
+            }
+            if (!blocked) {
+                mov(moves[i].dst, moves[i].src);
+                moves[i] = moves[--n];
+                progress = true;
+            }
+        }
+        if (!progress) {
+            char saved[32];
+            strcpy(saved, moves[0].dst);
+            mov("rax", saved);
+            for (int32_t j = 0; j < n; j++) {
+                if (!strcmp(moves[j].src, saved)) {
+                    strcpy(moves[j].src, "rax");
+                }
+            }
+        }
+    }
+}
+
+static void add_move(Move *moves, int32_t *n, const char *dst, const char *src) {
+    if (!strcmp(dst, src)) {
+        return;
+    }
+    strcpy(moves[*n].dst, dst);
+    strcpy(moves[*n].src, src);
+    (*n)++;
+}
+
+static void print_label(BasicBlock *bb) { emitf(".L.bb.%s.%d:\n", s_irf->fn->name, bb->id); }
+
+static void jmp_to(const char *op, BasicBlock *bb) { emitf("  %s .L.bb.%s.%d\n", op, s_irf->fn->name, bb->id); }
+
+static const char *setcc(IROp op) {
+    switch (op) {
+        case IR_EQ:
+            return "sete";
+        case IR_NE:
+            return "setne";
+        case IR_LT:
+            return "setl";
+        default:
+            return "setle";
+    }
+}
+
+// 呼び出し先保存レジスタを戻してフレームを片付ける
+static void gen_epilogue(void) {
+    int32_t off = s_save_base;
+    for (int32_t r = 0; r < num_alloc_regs; r++) {
+        if (s_ra->used_callee >> r & 1) {
+            off += 8;
+            emitf("  mov %s, [rbp-%d]\n", reg_names[r], off);
+        }
+    }
+    emitf("  mov rsp, rbp\n");
+    emitf("  pop rbp\n");
+}
+
+// dst = a op b
+static void gen_arith(IR *ir, const char *op, bool commutative) {
+    if (is_reg(ir->dst) && !same_loc(ir->dst, ir->b)) {
+        mov(loc(ir->dst), loc(ir->a));
+        emitf("  %s %s, %s\n", op, loc(ir->dst), loc(ir->b));
+        return;
+    }
+    if (is_reg(ir->dst) && commutative) {
+        emitf("  %s %s, %s\n", op, loc(ir->dst), loc(ir->a));
+        return;
+    }
+    mov("rax", loc(ir->a));
+    emitf("  %s rax, %s\n", op, loc(ir->b));
+    mov(loc(ir->dst), "rax");
+}
+
+static void gen_ir(IR *ir, BasicBlock *next_bb) {
+    switch (ir->op) {
+        case IR_IMM:
+            // メモリへのmovの即値は32ビットまでなので、それより大きければraxを経由する
+            if (!is_reg(ir->dst) && (ir->imm < INT32_MIN || INT32_MAX < ir->imm)) {
+                emitf("  mov rax, %ld\n", ir->imm);
+                mov(loc(ir->dst), "rax");
+                return;
+            }
+            emitf("  mov %s, %ld\n", loc(ir->dst), ir->imm);
+            return;
+        case IR_MOV:
+            if (!is_reg(ir->dst) && !is_reg(ir->a)) {
+                mov("rax", loc(ir->a));
+                mov(loc(ir->dst), "rax");
+            } else {
+                mov(loc(ir->dst), loc(ir->a));
+            }
+            return;
+        case IR_ADD:
+            gen_arith(ir, "add", true);
+            return;
+        case IR_SUB:
+            gen_arith(ir, "sub", false);
+            return;
+        case IR_MUL:
+            if (!is_reg(ir->dst)) {
+                mov("rax", loc(ir->a));
+                emitf("  imul rax, %s\n", loc(ir->b));
+                mov(loc(ir->dst), "rax");
+                return;
+            }
+            gen_arith(ir, "imul", true);
+            return;
+        case IR_SHL:
+            if (is_reg(ir->dst)) {
+                mov(loc(ir->dst), loc(ir->a));
+                emitf("  shl %s, %ld\n", loc(ir->dst), ir->imm);
+            } else {
+                mov("rax", loc(ir->a));
+                emitf("  shl rax, %ld\n", ir->imm);
+                mov(loc(ir->dst), "rax");
+            }
+            return;
+        case IR_SAR:
+            // 負数は2^imm-1を足してから右シフトし、0方向に丸める
+            mov("rax", loc(ir->a));
+            emitf("  mov r11, rax\n");
+            emitf("  sar r11, 63\n");
+            emitf("  shr r11, %ld\n", 64 - ir->imm);
+            emitf("  add rax, r11\n");
+            emitf("  sar rax, %ld\n", ir->imm);
+            mov(loc(ir->dst), "rax");
+            return;
+        case IR_DIV:
+            mov("rax", loc(ir->a));
+            emitf("  cqo\n");
+            emitf("  idiv %s\n", loc(ir->b));
+            mov(loc(ir->dst), "rax");
+            return;
+        case IR_EQ:
+        case IR_NE:
+        case IR_LT:
+        case IR_LE:
+            if (is_reg(ir->a)) {
+                emitf("  cmp %s, %s\n", loc(ir->a), loc(ir->b));
+            } else {
+                mov("rax", loc(ir->a));
+                emitf("  cmp rax, %s\n", loc(ir->b));
+            }
+            emitf("  %s al\n", setcc(ir->op));
+            if (is_reg(ir->dst)) {
+                emitf("  movzb %s, al\n", loc(ir->dst));
+            } else {
+                emitf("  movzb rax, al\n");
+                mov(loc(ir->dst), "rax");
+            }
+            return;
+        case IR_ARG:
+            // エントリでまとめて受け取るのでここでは何もしない
+            return;
+        case IR_LEA:
+            if (is_reg(ir->dst)) {
+                emitf("  lea %s, [rbp-%d]\n", loc(ir->dst), ir->var->offset);
+            } else {
+                emitf("  lea rax, [rbp-%d]\n", ir->var->offset);
+                mov(loc(ir->dst), "rax");
+            }
+            return;
+        case IR_LOAD: {
+            const char *addr = loc(ir->a);
+            if (!is_reg(ir->a)) {
+                mov("rax", addr);
+                addr = "rax";
+            }
+            if (is_reg(ir->dst)) {
+                emitf("  mov %s, [%s]\n", loc(ir->dst), addr);
+            } else {
+                emitf("  mov rax, [%s]\n", addr);
+                mov(loc(ir->dst), "rax");
+            }
+            return;
+        }
+        case IR_STORE: {
+            const char *addr = loc(ir->a);
+            if (!is_reg(ir->a)) {
+                mov("rax", addr);
+                addr = "rax";
+            }
+            const char *val = loc(ir->b);
+            if (!is_reg(ir->b)) {
+                mov("r11", val);
+                val = "r11";
+            }
+            emitf("  mov [%s], %s\n", addr, val);
+            return;
+        }
+        case IR_LOAD_VAR:
+            if (is_reg(ir->dst)) {
+                emitf("  mov %s, [rbp-%d]\n", loc(ir->dst), ir->var->offset);
+            } else {
+                emitf("  mov rax, [rbp-%d]\n", ir->var->offset);
+                mov(loc(ir->dst), "rax");
+            }
+            return;
+        case IR_STORE_VAR:
+            if (is_reg(ir->a)) {
+                emitf("  mov [rbp-%d], %s\n", ir->var->offset, loc(ir->a));
+            } else {
+                mov("rax", loc(ir->a));
+                emitf("  mov [rbp-%d], rax\n", ir->var->offset);
+            }
+            return;
+        case IR_CALL:
+        case IR_TAILCALL: {
+            Move moves[6];
+            int32_t n = 0;
+            for (int32_t i = 0; i < ir->nargs && i < 6; i++) {
+                add_move(moves, &n, argreg[i], loc(ir->args[i]));
+            }
+            parallel_move(moves, n);
+            if (ir->op == IR_TAILCALL) {
+                // 引数レジスタは呼び出し先保存ではないので、戻しても壊れない
+                gen_epilogue();
+                emitf("  mov rax, 0\n");
+                emitf("  jmp %s\n", ir->name);
+                return;
+            }
+            emitf("  mov rax, 0\n");
+            emitf("  call %s\n", ir->name);
+            mov(loc(ir->dst), "rax");
+            return;
+        }
+        case IR_RET:
+            if (ir->a >= 0) {
+                mov("rax", loc(ir->a));
+            }
+            emitf("  jmp .L.return.%s\n", s_irf->fn->name);
+            return;
+        case IR_JMP:
+            if (ir->then != next_bb) {
+                jmp_to("jmp", ir->then);
+            }
+            return;
+        case IR_BR:
+            emitf("  cmp %s, 0\n", loc(ir->a));
+            jmp_to("je ", ir->els);
+            if (ir->then != next_bb) {
+                jmp_to("jmp", ir->then);
+            }
+            return;
+        case IR_PHI:
+            error("φがSSA形式から戻されずに残っています");
+            return;
+    }
+}
+
+void generate_function_regalloc(Function *fn, const CompileOptions *opts) {
+    s_irf = lower_function(fn, opts);
+    optimize_ir(s_irf, opts);
+    s_ra = allocate_registers(s_irf);
+
+    // 変数をメモリに置くときだけフレームに変数の領域をとる
+    s_spill_base = 0;
+    if (s_irf->mem_locals) {
+        assign_lvar_offsets(fn);
+        s_spill_base = fn->stack_size;
+    }
+    s_save_base = s_spill_base + s_ra->num_spills * 8;
+    int32_t nsaved = __builtin_popcount(s_ra->used_callee);
+    int32_t stack_size = align_to(s_save_base + nsaved * 8, 16);
+
+    emitf(".global %s\n", fn->name);
+    emitf("%s:\n", fn->name);
+    emitf("# prologue {\n");
+    emitf("  push rbp\n");
+    emitf("  mov rbp, rsp\n");
+    emitf("  sub rsp, %d # spills: %d\n", stack_size, s_ra->num_spills);
+    int32_t off = s_save_base;
+    for (int32_t r = 0; r < num_alloc_regs; r++) {
+        if (s_ra->used_callee >> r & 1) {
+            off += 8;
+            emitf("  mov [rbp-%d], %s\n", off, reg_names[r]);
+        }
+    }
+    emitf("# } prologue\n");
+
+    // 引数レジスタから割り当て先へ並列に転送する
+    Move moves[6];
+    int32_t n = 0;
+    for (IR *ir = s_irf->blocks->first; ir && ir->op == IR_ARG; ir = ir->next) {
+        if (ir->imm < 6) {
+            add_move(moves, &n, loc(ir->dst), argreg[ir->imm]);
+        }
+    }
+    parallel_move(moves, n);
+
+    for (BasicBlock *bb = s_irf->blocks; bb; bb = bb->next) {
+        print_label(bb);
+        for (IR *ir = bb->first; ir; ir = ir->next) {
+            gen_ir(ir, bb->next);
+        }
+    }
+
+    emitf("# epilogue {\n");
+    emitf(".L.return.%s:\n", fn->name);
+    gen_epilogue();
+    emitf("  ret\n");
+    emitf("# } epilogue\n");
+}
+
+void generate_code_regalloc(Function *fns, const CompileOptions *opts) {
+    emitf(".intel_syntax noprefix\n");
+    emit_functions(fns, opts, generate_function_regalloc);
+    emit_flush();
+}
@@ -0,0 +1,171 @@
+#include <elf.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "9cc.h"
+
+// assemble()したObjectをx86-64の再配置可能なELF (.o) として書く (-c)。
+//
+// セクションは.text, .rela.text, .symtab, .strtab, .shstrtabと、スタックを
+// 実行可能にしないための空の.note.GNU-stack。callとjmpの再配置は
+// R_X86_64_PLT32にする。静的リンクならリンカが直接の呼び出しに解決する。
+
+enum {
+    SEC_NULL,
+    SEC_TEXT,
+    SEC_RELA_TEXT,
+    SEC_SYMTAB,
+    SEC_STRTAB,
+    SEC_SHSTRTAB,
+    SEC_NOTE_GNU_STACK,
+    NUM_SECTIONS,
+};
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} Buf;
+
+static size_t put(Buf *b, const void *p, size_t n) {
+    if (b->cap - b->len < n) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap - b->len < n) {
+            cap *= 2;
+        }
+        b->data = realloc(b->data, cap);
+        b->cap = cap;
+    }
+    size_t off = b->len;
+    memcpy(b->data + off, p, n);
+    b->len += n;
+    return off;
+}
+
+// 文字列表に足して位置を返す
+static uint32_t put_str(Buf *b, const char *s) { return put(b, s, strlen(s) + 1); }
+
+static void align(Buf *b, size_t n) {
+    static const char zero[16];
+    put(b, zero, (n - b->len % n) % n);
+}
+
+void write_elf(int fd, const Object *obj) {
+    // シンボル表は局所シンボルを先に並べる。ELFでの番号をsymsの番号から引く
+    Buf symtab = {};
+    Buf strtab = {};
+    put_str(&strtab, "");
+    put(&symtab, &(Elf64_Sym){}, sizeof(Elf64_Sym));
+    uint32_t *index = malloc(sizeof(uint32_t) * (obj->nsyms ? obj->nsyms : 1));
+    uint32_t nlocals = 1;
+    for (int32_t pass = 0; pass < 2; pass++) {
+        for (int32_t i = 0; i < obj->nsyms; i++) {
+            const ObjSymbol *s = &obj->syms[i];
+            bool global = s->global || !s->defined;
+            if (global != (pass == 1)) {
+                continue;
+            }
+            Elf64_Sym sym = {
+                .st_name = put_str(&strtab, s->name),
+                .st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL, s->defined ? STT_FUNC : STT_NOTYPE),
+                .st_shndx = s->defined ? SEC_TEXT : SHN_UNDEF,
+                .st_value = s->defined ? s->offset : 0,
+                .st_size = s->defined ? s->size : 0,
+            };
+            index[i] = symtab.len / sizeof(Elf64_Sym);
+            put(&symtab, &sym, sizeof(sym));
+        }
+        if (pass == 0) {
+            nlocals = symtab.len / sizeof(Elf64_Sym);
+        }
+    }
+
+    Buf rela = {};
+    for (int32_t i = 0; i < obj->nrelocs; i++) {
+        Elf64_Rela r = {
+            .r_offset = obj->relocs[i].offset,
+            .r_info = ELF64_R_INFO(index[obj->relocs[i].sym], R_X86_64_PLT32),
+            .r_addend = -4,
+        };
+        put(&rela, &r, sizeof(r));
+    }
+    free(index);
+
+    Buf shstrtab = {};
+    put_str(&shstrtab, "");
+    Elf64_Shdr sh[NUM_SECTIONS] = {};
+    sh[SEC_TEXT] = (Elf64_Shdr){.sh_name = put_str(&shstrtab, ".text"),
+                                .sh_type = SHT_PROGBITS,
+                                .sh_flags = SHF_ALLOC | SHF_EXECINSTR,
+                                .sh_addralign = 16};
+    sh[SEC_RELA_TEXT] = (Elf64_Shdr){.sh_name = put_str(&shstrtab, ".rela.text"),
+                                     .sh_type = SHT_RELA,
+                                     .sh_flags = SHF_INFO_LINK,
+                                     .sh_link = SEC_SYMTAB,
+                                     .sh_info = SEC_TEXT,
+                                     .sh_addralign = 8,
+                                     .sh_entsize = sizeof(Elf64_Rela)};
+    sh[SEC_SYMTAB] = (Elf64_Shdr){.sh_name = put_str(&shstrtab, ".symtab"),
+                                  .sh_type = SHT_SYMTAB,
+                                  .sh_link = SEC_STRTAB,
+                                  .sh_info = nlocals,
+                                  .sh_addralign = 8,
+                                  .sh_entsize = sizeof(Elf64_Sym)};
+    sh[SEC_STRTAB] = (Elf64_Shdr){.sh_name = put_str(&shstrtab, ".strtab"), .sh_type = SHT_STRTAB, .sh_addralign = 1};
+    sh[SEC_SHSTRTAB] = (Elf64_Shdr){.sh_type = SHT_STRTAB, .sh_addralign = 1};
+    sh[SEC_NOTE_GNU_STACK] = (Elf64_Shdr){.sh_name = put_str(&shstrtab, ".note.GNU-stack"),
+                                          .sh_type = SHT_PROGBITS,
+                                          .sh_addralign = 1};
+    sh[SEC_SHSTRTAB].sh_name = put_str(&shstrtab, ".shstrtab");
+
+    // ヘッダ、各セクションの中身、セクションヘッダの順に並べる
+    Buf out = {};
+    Elf64_Ehdr eh = {
+        .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_SYSV},
+        .e_type = ET_REL,
+        .e_machine = EM_X86_64,
+        .e_version = EV_CURRENT,
+        .e_ehsize = sizeof(Elf64_Ehdr),
+        .e_shentsize = sizeof(Elf64_Shdr),
+        .e_shnum = NUM_SECTIONS,
+        .e_shstrndx = SEC_SHSTRTAB,
+    };
+    put(&out, &eh, sizeof(eh));
+    const Buf contents[NUM_SECTIONS] = {
+        [SEC_TEXT] = {(char *)obj->text, obj->len},
+        [SEC_RELA_TEXT] = rela,
+        [SEC_SYMTAB] = symtab,
+        [SEC_STRTAB] = strtab,
+        [SEC_SHSTRTAB] = shstrtab,
+    };
+    for (int32_t i = 1; i < NUM_SECTIONS; i++) {
+        align(&out, sh[i].sh_addralign);
+        sh[i].sh_offset = out.len;
+        sh[i].sh_size = contents[i].len;
+        if (contents[i].len > 0) {
+            put(&out, contents[i].data, contents[i].len);
+        }
+    }
+    align(&out, 8);
+    ((Elf64_Ehdr *)out.data)->e_shoff = out.len;
+    put(&out, sh, sizeof(sh));
+
+    for (size_t w = 0; w < out.len;) {
+        ssize_t n = write(fd, out.data + w, out.len - w);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error("elf: write failed: %s", strerror(errno));
+        }
+        w += n;
+    }
+    free(out.data);
+    free(rela.data);
+    free(symtab.data);
+    free(strtab.data);
+    free(shstrtab.data);
+}
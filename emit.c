@@ -0,0 +1,335 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "9cc.h"
+
+// アセンブリの出力先。printfを使わず大きなバッファに書き込み、
+// いっぱいになるか最後にwrite(2)でまとめて吐き出す。
+//
+// emitf()の書式は%d, %ld, %s, %%だけを扱う。書式中の'#'から行末までは
+// コメントで、emit_set_comments(false)なら出力しない。
+// コメントだけの行は行ごと取り除く。
+//
+// 状態はスレッドごとに持つので、スレッドごとに別のファイルへ出力できる。
+// emit_begin_capture()からemit_end_capture()までの出力は、吐き出さずに
+// メモリ上に溜めて呼び出し側に渡す。関数ごとに別スレッドで生成した
+// コードを、後でソース順につなげるのに使う。
+
+#define EMIT_BUF_SIZE (1 << 20)
+#define EMIT_RESERVE 256  // emitf()の前に確保しておく空き
+
+static _Thread_local char *s_buf;  // スレッドごとに最初の出力で確保する
+static _Thread_local size_t s_len;
+static _Thread_local size_t s_cap;
+static _Thread_local int s_fd = 1;
+static _Thread_local bool s_comments = true;
+static _Thread_local bool s_line_start = true;  // 吐き出した出力が行末で終わっている
+static _Thread_local size_t s_bytes;            // これまでに出力したバイト数
+
+// キャプチャ中は、キャプチャ前のバッファをここに退避しておく
+static _Thread_local bool s_capture;
+static _Thread_local char *s_saved_buf;
+static _Thread_local size_t s_saved_cap;
+
+void emit_set_fd(int fd) { s_fd = fd; }
+
+void emit_set_comments(bool on) { s_comments = on; }
+
+bool emit_comments_enabled(void) { return s_comments; }
+
+size_t emit_bytes_written(void) { return s_bytes + s_len; }
+
+static void write_all(const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(s_fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error("emit: write failed: %s", strerror(errno));
+        }
+        p += w;
+        n -= w;
+    }
+}
+
+void emit_flush(void) {
+    if (s_capture) {
+        return;
+    }
+    write_all(s_buf, s_len);
+    if (s_len > 0) {
+        s_line_start = s_buf[s_len - 1] == '\n';
+    }
+    s_bytes += s_len;
+    s_len = 0;
+}
+
+// 少なくともnバイトの空きを作る。キャプチャ中は吐き出さずにバッファを広げる
+static void reserve(size_t n) {
+    if (s_buf && s_cap - s_len >= n) {
+        return;
+    }
+    if (s_buf && !s_capture) {
+        emit_flush();
+        if (s_cap >= n) {
+            return;
+        }
+    }
+    size_t cap = s_cap ? s_cap : (s_capture ? 4096 : EMIT_BUF_SIZE);
+    while (cap - s_len < n) {
+        cap *= 2;
+    }
+    s_buf = realloc(s_buf, cap);
+    if (!s_buf) {
+        error("emit: out of memory");
+    }
+    s_cap = cap;
+}
+
+// 残りを吐き出してバッファを解放する。スレッドを終える前に呼ぶ
+void emit_close(void) {
+    emit_flush();
+    free(s_buf);
+    s_buf = NULL;
+    s_cap = 0;
+}
+
+void emit_begin_capture(void) {
+    emit_flush();
+    s_saved_buf = s_buf;
+    s_saved_cap = s_cap;
+    s_buf = NULL;
+    s_cap = 0;
+    s_capture = true;
+}
+
+// キャプチャした出力を返す。返した領域は呼び出し側がfreeする
+char *emit_end_capture(size_t *len) {
+    char *buf = s_buf;
+    *len = s_len;
+    s_buf = s_saved_buf;
+    s_cap = s_saved_cap;
+    s_len = 0;
+    s_capture = false;
+    return buf;
+}
+
+// sのnバイトをそのまま出力する。コメントも取り除かない
+void emit_bytes(const char *s, size_t n) {
+    if (!s_capture && n > EMIT_BUF_SIZE) {
+        // バッファより大きなものは直接書く
+        emit_flush();
+        write_all(s, n);
+        s_bytes += n;
+        s_line_start = s[n - 1] == '\n';
+        return;
+    }
+    reserve(n);
+    memcpy(s_buf + s_len, s, n);
+    s_len += n;
+}
+
+static const char s_digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// valを10進数でpに書き込み、書き込んだ末尾を返す。pには21バイト必要。
+char *format_int(char *p, int64_t val) {
+    uint64_t u = val;
+    if (val < 0) {
+        *p++ = '-';
+        u = -u;
+    }
+    char tmp[20];
+    char *q = tmp + sizeof(tmp);
+    while (u >= 100) {
+        q -= 2;
+        memcpy(q, s_digit_pairs + u % 100 * 2, 2);
+        u /= 100;
+    }
+    if (u >= 10) {
+        q -= 2;
+        memcpy(q, s_digit_pairs + u * 2, 2);
+    } else {
+        *--q = '0' + u;
+    }
+    size_t n = tmp + sizeof(tmp) - q;
+    memcpy(p, q, n);
+    return p + n;
+}
+
+// 書き込み位置outの後ろにnバイトの空きを作り、新しい書き込み位置を返す
+static char *make_room(char *out, size_t n) {
+    s_len = out - s_buf;
+    reserve(n);
+    return s_buf + s_len;
+}
+
+// outに1バイト書き、新しい書き込み位置を返す。limitに達していたら空きを作る
+static inline char *put_char(char *out, char **limit, char c) {
+    if (out >= *limit) {
+        out = make_room(out, EMIT_RESERVE);
+        *limit = s_buf + s_cap;
+    }
+    *out++ = c;
+    return out;
+}
+
+void emitf(const char *fmt, ...) {
+    // 1回の呼び出しで書く量はたいてい小さいので、先に空きを作っておき
+    // 境界は空きが少なくなったときだけ確認する
+    char *out = make_room(s_buf + s_len, EMIT_RESERVE);
+    char *limit = s_buf + s_cap;
+
+    va_list ap;
+    va_start(ap, fmt);
+    for (const char *p = fmt; *p; p++) {
+        char c = *p;
+        if (c != '%' && c != '#') {
+            out = put_char(out, &limit, c);
+            continue;
+        }
+
+        if (c == '#') {
+            if (s_comments) {
+                out = put_char(out, &limit, c);
+                continue;
+            }
+            // コメント直前の空白を取り除き、引数を消費しながら行末まで読み飛ばす
+            while (out > s_buf && out[-1] == ' ') {
+                out--;
+            }
+            for (p++; *p && *p != '\n'; p++) {
+                if (*p != '%') {
+                    continue;
+                }
+                p++;
+                if (*p == 'l') {
+                    p++;
+                    va_arg(ap, long);
+                } else if (*p == 'd') {
+                    va_arg(ap, int);
+                } else if (*p == 's') {
+                    va_arg(ap, const char *);
+                }
+            }
+            if (!*p) {
+                break;
+            }
+            // コメントだけの行は改行ごと取り除く
+            bool empty = out > s_buf ? out[-1] == '\n' : s_line_start;
+            if (!empty) {
+                out = put_char(out, &limit, '\n');
+            }
+            continue;
+        }
+
+        if (limit - out < 24) {
+            out = make_room(out, EMIT_RESERVE);
+            limit = s_buf + s_cap;
+        }
+        switch (*++p) {
+            case 'd':
+                out = format_int(out, va_arg(ap, int));
+                break;
+            case 'l':
+                p++;
+                out = format_int(out, va_arg(ap, long));
+                break;
+            case 's': {
+                const char *str = va_arg(ap, const char *);
+                size_t n = strlen(str);
+                if ((size_t)(limit - out) < n + EMIT_RESERVE / 2) {
+                    out = make_room(out, n + EMIT_RESERVE);
+                    limit = s_buf + s_cap;
+                }
+                memcpy(out, str, n);
+                out += n;
+                break;
+            }
+            case '%':
+                out = put_char(out, &limit, '%');
+                break;
+            default:
+                error("emitf: unsupported format: %s", fmt);
+        }
+    }
+    va_end(ap);
+    s_len = out - s_buf;
+}
+
+typedef struct {
+    Function **fns;
+    const CompileOptions *opts;
+    FunctionGen gen;
+    char **out;
+    size_t *len;
+    bool comments;
+} EmitJob;
+
+static void emit_function_task(void *arg, int64_t i) {
+    EmitJob *job = arg;
+    bool comments = s_comments;
+    s_comments = job->comments;
+    emit_begin_capture();
+    job->gen(job->fns[i], job->opts);
+    job->out[i] = emit_end_capture(&job->len[i]);
+    s_comments = comments;
+}
+
+// fns[i]をgen()で生成したコードを出力せずにout[i]に、長さをlen[i]に返す。
+// out[i]は呼び出し側がfreeする。codegen_threadsが2以上なら各関数を別スレッドで生成する
+void emit_capture_functions(Function **fns, int64_t n, const CompileOptions *opts, FunctionGen gen, char **out,
+                            size_t *len) {
+    EmitJob job = {fns, opts, gen, out, len, s_comments};
+    run_parallel(opts->codegen_threads, n, emit_function_task, &job);
+}
+
+// 関数ごとにgen(fn, opts)でコードを生成する。codegen_threadsが2以上なら各関数を
+// 別スレッドでバッファに生成してからソース順に出力する。出力はスレッド数によらない
+void emit_functions(Function *fns, const CompileOptions *opts, FunctionGen gen) {
+    int32_t nthreads = opts->codegen_threads;
+    int64_t n = 0;
+    for (Function *fn = fns; fn; fn = fn->next) {
+        n++;
+    }
+    if (nthreads <= 1 || n <= 1) {
+        for (Function *fn = fns; fn; fn = fn->next) {
+            gen(fn, opts);
+        }
+        return;
+    }
+
+    Function **list = malloc(sizeof(Function *) * n);
+    char **out = malloc(sizeof(char *) * n);
+    size_t *len = malloc(sizeof(size_t) * n);
+    int64_t i = 0;
+    for (Function *fn = fns; fn; fn = fn->next) {
+        list[i++] = fn;
+    }
+    emit_capture_functions(list, n, opts, gen, out, len);
+
+    for (i = 0; i < n; i++) {
+        if (len[i] > 0) {
+            emit_bytes(out[i], len[i]);
+        }
+        free(out[i]);
+    }
+    free(list);
+    free(out);
+    free(len);
+}
@@ -0,0 +1,265 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// parse()とgenerate_code()の間で定数畳み込みと代数的な簡約を行う。
+// 例えば`5+20-4`は21に、`- -x`(= 0-(0-x))はxになる。
+
+static _Thread_local int32_t s_removed;  // 取り除いたノード数
+
+static bool is_num(Node *node, int64_t val) { return node->kind == ND_NUM && node->val == val; }
+
+// valが2のべき乗ならその指数を、そうでなければ-1を返す
+static int32_t log2_exact(int64_t val) {
+    if (val <= 1 || (val & (val - 1))) {
+        return -1;
+    }
+    return __builtin_ctzll(val);
+}
+
+// 両辺が定数の二項演算を計算する。畳み込めない場合は偽を返す。
+static bool eval_binary(NodeKind kind, int64_t l, int64_t r, int64_t *out) {
+    switch (kind) {
+        case ND_ADD:
+            *out = l + r;
+            break;
+        case ND_SUB:
+            *out = l - r;
+            break;
+        case ND_MUL:
+            *out = l * r;
+            break;
+        case ND_DIV:
+            // ゼロ除算は実行時まで残す
+            if (r == 0) {
+                return false;
+            }
+            *out = l / r;
+            break;
+        case ND_EQ:
+            *out = l == r;
+            break;
+        case ND_NE:
+            *out = l != r;
+            break;
+        case ND_LT:
+            *out = l < r;
+            break;
+        case ND_LE:
+            *out = l <= r;
+            break;
+        default:
+            return false;
+    }
+    // ND_NUMは32ビットなので、収まらない結果は畳み込まない
+    return INT32_MIN <= *out && *out <= INT32_MAX;
+}
+
+// 畳み込みの途中のノード。slotはノードを指している場所で、畳み込んだ結果で置き換える
+typedef struct {
+    Node **slot;
+    bool expanded;  // 子を積んだ
+} FoldFrame;
+
+// 深い式でもCのスタックを使い切らないよう、明示的なスタックで後行順にたどる。
+// スタックはアリーナ上に置き、アリーナが解放されたら作り直す
+static _Thread_local FoldFrame *s_stack;
+static _Thread_local int32_t s_len;
+static _Thread_local int32_t s_cap;
+static _Thread_local uint64_t s_generation;
+
+static void push(Node **slot) {
+    if (!*slot) {
+        return;
+    }
+    if (s_len == s_cap) {
+        s_cap = s_cap ? s_cap * 2 : 256;
+        FoldFrame *p = arena_alloc(sizeof(FoldFrame) * s_cap);
+        if (s_len > 0) {
+            memcpy(p, s_stack, sizeof(FoldFrame) * s_len);
+        }
+        s_stack = p;
+    }
+    s_stack[s_len++] = (FoldFrame){slot, false};
+}
+
+// リストの要素は後ろから畳み込まれるので、置き換えたノードのnextは後ろの結果を指している
+static void push_list(Node **head) {
+    for (Node **p = head; *p; p = &(*p)->next) {
+        push(p);
+    }
+}
+
+static void push_children(Node *node) {
+    switch (node->kind) {
+        case ND_IF:
+            push(&node->cond);
+            push(&node->then);
+            push(&node->els);
+            return;
+        case ND_WHILE:
+        case ND_FOR:
+            if (node->kind == ND_FOR) {
+                push(&node->init);
+                push(&node->inc);
+            }
+            push(&node->cond);
+            push(&node->then);
+            return;
+        case ND_BLOCK:
+            push_list(&node->body);
+            return;
+        case ND_FUNCALL:
+            push_list(&node->args);
+            return;
+        case ND_INLINE:
+            push_list(&node->inlined);
+            return;
+        case ND_RETURN:
+        case ND_ADDR:
+        case ND_DEREF:
+        case ND_SHL:
+        case ND_SAR:
+            push(&node->lhs);
+            return;
+        case ND_ASSIGN:
+        case ND_ADD:
+        case ND_SUB:
+        case ND_MUL:
+        case ND_DIV:
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE:
+            push(&node->lhs);
+            push(&node->rhs);
+            return;
+        default:
+            return;
+    }
+}
+
+// 子を畳み込み済みのnodeを畳み込み、置き換えるノードを返す
+static Node *fold_node(Node *node) {
+    switch (node->kind) {
+        case ND_ADD:
+        case ND_SUB:
+        case ND_MUL:
+        case ND_DIV:
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE:
+            break;
+        default:
+            return node;
+    }
+
+    Node *lhs = node->lhs;
+    Node *rhs = node->rhs;
+
+    int64_t val;
+    if (lhs->kind == ND_NUM && rhs->kind == ND_NUM && eval_binary(node->kind, lhs->val, rhs->val, &val)) {
+        lhs->val = val;
+        s_removed += 2;
+        return lhs;
+    }
+
+    switch (node->kind) {
+        case ND_ADD:
+            // x+0, 0+x
+            if (is_num(rhs, 0) || is_num(lhs, 0)) {
+                Node *x = is_num(rhs, 0) ? lhs : rhs;
+                s_removed += 2;
+                return x;
+            }
+            break;
+        case ND_SUB:
+            // x-0
+            if (is_num(rhs, 0)) {
+                s_removed += 2;
+                return lhs;
+            }
+            // 0-(0-x)
+            if (is_num(lhs, 0) && rhs->kind == ND_SUB && is_num(rhs->lhs, 0)) {
+                Node *x = rhs->rhs;
+                s_removed += 4;
+                return x;
+            }
+            break;
+        case ND_MUL: {
+            // x*1, 1*x
+            if (is_num(rhs, 1) || is_num(lhs, 1)) {
+                Node *x = is_num(rhs, 1) ? lhs : rhs;
+                s_removed += 2;
+                return x;
+            }
+            // x*2^k => x<<k
+            Node *num = rhs->kind == ND_NUM ? rhs : lhs;
+            int32_t shift = num->kind == ND_NUM ? log2_exact(num->val) : -1;
+            if (shift > 0) {
+                node->kind = ND_SHL;
+                node->lhs = num == rhs ? lhs : rhs;
+                node->rhs = NULL;
+                node->val = shift;
+                s_removed += 1;
+            }
+            break;
+        }
+        case ND_DIV: {
+            // x/1
+            if (is_num(rhs, 1)) {
+                s_removed += 2;
+                return lhs;
+            }
+            // x/2^k => 0方向に丸める算術右シフト
+            int32_t shift = rhs->kind == ND_NUM ? log2_exact(rhs->val) : -1;
+            if (shift > 0) {
+                node->kind = ND_SAR;
+                node->rhs = NULL;
+                node->val = shift;
+                s_removed += 1;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    return node;
+}
+
+static void fold(Node **root) {
+    if (s_generation != arena_generation()) {
+        s_generation = arena_generation();
+        s_stack = NULL;
+        s_cap = 0;
+    }
+    s_len = 0;
+    push(root);
+    while (s_len > 0) {
+        FoldFrame *f = &s_stack[s_len - 1];
+        if (!f->expanded) {
+            f->expanded = true;
+            push_children(*f->slot);
+            continue;
+        }
+        s_len--;
+        Node *node = *f->slot;
+        Node *x = fold_node(node);
+        if (x != node) {
+            x->next = node->next;
+            *f->slot = x;
+        }
+    }
+}
+
+int32_t fold_constants(Function *fns) {
+    s_removed = 0;
+    for (Function *fn = fns; fn; fn = fn->next) {
+        fold(&fn->body);
+    }
+    return s_removed;
+}
@@ -0,0 +1,233 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// 関数単位のインクリメンタルコンパイル (--incremental)。
+//
+// ファイル全体のキャッシュに外れたとき、トークン列を関数定義ごとに区切って
+// 関数ごとのキーを作り、--cacheのディレクトリに関数ごとのアセンブリを置く。
+// キーに当たった関数はエントリをそのまま使い、外れた関数だけを構文解析して
+// コード生成する。出力は--incrementalなしと同じになる。
+//
+// 関数のアセンブリは、その関数のトークン列のほかに、インライン展開で本体が
+// 入りうる関数にもよる。展開するのは同じ翻訳単位で定義した葉関数だけなので、
+// 直接呼んでいる関数の定義のトークン列をキーに含めればよい。
+// ラベルは関数ごとに1から振り、変数の範囲も関数の中の相対的な位置でしか
+// 比べないので、他の関数が変わっても関数のアセンブリは変わらない。
+
+// ソース上の関数定義
+typedef struct {
+    Token *begin;        // 関数名のトークン
+    Ident *name;
+    Hash128 tokens;      // 関数名から閉じ括弧までのトークン列のハッシュ
+    Ident **callees;     // 本体で呼んでいる名前 (重複あり)
+    int32_t ncallees;
+    int32_t next_same;   // 同じ名前の次の定義。なければ-1
+    CacheKey key;
+    char *text;          // キャッシュからマップしたアセンブリ。NULLならコンパイルし直す
+    size_t len;
+} FnRange;
+
+static bool is_punct(Token *tok, char c) { return tok->kind == TK_RESERVED && tok->len == 1 && tok->str[0] == c; }
+
+// tokから始まる関数定義 ident "(" params ")" "{" ... "}" をfnに入れ、次のトークンを返す。
+// 関数定義になっていなければNULLを返す
+static Token *scan_function(Token *tok, FnRange *fn) {
+    *fn = (FnRange){.begin = tok, .name = tok->ident, .tokens = HASH128_INIT};
+    if (tok->kind != TK_IDENT || !is_punct(tok->next, '(')) {
+        return NULL;
+    }
+    Token *t = tok->next;
+    while (!is_punct(t, ')')) {
+        if (t->kind == TK_EOF) {
+            return NULL;
+        }
+        t = t->next;
+    }
+    if (!is_punct(t->next, '{')) {
+        return NULL;
+    }
+
+    int32_t cap = 0;
+    int32_t depth = 0;
+    for (t = tok;; t = t->next) {
+        if (t->kind == TK_EOF) {
+            free(fn->callees);
+            return NULL;
+        }
+        // 空白を除いた綴りが同じなら同じトークン列
+        fn->tokens = hash128(fn->tokens, &t->kind, sizeof(t->kind));
+        fn->tokens = hash128(fn->tokens, &t->len, sizeof(t->len));
+        fn->tokens = hash128(fn->tokens, t->str, t->len);
+        if (is_punct(t, '{')) {
+            depth++;
+        } else if (is_punct(t, '}')) {
+            if (--depth == 0) {
+                return t->next;
+            }
+        } else if (t != tok && t->kind == TK_IDENT && is_punct(t->next, '(')) {
+            if (fn->ncallees == cap) {
+                cap = cap ? cap * 2 : 8;
+                fn->callees = realloc(fn->callees, sizeof(Ident *) * cap);
+            }
+            fn->callees[fn->ncallees++] = t->ident;
+        }
+    }
+}
+
+static void free_ranges(FnRange *fns, int32_t n) {
+    for (int32_t i = 0; i < n; i++) {
+        free(fns[i].callees);
+    }
+    free(fns);
+}
+
+// トークン列を関数定義に区切ってfnsに入れ、その数を返す。
+// 関数定義の並びになっていなければ-1を返す
+static int32_t scan(Token *tok, FnRange **fns) {
+    int32_t n = 0;
+    int32_t cap = 0;
+    *fns = NULL;
+    while (tok->kind != TK_EOF) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            *fns = realloc(*fns, sizeof(FnRange) * cap);
+        }
+        tok = scan_function(tok, &(*fns)[n]);
+        if (!tok) {
+            free_ranges(*fns, n);
+            return -1;
+        }
+        n++;
+    }
+    return n;
+}
+
+// 関数のキー。オプション、自身のトークン列、呼んでいる名前ごとにその名前の全ての定義の
+// トークン列から作る。定義のない名前は翻訳単位の外の関数なので名前だけを足す
+static CacheKey function_key(FnRange *fns, int32_t i, int32_t *first, Hash128 base) {
+    FnRange *fn = &fns[i];
+    Hash128 h = hash128(base, &fn->tokens, sizeof(fn->tokens));
+    for (int32_t j = 0; j < fn->ncallees; j++) {
+        Ident *callee = fn->callees[j];
+        h = hash128(h, &callee->len, sizeof(callee->len));
+        h = hash128(h, callee->name, callee->len);
+        int32_t ndefs = 0;
+        for (int32_t k = first[callee->id]; k >= 0; k = fns[k].next_same) {
+            ndefs++;
+        }
+        h = hash128(h, &ndefs, sizeof(ndefs));
+        for (int32_t k = first[callee->id]; k >= 0; k = fns[k].next_same) {
+            h = hash128(h, &fns[k].tokens, sizeof(fns[k].tokens));
+        }
+    }
+    return cache_key_of(h);
+}
+
+// textをコンパイルし、アセンブリを現在のemitの出力先に書く。
+// 変わっていない関数はcache_dirの関数ごとのエントリを使い、変わった関数のエントリを置く
+void compile_incremental(char *text, const CompileOptions *opts, const char *cache_dir, PhaseStats *phases) {
+    emit_set_comments(opts->asm_comments);
+
+    // 関数の区切りとキーを知るには全体をトークナイズする必要がある
+    Token *token = tokenize(text);
+    stats_phase(phases, PHASE_TOKENIZE);
+
+    FnRange *fns;
+    int32_t n = scan(token, &fns);
+    if (n < 0) {
+        // 関数定義の並びでなければ、エラーの報告はparse()に任せる
+        Function *all = parse(token);
+        stats_phase(phases, PHASE_PARSE);
+        optimize(all, opts, phases);
+        if (opts->regalloc) {
+            generate_code_regalloc(all, opts);
+        } else {
+            generate_code(all, opts);
+        }
+        stats_phase(phases, PHASE_CODEGEN);
+        return;
+    }
+
+    // 名前から定義を引く表。同じ名前の定義はソース順につなぐ
+    int32_t *first = malloc(sizeof(int32_t) * num_idents());
+    for (int32_t i = 0; i < num_idents(); i++) {
+        first[i] = -1;
+    }
+    for (int32_t i = n - 1; i >= 0; i--) {
+        fns[i].next_same = first[fns[i].name->id];
+        first[fns[i].name->id] = i;
+    }
+
+    // 当たった関数のエントリをマップする。変わった関数と、そこへ展開しうる関数を構文解析する
+    Hash128 base = hash128(hash_options(HASH128_INIT, opts), "function\n", 9);
+    bool *need = calloc(n ? n : 1, sizeof(bool));
+    int32_t nchanged = 0;
+    for (int32_t i = 0; i < n; i++) {
+        fns[i].key = function_key(fns, i, first, base);
+        fns[i].text = cache_map(cache_dir, &fns[i].key, &fns[i].len);
+        if (fns[i].text) {
+            continue;
+        }
+        nchanged++;
+        need[i] = true;
+        for (int32_t j = 0; j < fns[i].ncallees; j++) {
+            for (int32_t k = first[fns[i].callees[j]->id]; k >= 0; k = fns[k].next_same) {
+                need[k] = true;
+            }
+        }
+    }
+    Function head = {};
+    Function *cur = &head;
+    Function **changed = malloc(sizeof(Function *) * (nchanged ? nchanged : 1));
+    int32_t *changed_index = malloc(sizeof(int32_t) * (nchanged ? nchanged : 1));
+    int32_t m = 0;
+    for (int32_t i = 0; i < n; i++) {
+        if (!need[i]) {
+            continue;
+        }
+        cur = cur->next = parse_function(fns[i].begin);
+        if (!fns[i].text) {
+            changed_index[m] = i;
+            changed[m++] = cur;
+        }
+    }
+    stats_phase(phases, PHASE_PARSE);
+    optimize(head.next, opts, phases);
+
+    // 変わった関数だけを生成してエントリを置き、ソース順につなげて出力する
+    char **out = malloc(sizeof(char *) * (nchanged ? nchanged : 1));
+    size_t *len = malloc(sizeof(size_t) * (nchanged ? nchanged : 1));
+    emit_capture_functions(changed, nchanged, opts, opts->regalloc ? generate_function_regalloc : generate_function,
+                           out, len);
+    for (int32_t j = 0; j < nchanged; j++) {
+        cache_store(cache_dir, &fns[changed_index[j]].key, out[j], len[j]);
+    }
+    emitf(".intel_syntax noprefix\n");
+    for (int32_t i = 0, j = 0; i < n; i++) {
+        if (fns[i].text) {
+            emit_bytes(fns[i].text, fns[i].len);
+            cache_unmap(fns[i].text, fns[i].len);
+        } else {
+            if (len[j] > 0) {
+                emit_bytes(out[j], len[j]);
+            }
+            free(out[j++]);
+        }
+    }
+    emit_flush();
+    stats_phase(phases, PHASE_CODEGEN);
+    phases->fns_reused = n - nchanged;
+    phases->fns_compiled = nchanged;
+
+    free(out);
+    free(len);
+    free(changed);
+    free(changed_index);
+    free(need);
+    free(first);
+    free_ranges(fns, n);
+}
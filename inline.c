@@ -0,0 +1,493 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// fold_constants()の前に、同じ翻訳単位で定義した小さな葉関数 (関数を呼ばない関数) の
+// 呼び出しを関数本体で置き換える。
+//
+// 呼び出しはND_INLINEになり、引数を仮引数の変数に代入してから本体の文を実行する。
+// 本体の中のreturnは関数から抜ける代わりに、値をretの変数に入れて合流点へ飛ぶ。
+// 呼ばれる側の変数は呼び出し元の新しい変数に置き換え、その範囲を呼び出しの
+// ソース上の範囲にする。範囲が重ならない変数とはスタックのスロットを共有できる。
+// 定数や変数をそのまま渡す引数は、代入せずに本体の中の仮引数と置き換える。
+//
+// 本体のノード数から、呼び出しを残した場合のコストを引いたものが予算以下なら展開する。
+
+#define INLINE_MAX_GROWTH 1024  // 1つの関数に展開で足すノード数の上限
+
+// 展開できる関数
+typedef struct {
+    Function *fn;
+    int32_t size;     // 本体のノード数
+    int32_t nparams;
+    int32_t nlocals;  // 仮引数を含む変数の数
+    int32_t sites;    // 処理中の関数で展開した呼び出しの数
+} Callee;
+
+typedef struct {
+    int32_t budget;
+
+    // 関数名からCalleeを引く開番地法の表。名前はインターンされているのでポインタで比べる
+    Callee **table;
+    int32_t table_size;
+
+    Function *fn;      // 展開先の関数
+    int32_t growth;    // 展開先の関数に足したノード数
+    Callee **touched;  // 展開先の関数に展開した関数 (報告用)
+    int32_t ntouched;
+    int32_t ninlined;
+} InlineCtx;
+
+static uint32_t hash_ptr(const void *p) { return (uint32_t)(((uintptr_t)p >> 3) * 0x9e3779b97f4a7c15ULL >> 32); }
+
+static Callee *find_callee(InlineCtx *ctx, const char *name) {
+    if (!ctx->table_size) {
+        return NULL;
+    }
+    uint32_t mask = ctx->table_size - 1;
+    for (uint32_t i = hash_ptr(name) & mask;; i = (i + 1) & mask) {
+        Callee *c = ctx->table[i];
+        if (!c || c->fn->name == name) {
+            return c;
+        }
+    }
+}
+
+// 深い式でもCのスタックを使い切らないよう、木は明示的なスタックでたどる。
+// 述語は展開の途中でも呼ぶので、スタックは呼び出しごとに持つ
+typedef struct {
+    Node **nodes;
+    int32_t len;
+    int32_t cap;
+} NodeStack;
+
+static void push_node(NodeStack *st, Node *node) {
+    if (!node) {
+        return;
+    }
+    if (st->len == st->cap) {
+        st->cap = st->cap ? st->cap * 2 : 64;
+        st->nodes = realloc(st->nodes, sizeof(Node *) * st->cap);
+    }
+    st->nodes[st->len++] = node;
+}
+
+static void push_children(NodeStack *st, Node *node) {
+    switch (node->kind) {
+        case ND_NUM:
+        case ND_LVAR:
+            return;
+        case ND_BLOCK:
+            for (Node *s = node->body; s; s = s->next) {
+                push_node(st, s);
+            }
+            return;
+        case ND_FUNCALL:
+            for (Node *a = node->args; a; a = a->next) {
+                push_node(st, a);
+            }
+            return;
+        case ND_INLINE:
+            for (Node *s = node->inlined; s; s = s->next) {
+                push_node(st, s);
+            }
+            return;
+        case ND_IF:
+        case ND_WHILE:
+        case ND_FOR:
+            push_node(st, node->cond);
+            push_node(st, node->then);
+            push_node(st, node->els);  // ND_FORではinit
+            push_node(st, node->inc);
+            return;
+        default:
+            push_node(st, node->lhs);
+            push_node(st, node->rhs);
+            return;
+    }
+}
+
+static int32_t count_nodes(Node *node) {
+    NodeStack st = {};
+    push_node(&st, node);
+    int32_t n = 0;
+    while (st.len > 0) {
+        Node *x = st.nodes[--st.len];
+        n++;
+        push_children(&st, x);
+    }
+    free(st.nodes);
+    return n;
+}
+
+// nodeの中に関数呼び出しがあるか
+static bool has_call(Node *node) {
+    NodeStack st = {};
+    push_node(&st, node);
+    bool found = false;
+    while (st.len > 0 && !found) {
+        Node *x = st.nodes[--st.len];
+        found = x->kind == ND_FUNCALL || x->kind == ND_INLINE;
+        push_children(&st, x);
+    }
+    free(st.nodes);
+    return found;
+}
+
+// nodeの中でvarに代入しているか。varがNULLなら変数への代入があるか。
+// 展開済みの呼び出しは、その中の新しい変数にしか代入しないので見ない
+static bool assigns(Node *node, LVar *var) {
+    NodeStack st = {};
+    push_node(&st, node);
+    bool found = false;
+    while (st.len > 0 && !found) {
+        Node *x = st.nodes[--st.len];
+        if (x->kind == ND_INLINE) {
+            continue;
+        }
+        found = x->kind == ND_ASSIGN && x->lhs->kind == ND_LVAR && (!var || x->lhs->lvar == var);
+        push_children(&st, x);
+    }
+    free(st.nodes);
+    return found;
+}
+
+// 文がreturnで終わり、次の文に落ちることがないか
+static bool ends_with_return(Node *node) {
+    if (!node) {
+        return false;
+    }
+    switch (node->kind) {
+        case ND_RETURN:
+            return true;
+        case ND_IF:
+            return ends_with_return(node->then) && ends_with_return(node->els);
+        case ND_BLOCK: {
+            Node *last = node->body;
+            while (last && last->next) {
+                last = last->next;
+            }
+            return ends_with_return(last);
+        }
+        default:
+            return false;
+    }
+}
+
+// 呼び出しを残した場合のコストをノード数に換算したもの。引数の受け渡し、
+// 呼び出し、プロローグとエピローグ、仮引数の格納
+static int32_t call_cost(int32_t nargs) { return 8 + 2 * nargs; }
+
+// fnを展開できるならそのCalleeを作る。
+// 最後に落ちた関数は最後の式の値を返すので、returnで終わる関数だけを展開する。
+// 代入しない変数を読む関数は不定の値を読むので展開しない
+static Callee *new_callee(Function *fn) {
+    if (fn->addr_taken || has_call(fn->body) || !ends_with_return(fn->body)) {
+        return NULL;
+    }
+    Callee *c = calloc(1, sizeof(Callee));
+    c->fn = fn;
+    c->size = count_nodes(fn->body);
+    for (LVar *var = fn->params; var; var = var->next) {
+        c->nparams++;
+    }
+    for (LVar *var = fn->locals; var; var = var->next) {
+        c->nlocals++;
+    }
+    int32_t i = 0;
+    for (LVar *var = fn->locals; i < c->nlocals - c->nparams; var = var->next, i++) {
+        if (!assigns(fn->body, var)) {
+            free(c);
+            return NULL;
+        }
+    }
+    return c;
+}
+
+static void build_table(InlineCtx *ctx, Function *fns) {
+    int32_t n = 0;
+    for (Function *fn = fns; fn; fn = fn->next) {
+        n++;
+    }
+    ctx->table_size = 1;
+    while (ctx->table_size < n * 2) {
+        ctx->table_size *= 2;
+    }
+    ctx->table = calloc(ctx->table_size, sizeof(Callee *));
+    ctx->touched = calloc(n ? n : 1, sizeof(Callee *));
+    uint32_t mask = ctx->table_size - 1;
+    for (Function *fn = fns; fn; fn = fn->next) {
+        Callee *c = new_callee(fn);
+        if (!c) {
+            continue;
+        }
+        uint32_t i = hash_ptr(fn->name) & mask;
+        while (ctx->table[i]) {
+            i = (i + 1) & mask;
+        }
+        ctx->table[i] = c;
+    }
+}
+
+// 展開1回分の、呼ばれる側の変数から呼び出し元への対応
+typedef struct {
+    LVar **from;
+    LVar **to;    // 置き換える呼び出し元の変数
+    Node **args;  // toの代わりに置く引数。NULLなら変数で置き換える
+    int32_t len;
+} VarMap;
+
+static LVar *new_var(InlineCtx *ctx, Function *callee, const char *name, Node *call) {
+    LVar *var = arena_new(OBJ_LVAR, sizeof(LVar));
+    size_t len = strlen(callee->name) + strlen(name) + 2;
+    var->name = arena_alloc(len);
+    snprintf(var->name, len, "%s.%s", callee->name, name);
+    var->ty = ty_int;
+    var->use_begin = call->call_begin;
+    var->use_end = call->call_end;
+    var->next = ctx->fn->locals;
+    ctx->fn->locals = var;
+    return var;
+}
+
+static Node *new_var_node(LVar *var) {
+    Node *node = new_node(ND_LVAR);
+    node->lvar = var;
+    return node;
+}
+
+static Node *copy_node(const Node *node, VarMap *map);
+
+static Node *copy_list(const Node *list, VarMap *map) {
+    Node head = {};
+    Node *cur = &head;
+    for (const Node *n = list; n; n = n->next) {
+        cur = cur->next = copy_node(n, map);
+    }
+    return head.next;
+}
+
+// 本体をコピーし、変数を呼び出し元のものに置き換える
+static Node *copy_node(const Node *node, VarMap *map) {
+    if (!node) {
+        return NULL;
+    }
+    if (node->kind == ND_LVAR) {
+        for (int32_t i = 0; i < map->len; i++) {
+            if (map->from[i] == node->lvar) {
+                return map->args[i] ? copy_node(map->args[i], map) : new_var_node(map->to[i]);
+            }
+        }
+    }
+    Node *n = new_node(node->kind);
+    memcpy(n, node, node_size(node->kind));
+    n->next = NULL;
+    switch (node->kind) {
+        case ND_NUM:
+        case ND_LVAR:
+            return n;
+        case ND_BLOCK:
+            n->body = copy_list(node->body, map);
+            return n;
+        case ND_IF:
+        case ND_WHILE:
+        case ND_FOR:
+            n->cond = copy_node(node->cond, map);
+            n->then = copy_node(node->then, map);
+            n->els = copy_node(node->els, map);  // ND_FORではinit
+            n->inc = copy_node(node->inc, map);
+            return n;
+        default:
+            n->lhs = copy_node(node->lhs, map);
+            n->rhs = copy_node(node->rhs, map);
+            return n;
+    }
+}
+
+// 呼び出しnodeを展開したND_INLINEを返す。展開しないならNULL
+static Node *inline_call(InlineCtx *ctx, Node *call) {
+    Callee *c = find_callee(ctx, call->symbolname);
+    if (!c) {
+        return NULL;
+    }
+    int32_t nargs = 0;
+    for (Node *a = call->args; a; a = a->next) {
+        nargs++;
+    }
+    if (nargs != c->nparams || c->size - call_cost(nargs) > ctx->budget ||
+        ctx->growth + c->size > INLINE_MAX_GROWTH) {
+        return NULL;
+    }
+
+    // 引数の中で代入する変数は、本体で読むときには値が変わっているかもしれない。
+    // &を使う関数の変数はポインタ経由で変わりうる
+    bool pure_args = !ctx->fn->addr_taken;
+    for (Node *a = call->args; a && pure_args; a = a->next) {
+        pure_args = !assigns(a, NULL);
+    }
+
+    Function *callee = c->fn;
+    VarMap map = {
+        .from = malloc(sizeof(LVar *) * c->nlocals),
+        .to = malloc(sizeof(LVar *) * c->nlocals),
+        .args = malloc(sizeof(Node *) * c->nlocals),
+    };
+    Node head = {};
+    Node *cur = &head;
+    Node *arg = call->args;
+    for (LVar *var = callee->params; var; var = var->next) {
+        Node *next = arg->next;
+        arg->next = NULL;
+        int32_t i = map.len++;
+        map.from[i] = var;
+        map.args[i] = NULL;
+        map.to[i] = NULL;
+        if ((arg->kind == ND_NUM || (arg->kind == ND_LVAR && pure_args)) && !assigns(callee->body, var)) {
+            map.args[i] = arg;
+        } else {
+            map.to[i] = new_var(ctx, callee, var->name, call);
+            cur = cur->next = new_binary(ND_ASSIGN, new_var_node(map.to[i]), arg);
+        }
+        arg = next;
+    }
+    int32_t i = 0;
+    for (LVar *var = callee->locals; i < c->nlocals - c->nparams; var = var->next, i++) {
+        int32_t k = map.len++;
+        map.from[k] = var;
+        map.to[k] = new_var(ctx, callee, var->name, call);
+        map.args[k] = NULL;
+    }
+    for (Node *n = callee->body->body; n; n = n->next) {
+        cur = cur->next = copy_node(n, &map);
+    }
+    free(map.from);
+    free(map.to);
+    free(map.args);
+
+    Node *node = new_node(ND_INLINE);
+    node->inlined = head.next;
+    node->ret = new_var(ctx, callee, "ret", call);
+    node->callee = callee;
+
+    ctx->growth += c->size;
+    ctx->ninlined++;
+    if (c->sites++ == 0) {
+        ctx->touched[ctx->ntouched++] = c;
+    }
+    return node;
+}
+
+// 展開の途中のノード。listならslotはリストの今の要素を指し、要素を1つずつ積む
+typedef struct {
+    Node **slot;
+    bool list;
+    bool expanded;  // 子 (listなら今の要素) を積んだ
+} InlineFrame;
+
+typedef struct {
+    InlineFrame *frames;
+    int32_t len;
+    int32_t cap;
+} FrameStack;
+
+static void push_frame(FrameStack *st, Node **slot, bool list) {
+    if (!*slot) {
+        return;
+    }
+    if (st->len == st->cap) {
+        st->cap = st->cap ? st->cap * 2 : 64;
+        st->frames = realloc(st->frames, sizeof(InlineFrame) * st->cap);
+    }
+    st->frames[st->len++] = (InlineFrame){slot, list, false};
+}
+
+// *root以下の呼び出しを内側から、左から順に展開する。展開の予算を使う順番を
+// 変えないよう、子は逆順に積む。リストの次の要素の場所は、前の要素を
+// 置き換えてから求める
+static void inline_calls(InlineCtx *ctx, Node **root) {
+    FrameStack st = {};
+    push_frame(&st, root, false);
+    while (st.len > 0) {
+        InlineFrame *f = &st.frames[st.len - 1];
+        Node *node = *f->slot;
+        if (f->list) {
+            if (f->expanded) {
+                f->slot = &node->next;
+                if (!*f->slot) {
+                    st.len--;
+                    continue;
+                }
+            }
+            f->expanded = true;
+            push_frame(&st, f->slot, false);
+            continue;
+        }
+        if (!f->expanded) {
+            f->expanded = true;
+            switch (node->kind) {
+                case ND_NUM:
+                case ND_LVAR:
+                    break;
+                case ND_BLOCK:
+                    push_frame(&st, &node->body, true);
+                    break;
+                case ND_FUNCALL:
+                    push_frame(&st, &node->args, true);
+                    break;
+                case ND_IF:
+                case ND_WHILE:
+                case ND_FOR:
+                    push_frame(&st, &node->inc, false);
+                    push_frame(&st, &node->els, false);  // ND_FORではinit
+                    push_frame(&st, &node->then, false);
+                    push_frame(&st, &node->cond, false);
+                    break;
+                default:
+                    push_frame(&st, &node->rhs, false);
+                    push_frame(&st, &node->lhs, false);
+                    break;
+            }
+            continue;
+        }
+        Node **slot = f->slot;
+        st.len--;
+        if (node->kind == ND_FUNCALL) {
+            Node *inlined = inline_call(ctx, node);
+            if (inlined) {
+                inlined->next = node->next;
+                *slot = inlined;
+            }
+        }
+    }
+    free(st.frames);
+}
+
+// 展開した呼び出しの数を返す。reportがNULLでなければ、関数ごとに展開した内容を書く
+int32_t inline_functions(Function *fns, int32_t budget, FILE *report) {
+    InlineCtx ctx = {.budget = budget};
+    build_table(&ctx, fns);
+    for (Function *fn = fns; fn; fn = fn->next) {
+        ctx.fn = fn;
+        ctx.growth = 0;
+        ctx.ntouched = 0;
+        inline_calls(&ctx, &fn->body);
+        for (int32_t i = 0; i < ctx.ntouched; i++) {
+            Callee *c = ctx.touched[i];
+            if (report) {
+                fprintf(report, "inline: %s into %s: %d call%s, %d nodes\n", c->fn->name, fn->name, c->sites,
+                        c->sites == 1 ? "" : "s", c->size);
+            }
+            c->sites = 0;
+        }
+    }
+    for (int32_t i = 0; i < ctx.table_size; i++) {
+        free(ctx.table[i]);
+    }
+    free(ctx.table);
+    free(ctx.touched);
+    return ctx.ninlined;
+}
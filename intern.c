@@ -0,0 +1,73 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// 識別子のインターン表。同じ綴りの識別子は同じIdentを指すので、
+// 名前の比較はポインタの比較、変数の検索はIdentからの直接参照で済む。
+// 表はアリーナ上にあり、arena_free_all()されたら作り直す。
+
+static _Thread_local Ident **s_table;
+static _Thread_local uint32_t s_capacity;  // 2のべき乗
+static _Thread_local int32_t s_count;
+static _Thread_local uint64_t s_generation;
+
+// FNV-1a
+static uint32_t hash_name(const char *s, int32_t len) {
+    uint32_t h = 2166136261u;
+    for (int32_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void init_table(uint32_t capacity) {
+    s_table = arena_alloc(sizeof(Ident *) * capacity);
+    s_capacity = capacity;
+}
+
+static void grow(void) {
+    Ident **old = s_table;
+    uint32_t old_capacity = s_capacity;
+    init_table(s_capacity * 2);
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (!old[i]) {
+            continue;
+        }
+        uint32_t j = old[i]->hash & (s_capacity - 1);
+        while (s_table[j]) {
+            j = (j + 1) & (s_capacity - 1);
+        }
+        s_table[j] = old[i];
+    }
+}
+
+Ident *intern(const char *s, int32_t len) {
+    if (!s_table || s_generation != arena_generation()) {
+        s_generation = arena_generation();
+        s_count = 0;
+        init_table(1024);
+    }
+
+    uint32_t h = hash_name(s, len);
+    uint32_t i = h & (s_capacity - 1);
+    for (Ident *id; (id = s_table[i]); i = (i + 1) & (s_capacity - 1)) {
+        if (id->hash == h && id->len == len && !memcmp(id->name, s, len)) {
+            return id;
+        }
+    }
+
+    Ident *id = arena_alloc(sizeof(Ident));
+    id->name = arena_strndup(s, len);
+    id->len = len;
+    id->hash = h;
+    id->id = s_count++;
+    s_table[i] = id;
+    // 負荷率を1/2以下に保つ
+    if ((uint32_t)s_count * 2 > s_capacity) {
+        grow();
+    }
+    return id;
+}
+
+int32_t num_idents(void) { return s_generation == arena_generation() ? s_count : 0; }
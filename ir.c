@@ -0,0 +1,631 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// Node木を仮想レジスタ上の三番地コードに変換する。
+// アドレスを取られない関数ではローカル変数を仮想レジスタに昇格させ、
+// スタックへの読み書きを無くす。
+
+static _Thread_local IRFunc *s_irf;
+static _Thread_local const CompileOptions *s_opts;
+static _Thread_local BasicBlock *s_bb;       // 命令を追加中のブロック
+static _Thread_local BasicBlock *s_last_bb;  // レイアウト順で最後のブロック
+static _Thread_local Node *s_inline;         // 変換中のND_INLINE。returnはその合流点へ飛ぶ
+static _Thread_local BasicBlock *s_inline_end;
+static _Thread_local BasicBlock *s_body;     // 引数を受け取った後のブロック。自己末尾呼び出しが戻る先
+
+static BasicBlock *new_bb(void) {
+    BasicBlock *bb = arena_alloc(sizeof(BasicBlock));
+    return bb;
+}
+
+// ブロックをレイアウトの末尾に置き、以降の命令の追加先にする
+static void start_bb(BasicBlock *bb) {
+    bb->id = s_last_bb ? s_last_bb->id + 1 : 0;
+    if (s_last_bb) {
+        s_last_bb->next = bb;
+    } else {
+        s_irf->blocks = bb;
+    }
+    s_last_bb = bb;
+    s_bb = bb;
+}
+
+static int32_t new_vreg(void) { return s_irf->num_vregs++; }
+
+static IR *emit(IROp op, int32_t dst, int32_t a, int32_t b) {
+    IR *ir = arena_alloc(sizeof(IR));
+    ir->op = op;
+    ir->dst = dst;
+    ir->a = a;
+    ir->b = b;
+    if (s_bb->last) {
+        s_bb->last->next = ir;
+    } else {
+        s_bb->first = ir;
+    }
+    s_bb->last = ir;
+    return ir;
+}
+
+static void emit_jmp(BasicBlock *to) {
+    IR *ir = emit(IR_JMP, -1, -1, -1);
+    ir->then = to;
+}
+
+bool ir_is_terminator(const IR *ir) {
+    return ir->op == IR_RET || ir->op == IR_TAILCALL || ir->op == IR_JMP || ir->op == IR_BR;
+}
+
+// 命令が仮想レジスタを読むフィールドへのポインタをoutに書き出し、その個数を返す。
+// outにはir_max_uses(ir)個分の領域が必要。
+int32_t ir_use_slots(IR *ir, int32_t **out) {
+    int32_t n = 0;
+    switch (ir->op) {
+        case IR_IMM:
+        case IR_ARG:
+        case IR_LEA:
+        case IR_LOAD_VAR:
+        case IR_JMP:
+            break;
+        case IR_MOV:
+        case IR_SHL:
+        case IR_SAR:
+        case IR_LOAD:
+        case IR_STORE_VAR:
+        case IR_BR:
+            out[n++] = &ir->a;
+            break;
+        case IR_RET:
+            if (ir->a >= 0) {
+                out[n++] = &ir->a;
+            }
+            break;
+        case IR_CALL:
+        case IR_TAILCALL:
+        case IR_PHI:
+            for (int32_t i = 0; i < ir->nargs; i++) {
+                out[n++] = &ir->args[i];
+            }
+            break;
+        default:
+            out[n++] = &ir->a;
+            out[n++] = &ir->b;
+            break;
+    }
+    return n;
+}
+
+// 命令が読む仮想レジスタをoutに書き出し、その個数を返す。
+// outにはir_max_uses(ir)個分の領域が必要。
+int32_t ir_uses(const IR *ir, int32_t *out) {
+    int32_t *slots[ir_max_uses(ir)];
+    int32_t n = ir_use_slots((IR *)ir, slots);
+    for (int32_t i = 0; i < n; i++) {
+        out[i] = *slots[i];
+    }
+    return n;
+}
+
+// ir_uses()のoutに必要な要素数
+int32_t ir_max_uses(const IR *ir) {
+    return ir->op == IR_CALL || ir->op == IR_TAILCALL || ir->op == IR_PHI ? ir->nargs + 2 : 2;
+}
+
+// 後続ブロックをoutに書き出し、その個数を返す
+int32_t ir_successors(const BasicBlock *bb, BasicBlock **out) {
+    IR *last = bb->last;
+    if (!last || last->op == IR_RET || last->op == IR_TAILCALL) {
+        return 0;
+    }
+    if (last->op == IR_JMP) {
+        out[0] = last->then;
+        return 1;
+    }
+    out[0] = last->then;
+    out[1] = last->els;
+    return 2;
+}
+
+static const char *op_name(IROp op) {
+    static const char *names[] = {
+        [IR_IMM] = "imm",   [IR_MOV] = "mov",           [IR_ADD] = "add",       [IR_SUB] = "sub",   [IR_MUL] = "mul",
+        [IR_DIV] = "div",   [IR_EQ] = "eq",             [IR_NE] = "ne",         [IR_LT] = "lt",     [IR_LE] = "le",
+        [IR_SHL] = "shl",   [IR_SAR] = "sar",           [IR_ARG] = "arg",       [IR_LEA] = "lea",   [IR_LOAD] = "load",
+        [IR_STORE] = "store", [IR_LOAD_VAR] = "load_var", [IR_STORE_VAR] = "store_var", [IR_CALL] = "call",
+        [IR_TAILCALL] = "tailcall", [IR_RET] = "ret",   [IR_JMP] = "jmp",           [IR_BR] = "br",         [IR_PHI] = "phi",
+    };
+    return names[op];
+}
+
+// IRを読める形で出力する (--dump-ir)
+//
+//   bb1: preds bb0 bb2
+//     v7 = phi v1 [bb0], v9 [bb2]
+//     v8 = lt v7, v4
+//     br v8, bb2, bb3
+void dump_ir(IRFunc *irf, FILE *out) {
+    fprintf(out, "function %s:\n", irf->fn->name);
+    for (BasicBlock *bb = irf->blocks; bb; bb = bb->next) {
+        fprintf(out, "bb%d:", bb->id);
+        if (bb->npreds) {
+            fprintf(out, " preds");
+            for (int32_t i = 0; i < bb->npreds; i++) {
+                fprintf(out, " bb%d", bb->preds[i]->id);
+            }
+        }
+        fprintf(out, "\n");
+        for (IR *ir = bb->first; ir; ir = ir->next) {
+            fprintf(out, "  ");
+            if (ir->dst >= 0) {
+                fprintf(out, "v%d = ", ir->dst);
+            }
+            fprintf(out, "%s", op_name(ir->op));
+            switch (ir->op) {
+                case IR_IMM:
+                case IR_ARG:
+                    fprintf(out, " %ld", ir->imm);
+                    break;
+                case IR_SHL:
+                case IR_SAR:
+                    fprintf(out, " v%d, %ld", ir->a, ir->imm);
+                    break;
+                case IR_LEA:
+                case IR_LOAD_VAR:
+                    fprintf(out, " %s", ir->var->name);
+                    break;
+                case IR_STORE_VAR:
+                    fprintf(out, " %s, v%d", ir->var->name, ir->a);
+                    break;
+                case IR_CALL:
+                case IR_TAILCALL:
+                    fprintf(out, " %s(", ir->name);
+                    for (int32_t i = 0; i < ir->nargs; i++) {
+                        fprintf(out, "%sv%d", i ? ", " : "", ir->args[i]);
+                    }
+                    fprintf(out, ")");
+                    break;
+                case IR_PHI:
+                    for (int32_t i = 0; i < ir->nargs; i++) {
+                        fprintf(out, "%s v%d [bb%d]", i ? "," : "", ir->args[i], ir->from[i]->id);
+                    }
+                    break;
+                case IR_RET:
+                    if (ir->a >= 0) {
+                        fprintf(out, " v%d", ir->a);
+                    }
+                    break;
+                case IR_JMP:
+                    fprintf(out, " bb%d", ir->then->id);
+                    break;
+                case IR_BR:
+                    fprintf(out, " v%d, bb%d, bb%d", ir->a, ir->then->id, ir->els->id);
+                    break;
+                case IR_MOV:
+                case IR_LOAD:
+                    fprintf(out, " v%d", ir->a);
+                    break;
+                default:
+                    fprintf(out, " v%d, v%d", ir->a, ir->b);
+                    break;
+            }
+            fprintf(out, "\n");
+        }
+    }
+}
+
+static int32_t gen_expr(Node *node);
+static void gen_stmt(Node *node, bool tail);
+
+static int32_t load_var(LVar *var) {
+    int32_t dst = new_vreg();
+    if (s_irf->mem_locals) {
+        emit(IR_LOAD_VAR, dst, -1, -1)->var = var;
+    } else {
+        // 後続の代入で変数が書き換わっても値が変わらないようにコピーする
+        emit(IR_MOV, dst, var->vreg, -1);
+    }
+    return dst;
+}
+
+static void store_var(LVar *var, int32_t val) {
+    if (s_irf->mem_locals) {
+        emit(IR_STORE_VAR, -1, val, -1)->var = var;
+    } else {
+        emit(IR_MOV, var->vreg, val, -1);
+    }
+}
+
+static IROp binary_op(NodeKind kind) {
+    switch (kind) {
+        case ND_ADD:
+            return IR_ADD;
+        case ND_SUB:
+            return IR_SUB;
+        case ND_MUL:
+            return IR_MUL;
+        case ND_DIV:
+            return IR_DIV;
+        case ND_EQ:
+            return IR_EQ;
+        case ND_NE:
+            return IR_NE;
+        case ND_LT:
+            return IR_LT;
+        case ND_LE:
+            return IR_LE;
+        default:
+            error("cannot be reached : %s (%d)", __FILE__, __LINE__);
+            return IR_ADD;
+    }
+}
+
+// 引数を左から評価し、値を持つ仮想レジスタの配列を返す
+static int32_t *gen_args(Node *call, int32_t *nargs) {
+    *nargs = 0;
+    for (Node *n = call->args; n; n = n->next) {
+        (*nargs)++;
+    }
+    int32_t *args = arena_alloc(sizeof(int32_t) * *nargs);
+    int32_t i = 0;
+    for (Node *n = call->args; n; n = n->next) {
+        args[i++] = gen_expr(n);
+    }
+    return args;
+}
+
+static void gen_call(IROp op, int32_t dst, Node *call) {
+    int32_t nargs;
+    int32_t *args = gen_args(call, &nargs);
+    IR *ir = emit(op, dst, -1, -1);
+    ir->name = call->symbolname;
+    ir->args = args;
+    ir->nargs = nargs;
+}
+
+// 式の変換の途中。子を変換するときは子のフレームを積んでいったん抜け、
+// 子が終わったらstepの段階から続ける
+typedef struct {
+    Node *node;
+    Node *arg;      // ND_FUNCALL: 次に変換する引数
+    int32_t *args;  // ND_FUNCALL: 変換した引数の値
+    int32_t nargs;
+    int32_t step;
+    int32_t a;  // 先に求めた左辺のアドレスや、呼び出しの結果の仮想レジスタ
+    bool lval;  // 値ではなくアドレスを求める
+} IRFrame;
+
+// 式の変換のスタック。スレッドごとにアリーナ上に置き、関数をまたいで使い回す
+static _Thread_local IRFrame *s_frames;
+static _Thread_local int32_t s_nframes;
+static _Thread_local int32_t s_frames_cap;
+static _Thread_local uint64_t s_generation;
+
+static void push_frame(Node *node, bool lval) {
+    if (s_nframes == s_frames_cap) {
+        s_frames_cap = s_frames_cap ? s_frames_cap * 2 : 256;
+        IRFrame *p = arena_alloc(sizeof(IRFrame) * s_frames_cap);
+        if (s_nframes > 0) {
+            memcpy(p, s_frames, sizeof(IRFrame) * s_nframes);
+        }
+        s_frames = p;
+    }
+    s_frames[s_nframes++] = (IRFrame){.node = node, .lval = lval};
+}
+
+// 代入の左辺のアドレスを求める段階を1つ進め、終わったら真を返す
+static bool gen_addr_step(IRFrame *f, int32_t step, int32_t *val) {
+    Node *node = f->node;
+    switch (node->kind) {
+        case ND_LVAR:
+            *val = new_vreg();
+            emit(IR_LEA, *val, -1, -1)->var = node->lvar;
+            return true;
+        case ND_DEREF:
+            if (step == 0) {
+                push_frame(node->lhs, false);
+                return false;
+            }
+            return true;
+        default:
+            error("代入の左辺値が変数でもDEREFでもありません: %d", node->kind);
+            return true;
+    }
+}
+
+// 各returnは値をnode->retに入れて合流点へ飛ぶ
+static int32_t gen_inline(Node *node) {
+    Node *saved = s_inline;
+    BasicBlock *saved_end = s_inline_end;
+    s_inline = node;
+    s_inline_end = new_bb();
+    for (Node *n = node->inlined; n; n = n->next) {
+        gen_stmt(n, false);
+    }
+    emit_jmp(s_inline_end);
+    start_bb(s_inline_end);
+    s_inline = saved;
+    s_inline_end = saved_end;
+    return load_var(node->ret);
+}
+
+// 式の変換を1段階進め、終わったら真を返す。*valには直前に終わった子の値が入っていて、
+// 終わったらこの式の値を入れる。子のフレームを積んだらfはもう使えない
+static bool gen_step(IRFrame *f, int32_t *val) {
+    Node *node = f->node;
+    int32_t step = f->step++;
+    if (f->lval) {
+        return gen_addr_step(f, step, val);
+    }
+    switch (node->kind) {
+        case ND_NUM:
+            *val = new_vreg();
+            emit(IR_IMM, *val, -1, -1)->imm = node->val;
+            return true;
+        case ND_LVAR:
+            *val = load_var(node->lvar);
+            return true;
+        case ND_ADDR:
+            if (step == 0) {
+                push_frame(node->lhs, true);
+                return false;
+            }
+            return true;
+        case ND_SHL:
+        case ND_SAR: {
+            if (step == 0) {
+                push_frame(node->lhs, false);
+                return false;
+            }
+            int32_t a = *val;
+            *val = new_vreg();
+            emit(node->kind == ND_SHL ? IR_SHL : IR_SAR, *val, a, -1)->imm = node->val;
+            return true;
+        }
+        case ND_DEREF: {
+            if (step == 0) {
+                push_frame(node->lhs, false);
+                return false;
+            }
+            int32_t addr = *val;
+            *val = new_vreg();
+            emit(IR_LOAD, *val, addr, -1);
+            return true;
+        }
+        case ND_ASSIGN:
+            if (node->lhs->kind == ND_LVAR) {
+                if (step == 0) {
+                    push_frame(node->rhs, false);
+                    return false;
+                }
+                store_var(node->lhs->lvar, *val);
+                return true;
+            }
+            switch (step) {
+                case 0:
+                    push_frame(node->lhs, true);
+                    return false;
+                case 1:
+                    f->a = *val;
+                    push_frame(node->rhs, false);
+                    return false;
+                default:
+                    emit(IR_STORE, -1, f->a, *val);
+                    return true;
+            }
+        case ND_FUNCALL: {
+            // 引数を左から1つずつ変換する
+            if (step == 0) {
+                f->a = new_vreg();
+                for (Node *n = node->args; n; n = n->next) {
+                    f->nargs++;
+                }
+                f->args = arena_alloc(sizeof(int32_t) * f->nargs);
+                f->arg = node->args;
+                f->nargs = 0;
+            } else {
+                f->args[f->nargs++] = *val;
+            }
+            if (f->arg) {
+                Node *arg = f->arg;
+                f->arg = arg->next;
+                push_frame(arg, false);
+                return false;
+            }
+            IR *ir = emit(IR_CALL, f->a, -1, -1);
+            ir->name = node->symbolname;
+            ir->args = f->args;
+            ir->nargs = f->nargs;
+            *val = f->a;
+            return true;
+        }
+        case ND_INLINE:
+            // 文の入れ子はソースの括弧の深さまでなので再帰でよい
+            *val = gen_inline(node);
+            return true;
+        default:
+            switch (step) {
+                case 0:
+                    push_frame(node->lhs, false);
+                    return false;
+                case 1:
+                    f->a = *val;
+                    push_frame(node->rhs, false);
+                    return false;
+                default: {
+                    int32_t b = *val;
+                    *val = new_vreg();
+                    emit(binary_op(node->kind), *val, f->a, b);
+                    return true;
+                }
+            }
+    }
+}
+
+// 式の値を持つ仮想レジスタを返す。式の木は深くなりうるので、再帰せずにs_framesで後行順にたどる
+static int32_t gen_expr(Node *node) {
+    int32_t base = s_nframes;
+    int32_t val = -1;
+    push_frame(node, false);
+    while (s_nframes > base) {
+        if (gen_step(&s_frames[s_nframes - 1], &val)) {
+            s_nframes--;
+        }
+    }
+    return val;
+}
+
+// 条件が偽ならelsへ、真ならthenへ分岐してブロックを閉じる
+static void gen_branch(Node *cond, BasicBlock *then, BasicBlock *els) {
+    IR *ir = emit(IR_BR, -1, gen_expr(cond), -1);
+    ir->then = then;
+    ir->els = els;
+}
+
+// tailなら関数の末尾の文で、式文ならその値を返す
+static void gen_stmt(Node *node, bool tail) {
+    switch (node->kind) {
+        case ND_RETURN:
+            if (s_inline) {
+                store_var(s_inline->ret, gen_expr(node->lhs));
+                emit_jmp(s_inline_end);
+            } else if (tail_call_kind(s_irf->fn, node, s_opts) == TAIL_SELF) {
+                // 引数をすべて評価してから仮引数に代入し、先頭へ戻る
+                int32_t nargs;
+                int32_t *args = gen_args(node->lhs, &nargs);
+                LVar *var = s_irf->fn->params;
+                for (int32_t i = 0; i < nargs; i++, var = var->next) {
+                    store_var(var, args[i]);
+                }
+                emit_jmp(s_body);
+            } else if (tail_call_kind(s_irf->fn, node, s_opts) == TAIL_SIBLING) {
+                gen_call(IR_TAILCALL, -1, node->lhs);
+            } else {
+                emit(IR_RET, -1, gen_expr(node->lhs), -1);
+            }
+            // return以降の文は到達不能なブロックに入れる
+            start_bb(new_bb());
+            return;
+        case ND_IF: {
+            BasicBlock *then = new_bb();
+            BasicBlock *els = new_bb();
+            BasicBlock *end = node->els ? new_bb() : els;
+            gen_branch(node->cond, then, els);
+            start_bb(then);
+            gen_stmt(node->then, tail);
+            emit_jmp(end);
+            if (node->els) {
+                start_bb(els);
+                gen_stmt(node->els, tail);
+                emit_jmp(end);
+            }
+            start_bb(end);
+            return;
+        }
+        case ND_WHILE: {
+            BasicBlock *cond = new_bb();
+            BasicBlock *body = new_bb();
+            BasicBlock *end = new_bb();
+            emit_jmp(cond);
+            start_bb(cond);
+            gen_branch(node->cond, body, end);
+            start_bb(body);
+            gen_stmt(node->then, false);
+            emit_jmp(cond);
+            start_bb(end);
+            return;
+        }
+        case ND_FOR: {
+            BasicBlock *cond = new_bb();
+            BasicBlock *body = new_bb();
+            BasicBlock *end = new_bb();
+            if (node->init) {
+                gen_expr(node->init);
+            }
+            emit_jmp(cond);
+            start_bb(cond);
+            if (node->cond) {
+                gen_branch(node->cond, body, end);
+            } else {
+                emit_jmp(body);
+            }
+            start_bb(body);
+            gen_stmt(node->then, false);
+            if (node->inc) {
+                gen_expr(node->inc);
+            }
+            emit_jmp(cond);
+            start_bb(end);
+            return;
+        }
+        case ND_BLOCK:
+            for (Node *n = node->body; n; n = n->next) {
+                gen_stmt(n, tail && !n->next);
+            }
+            return;
+        default: {
+            int32_t val = gen_expr(node);
+            if (tail) {
+                emit(IR_RET, -1, val, -1);
+                start_bb(new_bb());
+            }
+            return;
+        }
+    }
+}
+
+IRFunc *lower_function(Function *fn, const CompileOptions *opts) {
+    if (s_generation != arena_generation()) {
+        s_generation = arena_generation();
+        s_frames = NULL;
+        s_frames_cap = 0;
+    }
+    s_nframes = 0;
+    s_opts = opts;
+    s_irf = arena_alloc(sizeof(IRFunc));
+    s_irf->fn = fn;
+    s_irf->mem_locals = fn->addr_taken;
+    s_last_bb = NULL;
+    s_inline = NULL;
+    start_bb(new_bb());
+
+    if (!s_irf->mem_locals) {
+        for (LVar *var = fn->locals; var; var = var->next) {
+            var->vreg = new_vreg();
+        }
+    }
+
+    // 引数レジスタの値を受け取る。IR_ARGはエントリの先頭にまとめて置く。
+    int32_t i = 0;
+    for (LVar *var = fn->params; var; var = var->next) {
+        if (s_irf->mem_locals) {
+            emit(IR_ARG, new_vreg(), -1, -1)->imm = i++;
+        } else {
+            emit(IR_ARG, var->vreg, -1, -1)->imm = i++;
+        }
+    }
+    if (s_irf->mem_locals) {
+        IR *arg = s_bb->first;
+        for (LVar *var = fn->params; var; var = var->next, arg = arg->next) {
+            emit(IR_STORE_VAR, -1, arg->dst, -1)->var = var;
+        }
+    }
+    s_body = NULL;
+    if (has_self_tail_call(fn, opts)) {
+        s_body = new_bb();
+        emit_jmp(s_body);
+        start_bb(s_body);
+    }
+
+    // スタックマシン版と同じく、末尾まで来たら最後の式文の値を返す。
+    // 末尾のifはどちらの枝も末尾の文として扱う。式文で終わらない経路は0を返す
+    gen_stmt(fn->body, true);
+    int32_t zero = new_vreg();
+    emit(IR_IMM, zero, -1, -1)->imm = 0;
+    emit(IR_RET, -1, zero, -1);
+    return s_irf;
+}
@@ -0,0 +1,87 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "9cc.h"
+
+// assemble()したObjectをメモリに置いて直接実行する (--run)。
+//
+// .textを書き込み可能な領域にコピーして再配置を埋め、実行可能に切り替えてから
+// mainを呼ぶ。プログラム内の関数へのcallはそのまま相対で届く。定義のない関数は
+// hostの表から探し、ホストの関数は2GB以上離れていることがあるので、
+// .textの後ろに置いた jmp [rip+0] と8バイトのアドレスのスタブを経由して呼ぶ。
+
+#define STUB_SIZE 16
+
+static void *find_host(const JitSymbol *host, int32_t nhost, const char *name) {
+    for (int32_t i = 0; i < nhost; i++) {
+        if (!strcmp(host[i].name, name)) {
+            return host[i].addr;
+        }
+    }
+    return NULL;
+}
+
+int64_t jit_run(const Object *obj, const JitSymbol *host, int32_t nhost) {
+    // 領域を確保する前に、呼び出し先とmainがそろっているかを確かめる
+    int32_t nstubs = 0;
+    const ObjSymbol *main = NULL;
+    for (int32_t i = 0; i < obj->nsyms; i++) {
+        const ObjSymbol *sym = &obj->syms[i];
+        if (sym->defined) {
+            if (!strcmp(sym->name, "main")) {
+                main = sym;
+            }
+        } else if (!find_host(host, nhost, sym->name)) {
+            error("jit: 未定義の関数です: %s", sym->name);
+        } else {
+            nstubs++;
+        }
+    }
+    if (!main) {
+        error("jit: mainがありません");
+    }
+
+    size_t stubs = (obj->len + STUB_SIZE - 1) / STUB_SIZE * STUB_SIZE;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (stubs + (size_t)nstubs * STUB_SIZE + page - 1) / page * page;
+    uint8_t *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        error("jit: mmapできません: %s", strerror(errno));
+    }
+    memcpy(base, obj->text, obj->len);
+
+    // シンボルのアドレス。ホストの関数はスタブのアドレスにする
+    uint8_t **addr = malloc(sizeof(uint8_t *) * obj->nsyms);
+    uint8_t *stub = base + stubs;
+    for (int32_t i = 0; i < obj->nsyms; i++) {
+        const ObjSymbol *sym = &obj->syms[i];
+        if (sym->defined) {
+            addr[i] = base + sym->offset;
+            continue;
+        }
+        static const uint8_t jmp_rip[6] = {0xff, 0x25, 0, 0, 0, 0};
+        void *target = find_host(host, nhost, sym->name);
+        memcpy(stub, jmp_rip, sizeof(jmp_rip));
+        memcpy(stub + sizeof(jmp_rip), &target, sizeof(target));
+        addr[i] = stub;
+        stub += STUB_SIZE;
+    }
+    for (int32_t i = 0; i < obj->nrelocs; i++) {
+        const ObjReloc *r = &obj->relocs[i];
+        int32_t rel = addr[r->sym] - (base + r->offset + 4);
+        memcpy(base + r->offset, &rel, 4);
+    }
+    free(addr);
+    if (mprotect(base, size, PROT_READ | PROT_EXEC) < 0) {
+        error("jit: mprotectできません: %s", strerror(errno));
+    }
+
+    int64_t (*entry)(void) = (int64_t (*)(void))(uintptr_t)(base + main->offset);
+    int64_t ret = entry();
+    munmap(base, size);
+    return ret;
+}
@@ -0,0 +1,225 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// コンパイラを他のプログラムに組み込むためのAPI。
+//
+// cc9_compile()はソースを1つコンパイルしてアセンブリをバッファに書く。
+// エラーは終了せずに偽を返し、メッセージはcc9_error()で取り出す。
+// Token, Nodeなどはスレッドごとのアリーナに置き、コンパイルのたびに解放するので、
+// 1つのプロセスで何度コンパイルしても確保したメモリは増えない。
+// コンパイラの状態はスレッドごとに持つので、別々のスレッドからならコンテキストごとに
+// 同時にコンパイルしてよい。コード生成は呼び出したスレッドで行う。
+// オプションはすべてCompileOptionsでコンテキストごとに持つので、
+// 1つのプロセスの中でもコンテキストごとに違う設定でコンパイルできる。
+// cc9_run()はコンパイルしたプログラムをアセンブラもリンカも通さずにメモリ上で実行する。
+
+struct CC9Context {
+    CompileOptions opts;
+    char *error;  // 直前のコンパイルのエラーメッセージ
+    size_t error_len;
+    JitSymbol *symbols;  // cc9_run()で呼べるホストの関数
+    int32_t nsymbols;
+    int32_t symbols_cap;
+};
+
+// cc9_compile()の中ならエラーからの戻り先
+static _Thread_local jmp_buf *s_trap;
+static _Thread_local FILE *s_trap_out;
+
+FILE *error_stream(void) { return s_trap ? s_trap_out : stderr; }
+
+_Noreturn void error_exit(void) {
+    if (s_trap) {
+        longjmp(*s_trap, 1);
+    }
+    exit(1);
+}
+
+// 構文解析した関数をインライン展開、定数畳み込み、ループ最適化してから型を付ける
+void optimize(Function *fns, const CompileOptions *opts, PhaseStats *phases) {
+    int32_t inlined = 0;
+    if (opts->inline_budget >= 0) {
+        inlined = inline_functions(fns, opts->inline_budget, opts->inline_report ? stderr : NULL);
+    }
+    if (opts->inline_report) {
+        fprintf(stderr, "inline: %d calls inlined\n", inlined);
+    }
+    stats_phase(phases, PHASE_INLINE);
+    int32_t removed = fold_constants(fns);
+    stats_phase(phases, PHASE_FOLD);
+    LoopStats loops = {};
+    if (opts->loop_opt) {
+        loops = optimize_loops(fns, opts->unroll);
+    }
+    stats_phase(phases, PHASE_LOOP_OPT);
+    for (Function *fn = fns; fn; fn = fn->next) {
+        add_type(fn->body);
+    }
+    stats_phase(phases, PHASE_ADD_TYPE);
+    if (opts->fold_stats) {
+        fprintf(stderr, "fold: removed %d nodes\n", removed);
+    }
+    if (opts->loop_stats) {
+        fprintf(stderr, "loop: hoisted %d, reduced %d, unrolled %d\n", loops.hoisted, loops.reduced, loops.unrolled);
+    }
+}
+
+// textをコンパイルし、アセンブリを現在のemitの出力先に書く。
+// 書いた後でemit_close()やarena_free_all()を呼ぶのは呼び出し側の役目
+Function *compile(char *text, const CompileOptions *opts, PhaseStats *phases) {
+    emit_set_comments(opts->asm_comments);
+
+    // トークナイズする
+    Token *token = tokenize(text);
+    stats_phase(phases, PHASE_TOKENIZE);
+    Function *fns = parse(token);
+    stats_phase(phases, PHASE_PARSE);
+    optimize(fns, opts, phases);
+
+    // 先頭の式から順にコード生成
+    if (opts->ir_dump && !opts->regalloc) {
+        // スタックマシン版はIRを使わないので、ダンプのためだけに変換する
+        for (Function *fn = fns; fn; fn = fn->next) {
+            optimize_ir(lower_function(fn, opts), opts);
+        }
+    }
+    if (opts->regalloc) {
+        // 線形走査でレジスタを割り当てる。--regallocなしなら従来のスタックマシン
+        generate_code_regalloc(fns, opts);
+    } else {
+        generate_code(fns, opts);
+    }
+    stats_phase(phases, PHASE_CODEGEN);
+    return fns;
+}
+
+CompileOptions default_compile_options(void) {
+    return (CompileOptions){
+        .peephole = true,
+        .tail_calls = true,
+        .asm_comments = true,
+        .loop_opt = true,
+        .unroll = 4,
+        .inline_budget = 16,
+        .codegen_threads = 1,
+    };
+}
+
+// optsがNULLならデフォルトのオプションを使う
+CC9Context *cc9_new(const CompileOptions *opts) {
+    CC9Context *ctx = calloc(1, sizeof(CC9Context));
+    ctx->opts = opts ? *opts : default_compile_options();
+    // 関数ごとに並列に生成すると呼び出したスレッドの出力のキャプチャと衝突する
+    ctx->opts.codegen_threads = 1;
+    return ctx;
+}
+
+void cc9_free(CC9Context *ctx) {
+    if (ctx) {
+        free(ctx->error);
+        free(ctx->symbols);
+        free(ctx);
+    }
+}
+
+static void append(CC9Buffer *out, const char *s, size_t n) {
+    if (out->cap - out->len < n + 1) {
+        size_t cap = out->cap ? out->cap : 4096;
+        while (cap - out->len < n + 1) {
+            cap *= 2;
+        }
+        out->data = realloc(out->data, cap);
+        out->cap = cap;
+    }
+    memcpy(out->data + out->len, s, n);
+    out->len += n;
+    out->data[out->len] = '\0';
+}
+
+// srcのlenバイトをコンパイルし、アセンブリをoutの末尾に足す。
+// エラーなら偽を返し、outは変えない
+bool cc9_compile(CC9Context *ctx, const char *src, size_t len, CC9Buffer *out) {
+    free(ctx->error);
+    ctx->error = NULL;
+    ctx->error_len = 0;
+
+    // トークナイザはNUL終端を読むので、終端したコピーをアリーナに置く
+    char *text = arena_strndup(src, len);
+    set_user_input("<input>", text);
+
+    jmp_buf trap;
+    s_trap_out = open_memstream(&ctx->error, &ctx->error_len);
+    s_trap = &trap;
+    emit_begin_capture();
+    PhaseStats phases;
+    stats_start(&phases);
+    volatile bool ok = false;  // longjmp()で戻った後にも読む
+    if (!setjmp(trap)) {
+        compile(text, &ctx->opts, &phases);
+        ok = true;
+    }
+    s_trap = NULL;
+    fclose(s_trap_out);
+    if (ok) {
+        free(ctx->error);
+        ctx->error = NULL;
+    }
+    size_t n;
+    char *buf = emit_end_capture(&n);
+    if (ok && n > 0) {
+        append(out, buf, n);
+    }
+    free(buf);
+    // Token, Node, LVar, Typeなどをまとめて解放する
+    arena_free_all();
+    return ok;
+}
+
+// 直前のcc9_compile()のエラーメッセージ。エラーがなければNULL
+const char *cc9_error(const CC9Context *ctx) { return ctx->error; }
+
+// cc9_run()のプログラムが定義せずに呼んだnameをaddrの関数にする。
+// 引数は整数で6個まで渡し、戻り値はraxで受け取る
+void cc9_add_symbol(CC9Context *ctx, const char *name, void *addr) {
+    if (ctx->nsymbols == ctx->symbols_cap) {
+        ctx->symbols_cap = ctx->symbols_cap ? ctx->symbols_cap * 2 : 16;
+        ctx->symbols = realloc(ctx->symbols, sizeof(JitSymbol) * ctx->symbols_cap);
+    }
+    ctx->symbols[ctx->nsymbols++] = (JitSymbol){name, addr};
+}
+
+// srcのlenバイトをコンパイルしてメモリ上で実行し、mainの戻り値をresultに入れる。
+// エラーなら偽を返す。実行したプログラムが落ちれば呼び出したプロセスも落ちる
+bool cc9_run(CC9Context *ctx, const char *src, size_t len, int64_t *result) {
+    CC9Buffer out = {};
+    if (!cc9_compile(ctx, src, len, &out)) {
+        return false;
+    }
+
+    jmp_buf trap;
+    s_trap_out = open_memstream(&ctx->error, &ctx->error_len);
+    s_trap = &trap;
+    Object *obj = calloc(1, sizeof(Object));
+    volatile bool ok = false;
+    if (!setjmp(trap)) {
+        assemble(out.data, out.len, obj);
+        *result = jit_run(obj, ctx->symbols, ctx->nsymbols);
+        ok = true;
+    }
+    s_trap = NULL;
+    fclose(s_trap_out);
+    if (ok) {
+        free(ctx->error);
+        ctx->error = NULL;
+    }
+    free_object(obj);
+    free(obj);
+    free(out.data);
+    arena_free_all();
+    return ok;
+}
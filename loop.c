@@ -0,0 +1,709 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// fold_constants()の後、add_type()の前に構文木のループを最適化する。
+//
+// gotoやbreakがないので、ループは入口が1つの自然なループで、ループ木は
+// ND_WHILE/ND_FORの入れ子そのものになる。ループ木を内側から順にたどり、
+//   - ループ内で値の変わらない式を、ループの前で一時変数に計算しておく
+//   - 誘導変数iと不変な値kの積i*kを、反復ごとにkずつ足す一時変数に置き換える
+//   - 初期値、終了条件、増分が定数のforを、展開係数の分だけ本体を並べて展開する
+// を行う。ループの前に置く文は、ループのノードをND_BLOCKに書き換えて入れる。
+//
+// &を使う関数ではポインタ経由で変数が変わりうるので何もしない。そうでなければ
+// 変数を書き換えるのは代入だけで、関数呼び出しやポインタ経由の書き込みは変数に届かない。
+
+#define UNROLL_MAX_NODES 256  // 展開した本体のノード数の上限
+
+// ループ木を帰りがけ順 (内側のループが先) に並べたリスト
+typedef struct Loop Loop;
+struct Loop {
+    Node *node;  // ND_WHILE/ND_FOR
+    Loop *next;
+};
+
+// ループの前に計算しておいた式と、その値を持つ一時変数
+typedef struct {
+    Node *expr;
+    LVar *var;
+} Hoisted;
+
+typedef struct {
+    Function *fn;
+    int32_t unroll;
+    LoopStats *stats;
+    Loop *loops;
+    Loop **tail;
+
+    // 処理中のループで代入する変数。代入の数だけ重複して入る
+    LVar **defs;
+    int32_t ndefs;
+    int32_t defs_cap;
+
+    // 処理中のループの前に置く文
+    Node pre;
+    Node *pre_tail;
+    Hoisted *hoisted;
+    int32_t nhoisted;
+    int32_t hoisted_cap;
+
+    LVar *range_var;  // add_range()で範囲を広げる変数
+    int32_t nnodes;   // count_node()で数えたノード数
+} LoopCtx;
+
+static void find_loops(LoopCtx *ctx, Node *node) {
+    if (!node) {
+        return;
+    }
+    switch (node->kind) {
+        case ND_BLOCK:
+            for (Node *n = node->body; n; n = n->next) {
+                find_loops(ctx, n);
+            }
+            return;
+        case ND_IF:
+            find_loops(ctx, node->then);
+            find_loops(ctx, node->els);
+            return;
+        case ND_WHILE:
+        case ND_FOR: {
+            Loop *loop = arena_alloc(sizeof(Loop));
+            loop->node = node;
+            find_loops(ctx, node->then);
+            *ctx->tail = loop;
+            ctx->tail = &loop->next;
+            return;
+        }
+        default:
+            return;
+    }
+}
+
+typedef void WalkFn(LoopCtx *ctx, Node *node);
+
+// nodeとその子孫を前順にたどってfnを呼ぶ
+static void walk(LoopCtx *ctx, Node *node, WalkFn *fn) {
+    if (!node) {
+        return;
+    }
+    fn(ctx, node);
+    switch (node->kind) {
+        case ND_NUM:
+        case ND_LVAR:
+            return;
+        case ND_BLOCK:
+            for (Node *n = node->body; n; n = n->next) {
+                walk(ctx, n, fn);
+            }
+            return;
+        case ND_FUNCALL:
+            for (Node *n = node->args; n; n = n->next) {
+                walk(ctx, n, fn);
+            }
+            return;
+        case ND_INLINE:
+            for (Node *n = node->inlined; n; n = n->next) {
+                walk(ctx, n, fn);
+            }
+            return;
+        case ND_IF:
+            walk(ctx, node->cond, fn);
+            walk(ctx, node->then, fn);
+            walk(ctx, node->els, fn);
+            return;
+        case ND_WHILE:
+        case ND_FOR:
+            if (node->kind == ND_FOR) {
+                walk(ctx, node->init, fn);
+                walk(ctx, node->inc, fn);
+            }
+            walk(ctx, node->cond, fn);
+            walk(ctx, node->then, fn);
+            return;
+        default:
+            walk(ctx, node->lhs, fn);
+            walk(ctx, node->rhs, fn);
+            return;
+    }
+}
+
+static void add_def(LoopCtx *ctx, Node *node) {
+    if (node->kind != ND_ASSIGN || node->lhs->kind != ND_LVAR) {
+        return;
+    }
+    if (ctx->ndefs == ctx->defs_cap) {
+        ctx->defs_cap = ctx->defs_cap ? ctx->defs_cap * 2 : 16;
+        ctx->defs = realloc(ctx->defs, sizeof(LVar *) * ctx->defs_cap);
+    }
+    ctx->defs[ctx->ndefs++] = node->lhs->lvar;
+}
+
+// ループ内でvarに代入している箇所の数
+static int32_t count_defs(LoopCtx *ctx, LVar *var) {
+    int32_t n = 0;
+    for (int32_t i = 0; i < ctx->ndefs; i++) {
+        n += ctx->defs[i] == var;
+    }
+    return n;
+}
+
+static bool is_invariant(LoopCtx *ctx, Node *node) {
+    switch (node->kind) {
+        case ND_NUM:
+            return true;
+        case ND_LVAR:
+            return count_defs(ctx, node->lvar) == 0;
+        case ND_ADD:
+        case ND_SUB:
+        case ND_MUL:
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE:
+            return is_invariant(ctx, node->lhs) && is_invariant(ctx, node->rhs);
+        case ND_SHL:
+        case ND_SAR:
+            return is_invariant(ctx, node->lhs);
+        default:
+            // 除算はループを1回も回らないときにゼロ除算を起こしうるので動かさない
+            return false;
+    }
+}
+
+static bool same_expr(const Node *a, const Node *b) {
+    if (a->kind != b->kind) {
+        return false;
+    }
+    switch (a->kind) {
+        case ND_NUM:
+            return a->val == b->val;
+        case ND_LVAR:
+            return a->lvar == b->lvar;
+        case ND_SHL:
+        case ND_SAR:
+            return a->val == b->val && same_expr(a->lhs, b->lhs);
+        default:
+            return same_expr(a->lhs, b->lhs) && same_expr(a->rhs, b->rhs);
+    }
+}
+
+static Node *copy_node(const Node *node);
+
+static Node *copy_list(const Node *list) {
+    Node head = {};
+    Node *cur = &head;
+    for (const Node *n = list; n; n = n->next) {
+        cur = cur->next = copy_node(n);
+    }
+    return head.next;
+}
+
+static Node *copy_node(const Node *node) {
+    if (!node) {
+        return NULL;
+    }
+    Node *n = new_node(node->kind);
+    memcpy(n, node, node_size(node->kind));
+    n->next = NULL;
+    switch (node->kind) {
+        case ND_NUM:
+        case ND_LVAR:
+            return n;
+        case ND_BLOCK:
+            n->body = copy_list(node->body);
+            return n;
+        case ND_FUNCALL:
+            n->args = copy_list(node->args);
+            return n;
+        case ND_INLINE:
+            n->inlined = copy_list(node->inlined);
+            return n;
+        case ND_IF:
+        case ND_WHILE:
+        case ND_FOR:
+            n->cond = copy_node(node->cond);
+            n->then = copy_node(node->then);
+            n->els = copy_node(node->els);  // ND_FORではinit
+            n->inc = copy_node(node->inc);
+            return n;
+        default:
+            n->lhs = copy_node(node->lhs);
+            n->rhs = copy_node(node->rhs);
+            return n;
+    }
+}
+
+static Node *new_var_node(LVar *var) {
+    Node *node = new_node(ND_LVAR);
+    node->lvar = var;
+    return node;
+}
+
+static void widen_range(LVar *var, LVar *used) {
+    if (!var->use_begin || used->use_begin < var->use_begin) {
+        var->use_begin = used->use_begin;
+    }
+    if (used->use_end > var->use_end) {
+        var->use_end = used->use_end;
+    }
+}
+
+static void add_range(LoopCtx *ctx, Node *node) {
+    if (node->kind == ND_LVAR) {
+        widen_range(ctx->range_var, node->lvar);
+    }
+}
+
+// exprの値を持つ一時変数を作る。ループ内で使う変数の範囲はループ全体を含むので、
+// exprが使う変数の範囲を合わせればループの前からループの終わりまでを覆う
+static LVar *new_temp(LoopCtx *ctx, Node *expr) {
+    LVar *var = arena_new(OBJ_LVAR, sizeof(LVar));
+    int32_t id = 0;
+    for (LVar *v = ctx->fn->locals; v; v = v->next) {
+        id++;
+    }
+    var->name = arena_alloc(24);
+    snprintf(var->name, 24, "loop.t%d", id);
+    var->ty = ty_int;
+    ctx->range_var = var;
+    walk(ctx, expr, add_range);
+    var->next = ctx->fn->locals;
+    ctx->fn->locals = var;
+    return var;
+}
+
+static void add_pre(LoopCtx *ctx, Node *stmt) {
+    stmt->next = NULL;
+    ctx->pre_tail = ctx->pre_tail->next = stmt;
+}
+
+static bool uses_var(Node *node) {
+    switch (node->kind) {
+        case ND_NUM:
+            return false;
+        case ND_LVAR:
+            return true;
+        case ND_SHL:
+        case ND_SAR:
+            return uses_var(node->lhs);
+        default:
+            return uses_var(node->lhs) || uses_var(node->rhs);
+    }
+}
+
+// 不変式exprをループの前で計算し、その値を持つ変数を返す。同じ式は1回だけ計算する
+static LVar *hoist(LoopCtx *ctx, Node *expr) {
+    for (int32_t i = 0; i < ctx->nhoisted; i++) {
+        if (same_expr(ctx->hoisted[i].expr, expr)) {
+            return ctx->hoisted[i].var;
+        }
+    }
+    LVar *var = new_temp(ctx, expr);
+    add_pre(ctx, new_binary(ND_ASSIGN, new_var_node(var), expr));
+    if (ctx->nhoisted == ctx->hoisted_cap) {
+        ctx->hoisted_cap = ctx->hoisted_cap ? ctx->hoisted_cap * 2 : 8;
+        ctx->hoisted = realloc(ctx->hoisted, sizeof(Hoisted) * ctx->hoisted_cap);
+    }
+    ctx->hoisted[ctx->nhoisted++] = (Hoisted){expr, var};
+    ctx->stats->hoisted++;
+    return var;
+}
+
+// *slotのノードを置き換える。リストの要素ならつながりを引き継ぐ
+static void replace(Node **slot, Node *node) {
+    node->next = (*slot)->next;
+    (*slot)->next = NULL;
+    *slot = node;
+}
+
+// *slot以下の不変な部分式をループの前に出す
+static void hoist_invariants(LoopCtx *ctx, Node **slot) {
+    Node *node = *slot;
+    if (!node) {
+        return;
+    }
+    if (is_invariant(ctx, node)) {
+        // 変数も演算もない式は範囲を決められないので残す (畳み込めなかった定数式だけ)
+        if (node->kind != ND_NUM && node->kind != ND_LVAR && uses_var(node)) {
+            replace(slot, new_var_node(hoist(ctx, node)));
+        }
+        return;
+    }
+    switch (node->kind) {
+        case ND_BLOCK:
+            for (Node **p = &node->body; *p; p = &(*p)->next) {
+                hoist_invariants(ctx, p);
+            }
+            return;
+        case ND_FUNCALL:
+            for (Node **p = &node->args; *p; p = &(*p)->next) {
+                hoist_invariants(ctx, p);
+            }
+            return;
+        case ND_INLINE:
+            for (Node **p = &node->inlined; *p; p = &(*p)->next) {
+                hoist_invariants(ctx, p);
+            }
+            return;
+        case ND_IF:
+            hoist_invariants(ctx, &node->cond);
+            hoist_invariants(ctx, &node->then);
+            hoist_invariants(ctx, &node->els);
+            return;
+        case ND_WHILE:
+        case ND_FOR:
+            if (node->kind == ND_FOR) {
+                hoist_invariants(ctx, &node->init);
+                hoist_invariants(ctx, &node->inc);
+            }
+            hoist_invariants(ctx, &node->cond);
+            hoist_invariants(ctx, &node->then);
+            return;
+        case ND_ASSIGN:
+            // 左辺は変数かアドレスの計算なので、アドレスの中だけを見る
+            if (node->lhs->kind == ND_DEREF) {
+                hoist_invariants(ctx, &node->lhs->lhs);
+            }
+            hoist_invariants(ctx, &node->rhs);
+            return;
+        case ND_NUM:
+        case ND_LVAR:
+            return;
+        default:
+            hoist_invariants(ctx, &node->lhs);
+            hoist_invariants(ctx, &node->rhs);
+            return;
+    }
+}
+
+// forの増分がi = i + s, i = s + i, i = i - sならiを返し、sをstepに入れる
+static LVar *induction_var(Node *inc, int64_t *step) {
+    if (!inc || inc->kind != ND_ASSIGN || inc->lhs->kind != ND_LVAR) {
+        return NULL;
+    }
+    LVar *var = inc->lhs->lvar;
+    Node *rhs = inc->rhs;
+    if (rhs->kind != ND_ADD && rhs->kind != ND_SUB) {
+        return NULL;
+    }
+    Node *l = rhs->lhs;
+    Node *r = rhs->rhs;
+    if (rhs->kind == ND_ADD && l->kind == ND_NUM) {
+        Node *t = l;
+        l = r;
+        r = t;
+    }
+    if (l->kind != ND_LVAR || l->lvar != var || r->kind != ND_NUM || r->val == 0) {
+        return NULL;
+    }
+    *step = rhs->kind == ND_ADD ? r->val : -(int64_t)r->val;
+    return var;
+}
+
+// 誘導変数の積を置き換える一時変数と、反復ごとに足す値
+typedef struct {
+    Node *factor;  // iに掛ける不変な値 (ND_NUMかND_LVAR)
+    LVar *var;
+    Node *delta;
+} Reduced;
+
+typedef struct {
+    LVar *iv;
+    int64_t step;
+    Reduced *list;
+    int32_t len;
+    int32_t cap;
+} Reduction;
+
+// nodeがiv*k, k*iv, iv<<nならkを返す。kはND_NUMかループ内で代入しない変数
+static Node *iv_factor(LoopCtx *ctx, Reduction *r, Node *node) {
+    if (node->kind == ND_SHL && node->lhs->kind == ND_LVAR && node->lhs->lvar == r->iv && node->val < 31) {
+        return new_num(1 << node->val);
+    }
+    if (node->kind != ND_MUL) {
+        return NULL;
+    }
+    Node *k = NULL;
+    if (node->lhs->kind == ND_LVAR && node->lhs->lvar == r->iv) {
+        k = node->rhs;
+    } else if (node->rhs->kind == ND_LVAR && node->rhs->lvar == r->iv) {
+        k = node->lhs;
+    }
+    if (!k || (k->kind != ND_NUM && (k->kind != ND_LVAR || count_defs(ctx, k->lvar) > 0))) {
+        return NULL;
+    }
+    return k;
+}
+
+// i*kの値を持つ一時変数を返す。作れなければNULL
+static LVar *reduce(LoopCtx *ctx, Reduction *r, Node *node, Node *k) {
+    for (int32_t i = 0; i < r->len; i++) {
+        if (same_expr(r->list[i].factor, k)) {
+            return r->list[i].var;
+        }
+    }
+    Node *delta;
+    if (k->kind == ND_NUM) {
+        int64_t d = r->step * k->val;
+        if (d < INT32_MIN || INT32_MAX < d) {
+            return NULL;
+        }
+        delta = new_num(d);
+    } else if (r->step == 1) {
+        delta = k;
+    } else {
+        delta = new_var_node(hoist(ctx, new_binary(ND_MUL, new_num(r->step), k)));
+    }
+    LVar *var = new_temp(ctx, node);
+    add_pre(ctx, new_binary(ND_ASSIGN, new_var_node(var), copy_node(node)));
+    if (r->len == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 4;
+        r->list = realloc(r->list, sizeof(Reduced) * r->cap);
+    }
+    r->list[r->len++] = (Reduced){k, var, delta};
+    return var;
+}
+
+// *slot以下の誘導変数の積を一時変数に置き換える
+static void reduce_strength(LoopCtx *ctx, Reduction *r, Node **slot) {
+    Node *node = *slot;
+    if (!node) {
+        return;
+    }
+    Node *k = iv_factor(ctx, r, node);
+    if (k) {
+        LVar *var = reduce(ctx, r, node, k);
+        if (var) {
+            replace(slot, new_var_node(var));
+            ctx->stats->reduced++;
+            return;
+        }
+    }
+    switch (node->kind) {
+        case ND_NUM:
+        case ND_LVAR:
+            return;
+        case ND_BLOCK:
+            for (Node **p = &node->body; *p; p = &(*p)->next) {
+                reduce_strength(ctx, r, p);
+            }
+            return;
+        case ND_FUNCALL:
+            for (Node **p = &node->args; *p; p = &(*p)->next) {
+                reduce_strength(ctx, r, p);
+            }
+            return;
+        case ND_INLINE:
+            for (Node **p = &node->inlined; *p; p = &(*p)->next) {
+                reduce_strength(ctx, r, p);
+            }
+            return;
+        case ND_IF:
+            reduce_strength(ctx, r, &node->cond);
+            reduce_strength(ctx, r, &node->then);
+            reduce_strength(ctx, r, &node->els);
+            return;
+        case ND_WHILE:
+        case ND_FOR:
+            if (node->kind == ND_FOR) {
+                reduce_strength(ctx, r, &node->init);
+                reduce_strength(ctx, r, &node->inc);
+            }
+            reduce_strength(ctx, r, &node->cond);
+            reduce_strength(ctx, r, &node->then);
+            return;
+        default:
+            reduce_strength(ctx, r, &node->lhs);
+            reduce_strength(ctx, r, &node->rhs);
+            return;
+    }
+}
+
+// 文のリストの末尾tailの後ろにstmtをつなぎ、新しい末尾を返す
+static Node *append_stmt(Node *tail, Node *stmt) {
+    stmt->next = NULL;
+    return tail->next = stmt;
+}
+
+static Node *new_block(Node *body) {
+    Node *node = new_node(ND_BLOCK);
+    node->body = body;
+    return node;
+}
+
+// 本体の最後で一時変数を増やし、iが増えた後もi*kと等しく保つ
+static void strength_reduce_loop(LoopCtx *ctx, Node *loop) {
+    Reduction r = {};
+    r.iv = induction_var(loop->inc, &r.step);
+    if (!r.iv || count_defs(ctx, r.iv) != 1) {
+        return;
+    }
+    reduce_strength(ctx, &r, &loop->cond);
+    reduce_strength(ctx, &r, &loop->then);
+    if (r.len == 0) {
+        return;
+    }
+    Node *tail = loop->then;
+    Node *body = new_block(tail);
+    for (int32_t i = 0; i < r.len; i++) {
+        Node *sum = new_binary(ND_ADD, new_var_node(r.list[i].var), r.list[i].delta);
+        tail = append_stmt(tail, new_binary(ND_ASSIGN, new_var_node(r.list[i].var), sum));
+    }
+    loop->then = body;
+    free(r.list);
+}
+
+static void count_node(LoopCtx *ctx, Node *node) {
+    (void)node;
+    ctx->nnodes++;
+}
+
+static int32_t count_nodes(LoopCtx *ctx, Node *node) {
+    ctx->nnodes = 0;
+    walk(ctx, node, count_node);
+    return ctx->nnodes;
+}
+
+// for (i = c0; i < c1; i = i + s)のような定数回のループの回数。数えられなければ-1
+static int64_t trip_count(LoopCtx *ctx, Node *init, Node *loop) {
+    int64_t s;
+    LVar *iv = induction_var(loop->inc, &s);
+    if (!iv || count_defs(ctx, iv) != 1 || !init || init->kind != ND_ASSIGN || init->lhs->kind != ND_LVAR ||
+        init->lhs->lvar != iv || init->rhs->kind != ND_NUM) {
+        return -1;
+    }
+    Node *cond = loop->cond;
+    if (!cond || (cond->kind != ND_LT && cond->kind != ND_LE && cond->kind != ND_NE)) {
+        return -1;
+    }
+    int64_t c0 = init->rhs->val;
+    bool up = cond->lhs->kind == ND_LVAR && cond->lhs->lvar == iv && cond->rhs->kind == ND_NUM;
+    bool down = cond->rhs->kind == ND_LVAR && cond->rhs->lvar == iv && cond->lhs->kind == ND_NUM;
+    if (up && s > 0) {
+        int64_t c1 = cond->rhs->val;
+        if (cond->kind == ND_LT) {
+            return c0 < c1 ? (c1 - c0 + s - 1) / s : 0;
+        }
+        if (cond->kind == ND_LE) {
+            return c0 <= c1 ? (c1 - c0) / s + 1 : 0;
+        }
+        return c0 <= c1 && (c1 - c0) % s == 0 ? (c1 - c0) / s : -1;
+    }
+    if (down && s < 0 && cond->kind != ND_NE) {
+        // c1 < i, c1 <= i
+        int64_t c1 = cond->lhs->val;
+        if (cond->kind == ND_LT) {
+            return c0 > c1 ? (c0 - c1 - s - 1) / -s : 0;
+        }
+        return c0 >= c1 ? (c0 - c1) / -s + 1 : 0;
+    }
+    return -1;
+}
+
+// 本体と増分のコピーをn回、tailの後ろに並べて最後の文を返す
+static Node *repeat_body(Node *tail, Node *loop, int64_t n) {
+    for (int64_t i = 0; i < n; i++) {
+        tail = append_stmt(tail, copy_node(loop->then));
+        tail = append_stmt(tail, copy_node(loop->inc));
+    }
+    return tail;
+}
+
+// 回数Tが定数のループを展開する。T <= 展開係数Uなら丸ごと直線のコードにし、
+// そうでなければT % U回分を前に出して、残りをU回分ずつ回す。
+// 条件は純粋な比較なので、評価を飛ばしても結果は変わらない。
+// 展開したらループの代わりに置く文の列を返す
+static Node *unroll(LoopCtx *ctx, Node *init, Node *loop) {
+    int64_t trips = trip_count(ctx, init, loop);
+    int32_t u = ctx->unroll;
+    if (trips <= 0 || u <= 1) {
+        return NULL;
+    }
+    int32_t size = count_nodes(ctx, loop->then) + count_nodes(ctx, loop->inc);
+    Node head = {};
+    if (trips <= u && trips * size <= UNROLL_MAX_NODES) {
+        repeat_body(&head, loop, trips);
+        ctx->stats->unrolled++;
+        return head.next;
+    }
+    if ((int64_t)u * size > UNROLL_MAX_NODES) {
+        return NULL;
+    }
+    Node *tail = repeat_body(&head, loop, trips % u);
+    Node body = {};
+    Node *last = repeat_body(&body, loop, u - 1);
+    append_stmt(last, loop->then);
+    loop->then = new_block(body.next);
+    append_stmt(tail, loop);
+    ctx->stats->unrolled++;
+    return head.next;
+}
+
+static void optimize_loop(LoopCtx *ctx, Loop *l) {
+    Node *loop = l->node;
+    ctx->pre.next = NULL;
+    ctx->pre_tail = &ctx->pre;
+    ctx->nhoisted = 0;
+
+    // 初期化式は1回だけ評価するので、不変式の計算より前に出しておく
+    Node *init = NULL;
+    if (loop->kind == ND_FOR && loop->init) {
+        init = loop->init;
+        loop->init = NULL;
+        add_pre(ctx, init);
+    }
+
+    ctx->ndefs = 0;
+    walk(ctx, loop, add_def);
+    hoist_invariants(ctx, &loop->cond);
+    hoist_invariants(ctx, &loop->then);
+    if (loop->kind == ND_FOR) {
+        hoist_invariants(ctx, &loop->inc);
+        strength_reduce_loop(ctx, loop);
+    }
+    if (!ctx->pre.next) {
+        return;
+    }
+
+    // ループのノードをその場でブロックに変え、前に置く文と元のループを並べる
+    Node *copy = new_node(loop->kind);
+    memcpy(copy, loop, node_size(loop->kind));
+    copy->next = NULL;
+    l->node = copy;
+
+    Node *stmts = NULL;
+    if (loop->kind == ND_FOR) {
+        stmts = unroll(ctx, init, copy);
+    }
+    if (!stmts) {
+        stmts = copy;
+    }
+    ctx->pre_tail->next = stmts;
+    loop->kind = ND_BLOCK;
+    loop->body = ctx->pre.next;
+}
+
+LoopStats optimize_loops(Function *fns, int32_t unroll) {
+    LoopStats stats = {};
+    LoopCtx ctx = {.unroll = unroll, .stats = &stats};
+    for (Function *fn = fns; fn; fn = fn->next) {
+        if (fn->addr_taken) {
+            continue;
+        }
+        ctx.fn = fn;
+        ctx.loops = NULL;
+        ctx.tail = &ctx.loops;
+        find_loops(&ctx, fn->body);
+        for (Loop *l = ctx.loops; l; l = l->next) {
+            optimize_loop(&ctx, l);
+        }
+    }
+    free(ctx.defs);
+    free(ctx.hoisted);
+    return stats;
+}
@@ -1,20 +1,484 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "9cc.h"
 
+static void usage(void) {
+    fprintf(stderr,
+            "usage: 9cc [--regalloc] [--fold-stats] [--mem-stats] [--stats] [--no-asm-comments] [--dump-ir]\n"
+            "           [--no-peephole] [--peephole-stats] [--no-loop-opt] [--unroll <n>] [--loop-stats]\n"
+            "           [--no-inline] [--inline-budget <n>] [--inline-report] [--no-tail-calls]\n"
+            "           [--cache <dir>] [--cache-size <MiB>] [--incremental]\n"
+            "           [-c] [-o <output>] <file | ->        (-c also assembles a .s file as is)\n"
+            "       9cc [options] --run <file | ->           (runs main in memory and exits with its value)\n"
+            "       9cc [options] -j <threads> <file>        (generates functions in parallel)\n"
+            "       9cc [options] [-j <threads>] <file>...   (writes one .s, or .o with -c, per input)\n"
+            "       9cc [options] --serve                    (compiles framed requests from stdin)\n");
+}
+
+typedef struct {
+    CompileOptions cc;
+    bool mem_stats;
+    bool stats;  // フェーズごとの時間と確保量をJSONで標準エラー出力に書く
+    bool peephole_stats;
+    bool serve;  // 標準入力からの要求を続けてコンパイルする
+    bool object;  // -c: 組み込みのアセンブラでELFのオブジェクトファイルを書く
+    bool run;     // --run: 組み込みのアセンブラでメモリに置き、mainを呼ぶ
+    const char *cache_dir;   // コンパイル結果のキャッシュを置くディレクトリ。NULLなら使わない
+    size_t cache_max_bytes;  // キャッシュの大きさの上限
+    bool incremental;        // キャッシュに外れたら、変わった関数だけをコンパイルし直す
+} Options;
+
+// 入力を最後まで読み込んだバッファ。mapped > 0ならmmapした領域
+typedef struct {
+    char *text;
+    size_t len;
+    size_t mapped;
+} Source;
+
+// fdを最後まで読み、NUL終端したバッファを返す
+static Source read_all(int fd, const char *name) {
+    size_t cap = 64 * 1024;
+    size_t len = 0;
+    char *buf = malloc(cap);
+    for (;;) {
+        if (cap - len < 2) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        ssize_t n = read(fd, buf + len, cap - len - 1);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error("%s を読めません: %s", name, strerror(errno));
+        }
+        len += n;
+    }
+    buf[len] = '\0';
+    return (Source){buf, len, 0};
+}
+
+// ファイルをコピーせずにmmapし、末尾がNULで終わるようにする。
+// ファイルより1バイト以上大きい無名の領域を予約してその先頭にファイルを
+// 重ねれば、ファイルの長さがページの倍数でも末尾の次のバイトは0になる。
+static Source read_file(const char *path) {
+    if (!strcmp(path, "-")) {
+        return read_all(0, "標準入力");
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        error("%s を開けません: %s", path, strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        error("%s: %s", path, strerror(errno));
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        // パイプなどはmmapできないので読み込む
+        Source src = read_all(fd, path);
+        close(fd);
+        return src;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = st.st_size;
+    size_t reserved = (size + page) / page * page;
+    char *p = mmap(NULL, reserved, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED || mmap(p, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        error("%s をmmapできません: %s", path, strerror(errno));
+    }
+    close(fd);
+    return (Source){p, size, reserved};
+}
+
+static void release_file(Source src) {
+    if (src.mapped) {
+        munmap(src.text, src.mapped);
+    } else {
+        free(src.text);
+    }
+}
+
+// --cacheを使うか。コンパイルの途中経過を報告するオプションがあれば、当たったときに
+// 報告できないので使わない
+static bool use_cache(const Options *opts) {
+    return opts->cache_dir && !opts->cc.fold_stats && !opts->cc.loop_stats && !opts->cc.inline_report &&
+           !opts->cc.ir_dump && !opts->peephole_stats && !opts->mem_stats;
+}
+
+// asm_fdに書いたlenバイトのアセンブリをアセンブルし、オブジェクトファイルをobj_fdに書く
+static void assemble_file(int asm_fd, size_t len, int obj_fd, PhaseStats *phases) {
+    char *text = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, asm_fd, 0) : NULL;
+    if (text == MAP_FAILED) {
+        error("アセンブリをmmapできません: %s", strerror(errno));
+    }
+    Object obj;
+    assemble(text, len, &obj);
+    write_elf(obj_fd, &obj);
+    free_object(&obj);
+    if (text) {
+        munmap(text, len);
+    }
+    stats_phase(phases, PHASE_ASSEMBLE);
+}
+
+static bool is_asm_file(const char *path) {
+    size_t len = strlen(path);
+    return len > 2 && !strcmp(path + len - 2, ".s");
+}
+
+// 1つの翻訳単位をコンパイルする。output_pathがNULLなら標準出力に書く。
+// コンパイラの状態はスレッドごとに持つので、別々のスレッドから同時に呼んでよい。
+static void compile_file(const char *input_path, const char *output_path, const Options *opts) {
+    Source src = read_file(input_path);
+    set_user_input(!strcmp(input_path, "-") ? "<stdin>" : input_path, src.text);
+
+    int fd = 1;
+    if (output_path) {
+        fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            error("%s を開けません: %s", output_path, strerror(errno));
+        }
+    }
+    // -cに.sを渡したらコンパイルせず、組み込みのアセンブラにかけるだけにする
+    if (opts->object && is_asm_file(input_path)) {
+        Object obj;
+        assemble(src.text, src.len, &obj);
+        write_elf(fd, &obj);
+        free_object(&obj);
+        if (output_path) {
+            close(fd);
+        }
+        release_file(src);
+        return;
+    }
+    // -cならアセンブリは名前のない一時ファイルに書き、最後にアセンブルしてobj_fdに書く
+    int obj_fd = -1;
+    FILE *asm_file = NULL;
+    if (opts->object) {
+        obj_fd = fd;
+        asm_file = tmpfile();
+        if (!asm_file) {
+            error("一時ファイルを作れません: %s", strerror(errno));
+        }
+        fd = fileno(asm_file);
+    }
+    // キャッシュに当たれば出力に書くだけで済む。外れたらキャッシュの一時ファイルに生成する
+    PhaseStats phases;
+    Function *fns = NULL;
+    size_t asm_bytes = 0;
+    int asm_fd = fd;
+    CacheKey key = {};
+    char tmp_path[PATH_MAX];
+    bool hit = false;
+    if (use_cache(opts)) {
+        int64_t start = stats_now_ns();
+        key = cache_key(src.text, src.len, &opts->cc);
+        hit = cache_fetch(opts->cache_dir, &key, fd, &asm_bytes);
+        if (!hit) {
+            int tmp = cache_create(opts->cache_dir, tmp_path);
+            asm_fd = tmp >= 0 ? tmp : fd;
+        }
+        int64_t cache_ns = stats_now_ns() - start;
+        stats_start(&phases);
+        phases.cache = hit ? "hit" : "miss";
+        phases.cache_ns = cache_ns;
+    } else {
+        stats_start(&phases);
+    }
+
+    if (!hit) {
+        emit_set_fd(asm_fd);
+        size_t asm_start = emit_bytes_written();
+        if (asm_fd != fd && opts->incremental) {
+            compile_incremental(src.text, &opts->cc, opts->cache_dir, &phases);
+        } else {
+            fns = compile(src.text, &opts->cc, &phases);
+        }
+        emit_close();
+        stats_phase(&phases, PHASE_CODEGEN);  // 最後の書き出しもコード生成に含める
+        asm_bytes = emit_bytes_written() - asm_start;
+        if (asm_fd != fd) {
+            int64_t start = stats_now_ns();
+            cache_commit(opts->cache_dir, &key, asm_fd, tmp_path, fd);
+            cache_evict(opts->cache_dir, opts->cache_max_bytes);
+            phases.cache_ns += stats_now_ns() - start;
+        }
+    }
+    if (opts->object) {
+        assemble_file(fd, asm_bytes, obj_fd, &phases);
+        fclose(asm_file);
+        fd = obj_fd;
+    }
+    if (output_path) {
+        close(fd);
+    }
+
+    if (opts->peephole_stats && !opts->cc.regalloc) {
+        int32_t counts[NUM_PEEPHOLE_RULES] = {0};
+        for (Function *fn = fns; fn; fn = fn->next) {
+            for (int32_t i = 0; i < NUM_PEEPHOLE_RULES; i++) {
+                counts[i] += fn->peephole_counts[i];
+            }
+        }
+        for (int32_t i = 0; i < NUM_PEEPHOLE_RULES; i++) {
+            fprintf(stderr, "peephole: %s %d\n", peephole_rule_names[i], counts[i]);
+        }
+    }
+
+    if (opts->mem_stats) {
+        ArenaStats st = arena_stats();
+        fprintf(stderr, "arena: %zu allocations, %zu bytes used, %zu bytes reserved\n", st.num_allocs, st.used_bytes,
+                st.reserved_bytes);
+    }
+    if (opts->stats) {
+        print_stats_json(stderr, input_path, opts->cc.regalloc ? "regalloc" : "stack", &phases, asm_bytes);
+    }
+    // Token, Node, LVar, Typeなどをまとめて解放する
+    arena_free_all();
+    release_file(src);
+}
+
+// --runのプログラムが定義せずに呼べるホストの関数
+static const JitSymbol host_symbols[] = {
+    {"putchar", (void *)putchar},
+    {"getchar", (void *)getchar},
+    {"exit", (void *)exit},
+    {"abort", (void *)abort},
+};
+
+// --run: 1つの翻訳単位をコンパイルしてメモリ上で実行し、mainの戻り値を返す。
+// アセンブリはファイルに書かずにキャプチャし、アセンブラとリンカと実行ファイルの起動を省く
+static int run_file(const char *input_path, const Options *opts) {
+    Source src = read_file(input_path);
+    set_user_input(!strcmp(input_path, "-") ? "<stdin>" : input_path, src.text);
+
+    PhaseStats phases;
+    stats_start(&phases);
+    CompileOptions cc = opts->cc;
+    // 関数ごとに並列に生成すると出力のキャプチャと衝突する
+    cc.codegen_threads = 1;
+    emit_begin_capture();
+    compile(src.text, &cc, &phases);
+    size_t len;
+    char *text = emit_end_capture(&len);
+    stats_phase(&phases, PHASE_CODEGEN);
+    Object obj;
+    assemble(text, len, &obj);
+    free(text);
+    stats_phase(&phases, PHASE_ASSEMBLE);
+    if (opts->stats) {
+        print_stats_json(stderr, input_path, cc.regalloc ? "regalloc" : "stack", &phases, len);
+    }
+
+    int64_t ret = jit_run(&obj, host_symbols, sizeof(host_symbols) / sizeof(host_symbols[0]));
+    free_object(&obj);
+    arena_free_all();
+    release_file(src);
+    return ret;
+}
+
+// --serve: 標準入力から要求を読み、1つずつコンパイルして標準出力に応答を書く。
+// プロセスを起動し直さずに何度でもコンパイルでき、入力の終わりで終了する。
+//
+//   要求  <ソースのバイト数>\n<ソース>
+//   応答  ok <バイト数>\n<アセンブリ>
+//         error <バイト数>\n<エラーメッセージ>
+static int serve(const Options *opts) {
+    CC9Context *ctx = cc9_new(&opts->cc);
+    CC9Buffer out = {};
+    char *src = NULL;
+    size_t cap = 0;
+    char header[64];
+    while (fgets(header, sizeof(header), stdin)) {
+        char *end;
+        errno = 0;
+        unsigned long long len = strtoull(header, &end, 10);
+        if (end == header || *end != '\n' || errno) {
+            error("--serve: 要求の長さを読めません");
+        }
+        if (cap < len + 1) {
+            cap = len + 1;
+            src = realloc(src, cap);
+        }
+        if (fread(src, 1, len, stdin) != len) {
+            error("--serve: 要求が途中で終わっています");
+        }
+        out.len = 0;
+        if (cc9_compile(ctx, src, len, &out)) {
+            printf("ok %zu\n", out.len);
+            fwrite(out.data, 1, out.len, stdout);
+        } else {
+            const char *msg = cc9_error(ctx);
+            printf("error %zu\n", strlen(msg));
+            fputs(msg, stdout);
+        }
+        fflush(stdout);
+    }
+    free(src);
+    free(out.data);
+    cc9_free(ctx);
+    return 0;
+}
+
+// foo.c -> foo.s (-cならfoo.cもfoo.sもfoo.o), それ以外は末尾に.sか.oを付ける
+static char *output_name(const char *input_path, bool object) {
+    size_t len = strlen(input_path);
+    if ((len > 2 && !strcmp(input_path + len - 2, ".c")) || (object && is_asm_file(input_path))) {
+        len -= 2;
+    }
+    char *name = malloc(len + 3);
+    memcpy(name, input_path, len);
+    strcpy(name + len, object ? ".o" : ".s");
+    return name;
+}
+
+typedef struct {
+    char **inputs;
+    char **outputs;
+    Options *opts;
+} Batch;
+
+static void compile_task(void *arg, int64_t i) {
+    Batch *batch = arg;
+    compile_file(batch->inputs[i], batch->outputs[i], batch->opts);
+}
+
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "引数の個数が正しくありません");
+    Options opts = {.cc = default_compile_options(), .cache_max_bytes = (size_t)64 << 20};
+    char **inputs = calloc(argc, sizeof(char *));
+    int32_t ninputs = 0;
+    char *output_path = NULL;
+    int32_t nthreads = 0;  // 0なら-jの指定なし
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--regalloc")) {
+            opts.cc.regalloc = true;
+        } else if (!strcmp(argv[i], "--fold-stats")) {
+            opts.cc.fold_stats = true;
+        } else if (!strcmp(argv[i], "--mem-stats")) {
+            opts.mem_stats = true;
+        } else if (!strcmp(argv[i], "--serve")) {
+            opts.serve = true;
+        } else if (!strcmp(argv[i], "--stats")) {
+            opts.stats = true;
+        } else if (!strcmp(argv[i], "--no-asm-comments")) {
+            opts.cc.asm_comments = false;
+        } else if (!strcmp(argv[i], "--no-peephole")) {
+            opts.cc.peephole = false;
+        } else if (!strcmp(argv[i], "--peephole-stats")) {
+            opts.peephole_stats = true;
+        } else if (!strcmp(argv[i], "--no-loop-opt")) {
+            opts.cc.loop_opt = false;
+        } else if (!strcmp(argv[i], "--loop-stats")) {
+            opts.cc.loop_stats = true;
+        } else if (!strcmp(argv[i], "--unroll")) {
+            if (++i == argc || atoi(argv[i]) < 1) {
+                usage();
+                return 1;
+            }
+            opts.cc.unroll = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "--no-inline")) {
+            opts.cc.inline_budget = -1;
+        } else if (!strcmp(argv[i], "--inline-budget")) {
+            if (++i == argc || atoi(argv[i]) < 0) {
+                usage();
+                return 1;
+            }
+            opts.cc.inline_budget = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "--inline-report")) {
+            opts.cc.inline_report = true;
+        } else if (!strcmp(argv[i], "--no-tail-calls")) {
+            opts.cc.tail_calls = false;
+        } else if (!strcmp(argv[i], "--cache")) {
+            if (++i == argc) {
+                usage();
+                return 1;
+            }
+            opts.cache_dir = argv[i];
+        } else if (!strcmp(argv[i], "--cache-size")) {
+            if (++i == argc || atoi(argv[i]) < 1) {
+                usage();
+                return 1;
+            }
+            opts.cache_max_bytes = (size_t)atoi(argv[i]) << 20;
+        } else if (!strcmp(argv[i], "--incremental")) {
+            opts.incremental = true;
+        } else if (!strcmp(argv[i], "--dump-ir")) {
+            opts.cc.ir_dump = stderr;
+        } else if (!strcmp(argv[i], "--run")) {
+            opts.run = true;
+        } else if (!strcmp(argv[i], "-c")) {
+            opts.object = true;
+        } else if (!strcmp(argv[i], "-o")) {
+            if (++i == argc) {
+                usage();
+                return 1;
+            }
+            output_path = argv[i];
+        } else if (!strncmp(argv[i], "-j", 2)) {
+            const char *n = argv[i][2] ? argv[i] + 2 : (++i < argc ? argv[i] : NULL);
+            if (!n || atoi(n) < 1) {
+                usage();
+                return 1;
+            }
+            nthreads = atoi(n);
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            usage();
+            return 1;
+        } else {
+            inputs[ninputs++] = argv[i];
+        }
+    }
+    if (opts.serve) {
+        if (ninputs > 0 || output_path) {
+            usage();
+            return 1;
+        }
+        return serve(&opts);
+    }
+    if (ninputs == 0 || (ninputs > 1 && output_path) || (opts.incremental && !opts.cache_dir)) {
+        usage();
         return 1;
     }
+    if (opts.run) {
+        if (ninputs > 1 || output_path || opts.object) {
+            usage();
+            return 1;
+        }
+        return run_file(inputs[0], &opts);
+    }
 
-    set_user_input(argv[1]);
-    // トークナイズする
-    Token *token = tokenize(argv[1]);
-    Function *fns = parse(token);
+    if (ninputs == 1) {
+        // 入力が1つなら、-jのスレッドは関数ごとのコード生成に使う
+        opts.cc.codegen_threads = nthreads ? nthreads : 1;
+        compile_file(inputs[0], output_path, &opts);
+        return 0;
+    }
 
-    // 先頭の式から順にコード生成
-    generate_code(fns);
+    // 入力は互いに独立なので、入力ごとに.sを書き出しながら並列にコンパイルする。
+    // 各入力の出力は-j 1で順にコンパイルした場合と同じになる。
+    char **outputs = calloc(ninputs, sizeof(char *));
+    for (int32_t i = 0; i < ninputs; i++) {
+        if (!strcmp(inputs[i], "-")) {
+            usage();
+            return 1;
+        }
+        outputs[i] = output_name(inputs[i], opts.object);
+    }
+    Batch batch = {inputs, outputs, &opts};
+    run_parallel(nthreads ? nthreads : 1, ninputs, compile_task, &batch);
     return 0;
-}
\ No newline at end of file
+}
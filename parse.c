@@ -1,35 +1,70 @@
-#include <ctype.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "9cc.h"
 
 // 現在着目しているトークン
-static Token *s_token;
+static _Thread_local Token *s_token;
+
+// 解析中の関数
+static _Thread_local Function *s_fn;
 
 // 入力プログラム
-static char *s_user_input;
+static _Thread_local char *s_user_input;
+static _Thread_local const char *s_filename;
 
-void set_user_input(char *input) { s_user_input = input; }
+void set_user_input(const char *filename, char *input) {
+    s_filename = filename;
+    s_user_input = input;
+}
 
 // ローカル変数
-static LVar *locals;
+static _Thread_local LVar *locals;
 
-// エラー箇所を報告する
+// エラー箇所を報告する。
+//
+//   foo.c:2:5: x = ;
+//                  ^ 数ではありません
 void error_at(const char *loc, const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
 
-    int pos = loc - s_user_input;
-    fprintf(stderr, "%s\n", s_user_input);
-    fprintf(stderr, "%*s", pos, "");  // pos個の空白を出力
-    fprintf(stderr, "^ ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    // locを含む行を探す
+    const char *line = loc;
+    while (s_user_input < line && line[-1] != '\n') {
+        line--;
+    }
+    const char *end = loc;
+    while (*end && *end != '\n') {
+        end++;
+    }
+    int line_no = 1;
+    for (const char *p = s_user_input; p < line; p++) {
+        if (*p == '\n') {
+            line_no++;
+        }
+    }
+
+    int col = loc - line;
+    FILE *out = error_stream();
+    int indent = fprintf(out, "%s:%d:%d: ", s_filename, line_no, col + 1);
+    fprintf(out, "%.*s\n", (int)(end - line), line);
+    fprintf(out, "%*s", indent + col, "");  // indent+col個の空白を出力
+    fprintf(out, "^ ");
+    vfprintf(out, fmt, ap);
+    fprintf(out, "\n");
+    va_end(ap);
+    error_exit();
 }
 
 bool peek(const char *op) {
@@ -49,6 +84,8 @@ bool consume(const char *op) {
     return false;
 }
 
+bool peek_kind(const TokenKind kind) { return s_token->kind == kind; }
+
 bool consume_kind(const TokenKind kind) {
     if (s_token->kind != kind) {
         return false;
@@ -92,7 +129,7 @@ int32_t expect_number() {
 //     Token *t = consume_ident();
 //     if (t) {
 //         return s_token;
-//         // return strndup(maybe_ident->str, maybe_ident->len);
+//         // return arena_strndup(maybe_ident->str, maybe_ident->len);
 //     }
 //     return NULL;
 // }
@@ -101,7 +138,7 @@ bool at_eof() { return s_token->kind == TK_EOF; }
 
 // 新しいトークンを作成してcurに繋げる
 Token *new_token(const TokenKind kind, Token *cur, char *str, const int32_t len) {
-    Token *tok = calloc(1, sizeof(Token));
+    Token *tok = arena_new(OBJ_TOKEN, sizeof(Token));
     tok->kind = kind;
     tok->str = str;
     tok->len = len;
@@ -109,29 +146,140 @@ Token *new_token(const TokenKind kind, Token *cur, char *str, const int32_t len)
     return tok;
 }
 
-bool startswith(const char *s1, const char *s2) { return strncmp(s1, s2, strlen(s2)) == 0; }
+// 文字の分類表。tokenize()は1文字ごとにこの表を1回引くだけで分岐する。
+enum {
+    CC_SPACE = 1 << 0,   // 空白文字
+    CC_IDENT1 = 1 << 1,  // 識別子の先頭に使える文字
+    CC_DIGIT = 1 << 2,   // 数字
+    CC_PUNCT = 1 << 3,   // 1文字の記号
+    CC_CMP = 1 << 4,     // 後ろに'='が続くと2文字の演算子になる記号
+};
+
+static const uint8_t s_char_class[256] = {
+    [' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\n'] = CC_SPACE, ['\v'] = CC_SPACE, ['\f'] = CC_SPACE, ['\r'] = CC_SPACE,
+    ['_'] = CC_IDENT1,
+    ['a'] = CC_IDENT1, ['b'] = CC_IDENT1, ['c'] = CC_IDENT1, ['d'] = CC_IDENT1, ['e'] = CC_IDENT1, ['f'] = CC_IDENT1,
+    ['g'] = CC_IDENT1, ['h'] = CC_IDENT1, ['i'] = CC_IDENT1, ['j'] = CC_IDENT1, ['k'] = CC_IDENT1, ['l'] = CC_IDENT1,
+    ['m'] = CC_IDENT1, ['n'] = CC_IDENT1, ['o'] = CC_IDENT1, ['p'] = CC_IDENT1, ['q'] = CC_IDENT1, ['r'] = CC_IDENT1,
+    ['s'] = CC_IDENT1, ['t'] = CC_IDENT1, ['u'] = CC_IDENT1, ['v'] = CC_IDENT1, ['w'] = CC_IDENT1, ['x'] = CC_IDENT1,
+    ['y'] = CC_IDENT1, ['z'] = CC_IDENT1,
+    ['A'] = CC_IDENT1, ['B'] = CC_IDENT1, ['C'] = CC_IDENT1, ['D'] = CC_IDENT1, ['E'] = CC_IDENT1, ['F'] = CC_IDENT1,
+    ['G'] = CC_IDENT1, ['H'] = CC_IDENT1, ['I'] = CC_IDENT1, ['J'] = CC_IDENT1, ['K'] = CC_IDENT1, ['L'] = CC_IDENT1,
+    ['M'] = CC_IDENT1, ['N'] = CC_IDENT1, ['O'] = CC_IDENT1, ['P'] = CC_IDENT1, ['Q'] = CC_IDENT1, ['R'] = CC_IDENT1,
+    ['S'] = CC_IDENT1, ['T'] = CC_IDENT1, ['U'] = CC_IDENT1, ['V'] = CC_IDENT1, ['W'] = CC_IDENT1, ['X'] = CC_IDENT1,
+    ['Y'] = CC_IDENT1, ['Z'] = CC_IDENT1,
+    ['0'] = CC_DIGIT, ['1'] = CC_DIGIT, ['2'] = CC_DIGIT, ['3'] = CC_DIGIT, ['4'] = CC_DIGIT, ['5'] = CC_DIGIT,
+    ['6'] = CC_DIGIT, ['7'] = CC_DIGIT, ['8'] = CC_DIGIT, ['9'] = CC_DIGIT,
+    ['+'] = CC_PUNCT, ['-'] = CC_PUNCT, ['*'] = CC_PUNCT, ['/'] = CC_PUNCT, ['('] = CC_PUNCT, [')'] = CC_PUNCT,
+    [';'] = CC_PUNCT, ['{'] = CC_PUNCT, ['}'] = CC_PUNCT, [','] = CC_PUNCT, ['&'] = CC_PUNCT,
+    ['<'] = CC_PUNCT | CC_CMP, ['>'] = CC_PUNCT | CC_CMP, ['='] = CC_PUNCT | CC_CMP, ['!'] = CC_CMP,
+};
+
+static inline bool has_class(char c, uint8_t cls) { return s_char_class[(uint8_t)c] & cls; }
+
+bool is_ident1(const char c) { return has_class(c, CC_IDENT1); }
+
+bool is_ident2(const char c) { return has_class(c, CC_IDENT1 | CC_DIGIT); }
 
-bool is_ident1(const char c) { return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_'; }
+bool is_alnum(const char c) { return is_ident2(c); }
 
-bool is_ident2(const char c) { return is_ident1(c) || ('0' <= c && c <= '9'); }
+// SIMDで、クラスclsに属する文字の連続をまとめて読み飛ばす。
+// ロードは境界に揃えて行うので、NUL終端の後ろのページを読むことはない。
+#if defined(__AVX2__)
+#define SCAN_WIDTH 32
+typedef __m256i Vec;
+#define vec_load(p) _mm256_load_si256((const __m256i *)(p))
+#define vec_set1(c) _mm256_set1_epi8(c)
+#define vec_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vec_gt(a, b) _mm256_cmpgt_epi8(a, b)
+#define vec_and(a, b) _mm256_and_si256(a, b)
+#define vec_or(a, b) _mm256_or_si256(a, b)
+#define vec_mask(a) ((uint32_t)_mm256_movemask_epi8(a))
+#elif defined(__SSE2__)
+#define SCAN_WIDTH 16
+typedef __m128i Vec;
+#define vec_load(p) _mm_load_si128((const __m128i *)(p))
+#define vec_set1(c) _mm_set1_epi8(c)
+#define vec_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define vec_gt(a, b) _mm_cmpgt_epi8(a, b)
+#define vec_and(a, b) _mm_and_si128(a, b)
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_mask(a) ((uint32_t)_mm_movemask_epi8(a))
+#endif
+
+#ifdef SCAN_WIDTH
+// lo <= c && c <= hi (符号付き比較なので0x80以上の文字は範囲外になる)
+static inline Vec vec_in_range(Vec v, char lo, char hi) {
+    return vec_and(vec_gt(v, vec_set1(lo - 1)), vec_gt(vec_set1(hi + 1), v));
+}
 
-bool is_alnum(const char c) { return is_ident2(c); }
+static inline uint32_t class_mask(Vec v, uint8_t cls) {
+    Vec m = vec_set1(0);
+    if (cls & CC_SPACE) {
+        m = vec_or(m, vec_or(vec_eq(v, vec_set1(' ')), vec_in_range(v, '\t', '\r')));
+    }
+    if (cls & CC_IDENT1) {
+        m = vec_or(m, vec_or(vec_in_range(v, 'a', 'z'), vec_in_range(v, 'A', 'Z')));
+        m = vec_or(m, vec_eq(v, vec_set1('_')));
+    }
+    if (cls & CC_DIGIT) {
+        m = vec_or(m, vec_in_range(v, '0', '9'));
+    }
+    return vec_mask(m);
+}
 
-// ポインタを更新したいので**pにしている
-bool consume_keyword_token(char **p, Token **cur) {
-    char keywords[][6] = {"return", "if", "else", "while", "for"};
-    TokenKind keywords_token[] = {TK_RETURN, TK_IF, TK_ELSE, TK_WHILE, TK_FOR};
-    int keywords_size[] = {6, 2, 4, 5, 3};
-    int num_keywords = sizeof(keywords_size) / sizeof(int);
-    for (int i = 0; i < num_keywords; i++) {
-        int keyword_len = keywords_size[i];
-        if (strncmp(*p, keywords[i], keyword_len) == 0 && !isalnum((*p)[keyword_len])) {
-            *cur = new_token(keywords_token[i], *cur, *p, keyword_len);
-            *p += keyword_len;
-            return true;
+static char *skip_class(char *p, uint8_t cls) {
+    // 短い連続はSIMDを使わずに済ませる
+    for (int i = 0; i < 4; i++, p++) {
+        if (!has_class(*p, cls)) {
+            return p;
         }
     }
-    return false;
+    uintptr_t off = (uintptr_t)p % SCAN_WIDTH;
+    char *q = p - off;
+    // 境界より前の部分は属するものとして扱う
+    uint32_t mask = class_mask(vec_load(q), cls) | (uint32_t)((1ull << off) - 1);
+    for (;;) {
+        uint32_t miss = ~mask;
+#if SCAN_WIDTH < 32
+        miss &= (1u << SCAN_WIDTH) - 1;
+#endif
+        if (miss) {
+            return q + __builtin_ctz(miss);
+        }
+        q += SCAN_WIDTH;
+        mask = class_mask(vec_load(q), cls);
+    }
+}
+#else
+static char *skip_class(char *p, uint8_t cls) {
+    while (has_class(*p, cls)) {
+        p++;
+    }
+    return p;
+}
+#endif
+
+// キーワードの完全ハッシュ表。(長さ * 7 + 先頭文字) & 7 で衝突しない。
+static const struct {
+    char name[8];
+    int32_t len;
+    TokenKind kind;
+} s_keywords[8] = {
+    [1] = {"else", 4, TK_ELSE},
+    [2] = {"while", 5, TK_WHILE},
+    [3] = {"for", 3, TK_FOR},
+    [4] = {"return", 6, TK_RETURN},
+    [7] = {"if", 2, TK_IF},
+};
+
+// 識別子がキーワードならそのトークン種別を、そうでなければTK_IDENTを返す
+static TokenKind keyword_kind(const char *p, int64_t len) {
+    int32_t h = (len * 7 + p[0]) & 7;
+    if (s_keywords[h].len == len && !memcmp(p, s_keywords[h].name, len)) {
+        return s_keywords[h].kind;
+    }
+    return TK_IDENT;
 }
 
 // 入力文字列pをトークナイズしてそれを返す
@@ -141,41 +289,46 @@ Token *tokenize(char *p) {
     Token *cur = &head;
 
     while (*p) {
+        uint8_t cls = s_char_class[(uint8_t)*p];
+
         // 空白文字をスキップ
-        if (isspace(*p)) {
-            p++;
+        if (cls & CC_SPACE) {
+            p = skip_class(p + 1, CC_SPACE);
             continue;
         }
 
-        if (startswith(p, "==") || startswith(p, "!=") || startswith(p, "<=") || startswith(p, ">=")) {
+        // ==, !=, <=, >=
+        if ((cls & CC_CMP) && p[1] == '=') {
             cur = new_token(TK_RESERVED, cur, p, 2);
             p += 2;
             continue;
         }
 
-        if (strchr("+-*/()<>;={},&", *p)) {
+        if (cls & CC_PUNCT) {
             cur = new_token(TK_RESERVED, cur, p++, 1);
             continue;
         }
 
-        if (consume_keyword_token(&p, &cur)) {
-            continue;
-        }
-
-        if (is_ident1(*p)) {
+        // 識別子とキーワード
+        if (cls & CC_IDENT1) {
             char *start = p;
-            do {
-                p++;
-            } while (is_ident2(*p));
-            cur = new_token(TK_IDENT, cur, start, p - start);
+            p = skip_class(p + 1, CC_IDENT1 | CC_DIGIT);
+            cur = new_token(keyword_kind(start, p - start), cur, start, p - start);
+            if (cur->kind == TK_IDENT) {
+                cur->ident = intern(start, p - start);
+            }
             continue;
         }
 
-        if (isdigit(*p)) {
-            cur = new_token(TK_NUM, cur, p, 0);
+        if (cls & CC_DIGIT) {
             char *start = p;
-            cur->val = strtol(p, &p, 10);
-            cur->len = p - start;
+            p = skip_class(p + 1, CC_DIGIT);
+            uint64_t val = 0;
+            for (char *q = start; q < p; q++) {
+                val = val * 10 + (*q - '0');
+            }
+            cur = new_token(TK_NUM, cur, start, p - start);
+            cur->val = val;
             continue;
         }
 
@@ -186,17 +339,32 @@ Token *tokenize(char *p) {
 }
 
 // 変数を名前で検索する。見つからなかった場合はNULLを返す。
-LVar *find_lvar(const Token *tok) {
-    for (LVar *var = locals; var; var = var->next) {
-        if (strlen(var->name) == (size_t)tok->len && !strncmp(tok->str, var->name, tok->len)) {
-            return var;
-        }
+LVar *find_lvar(const Token *tok) { return find_var(tok->ident); }
+
+// kindが使うフィールドまでの大きさ
+size_t node_size(NodeKind kind) {
+    switch (kind) {
+        case ND_NUM:
+            return offsetof(Node, lhs);
+        case ND_LVAR:
+            return offsetof(Node, lvar) + sizeof(LVar *);
+        case ND_BLOCK:
+            return offsetof(Node, body) + sizeof(Node *);
+        case ND_FUNCALL:
+            return offsetof(Node, call_end) + sizeof(char *);
+        case ND_INLINE:
+            return offsetof(Node, callee) + sizeof(Function *);
+        case ND_IF:
+        case ND_WHILE:
+        case ND_FOR:
+            return sizeof(Node);
+        default:
+            return offsetof(Node, rhs) + sizeof(Node *);
     }
-    return NULL;
 }
 
 Node *new_node(const NodeKind kind) {
-    Node *node = calloc(1, sizeof(Node));
+    Node *node = arena_new(OBJ_NODE, node_size(kind));
     node->kind = kind;
     return node;
 }
@@ -221,13 +389,6 @@ Type *type_suffix(void);
 Node *compound_stmt(void);
 Node *stmt(void);
 Node *expr(void);
-Node *assign(void);
-Node *equality(void);
-Node *relational(void);
-Node *add(void);
-Node *mul(void);
-Node *unary(void);
-Node *primary(void);
 
 // program = function-definition*
 Function *program() {
@@ -239,20 +400,31 @@ Function *program() {
     return head.next;
 }
 
-static char *get_ident(Token *tok) {
+static Ident *get_ident(Token *tok) {
     if (tok->kind != TK_IDENT) {
         error_at(tok->str, "識別子ではありません");
     }
-    return strndup(tok->str, tok->len);
+    return tok->ident;
 }
 
-static LVar *new_lvar(char *name, Type *ty) {
-    LVar *var = calloc(1, sizeof(LVar));
-    var->name = name;
+// 変数を使った位置を記録する
+static void use_lvar(LVar *var, const char *pos) {
+    if (!var->use_begin || pos < var->use_begin) {
+        var->use_begin = pos;
+    }
+    if (pos > var->use_end) {
+        var->use_end = pos;
+    }
+}
+
+static LVar *new_lvar(Ident *ident, Type *ty) {
+    LVar *var = arena_new(OBJ_LVAR, sizeof(LVar));
+    var->name = ident->name;
+    var->ident = ident;
     var->ty = ty;
     var->next = locals;
-    var->offset = locals ? locals->offset + 8 : 8;
     locals = var;
+    declare_var(var, true);
     return var;
 }
 
@@ -265,20 +437,52 @@ static void create_param_lvars(Type *param) {
     new_lvar(get_ident(param->name), param);
 }
 
+// 解析中の関数の、最も外側のループのソース上の範囲
+typedef struct LoopRange LoopRange;
+struct LoopRange {
+    LoopRange *next;
+    const char *begin;
+    const char *end;
+};
+
+static _Thread_local LoopRange *s_loops;
+static _Thread_local int32_t s_loop_depth;
+
+// ループ内で使う変数の範囲をループ全体に広げる。次の反復で前の値を読むことがあるため。
+static void extend_use_ranges(LVar *vars) {
+    for (LVar *var = vars; var; var = var->next) {
+        for (LoopRange *loop = s_loops; loop; loop = loop->next) {
+            if (var->use_begin <= loop->end && loop->begin <= var->use_end) {
+                use_lvar(var, loop->begin);
+                use_lvar(var, loop->end);
+            }
+        }
+    }
+}
+
 // functon-definition = declarator "{" compound-stmt
 Function *function(void) {
     Type *ty = declarator();
 
     locals = NULL;
+    s_loops = NULL;
+    enter_scope();
 
-    Function *fn = calloc(1, sizeof(Function));
-    fn->name = get_ident(ty->name);
+    Function *fn = arena_alloc(sizeof(Function));
+    fn->name = get_ident(ty->name)->name;
     create_param_lvars(ty->params);
     fn->params = locals;
+    // 引数はプロローグで格納するので関数の先頭から生きている
+    for (LVar *var = locals; var; var = var->next) {
+        use_lvar(var, ty->name->str);
+    }
 
     expect("{");
+    s_fn = fn;
     fn->body = compound_stmt();
     fn->locals = locals;
+    leave_scope();
+    extend_use_ranges(locals);
 
     return fn;
 }
@@ -322,6 +526,7 @@ Type *type_suffix() {
 // compound-stmt = stmt* "}"
 Node *compound_stmt() {
     Node *node = new_node(ND_BLOCK);
+    enter_scope();
 
     Node head = {};
     Node *cur = &head;
@@ -330,31 +535,23 @@ Node *compound_stmt() {
     }
     expect("}");
     node->body = head.next;
+    leave_scope();
     return node;
 }
 
-Node *stmt(void) {
-    Node *node = NULL;
-
-    if (consume_kind(TK_RETURN)) {
-        node = new_binary(ND_RETURN, expr(), NULL);
-        expect(";");
-    } else if (consume_kind(TK_IF)) {
-        node = new_node(ND_IF);
-        expect("(");
-        node->cond = expr();
-        expect(")");
-        node->then = stmt();
-        if (consume_kind(TK_ELSE)) {
-            node->els = stmt();
-        }
-    } else if (consume_kind(TK_WHILE)) {
+// while/forを解析し、最も外側のループならその範囲を記録する
+static Node *loop_stmt(void) {
+    const char *begin = s_token->str;
+    Node *node;
+    s_loop_depth++;
+    if (consume_kind(TK_WHILE)) {
         node = new_node(ND_WHILE);
         expect("(");
         node->cond = expr();
         expect(")");
         node->then = stmt();
-    } else if (consume_kind(TK_FOR)) {
+    } else {
+        consume_kind(TK_FOR);
         node = new_node(ND_FOR);
         expect("(");
         if (!peek(";")) {
@@ -370,6 +567,34 @@ Node *stmt(void) {
         }
         expect(")");
         node->then = stmt();
+    }
+    if (--s_loop_depth == 0) {
+        LoopRange *loop = arena_alloc(sizeof(LoopRange));
+        loop->begin = begin;
+        loop->end = s_token->str;
+        loop->next = s_loops;
+        s_loops = loop;
+    }
+    return node;
+}
+
+Node *stmt(void) {
+    Node *node = NULL;
+
+    if (consume_kind(TK_RETURN)) {
+        node = new_binary(ND_RETURN, expr(), NULL);
+        expect(";");
+    } else if (consume_kind(TK_IF)) {
+        node = new_node(ND_IF);
+        expect("(");
+        node->cond = expr();
+        expect(")");
+        node->then = stmt();
+        if (consume_kind(TK_ELSE)) {
+            node->els = stmt();
+        }
+    } else if (peek_kind(TK_WHILE) || peek_kind(TK_FOR)) {
+        node = loop_stmt();
     } else if (consume("{")) {
         node = compound_stmt();
     } else if (consume(";")) {
@@ -381,144 +606,236 @@ Node *stmt(void) {
     return node;
 }
 
-// expr = equality
-Node *expr(void) { return assign(); }
-
-Node *assign(void) {
-    Node *node = equality();
-    if (consume("=")) {
-        return new_binary(ND_ASSIGN, node, assign());
+// expr       = assign
+// assign     = equality ("=" assign)?
+// equality   = relational ("==" relational | "!=" relational)*
+// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
+// add        = mul ("+" mul | "-" mul)*
+// mul        = unary ("*" unary | "/" unary)*
+// unary      = ("+" | "-" | "*" | "&") unary | primary
+// primary    = num
+//            | ident ("(" (expr ("," expr)* ","?)? ")")?
+//            | "(" expr ")"
+//
+// 生成したプログラムの式は何千段も入れ子になることがあるので、規則ごとに再帰せず、
+// 二項演算子を優先順位の表で扱い、括弧、前置演算子、呼び出しの途中を明示的なスタックに積む。
+
+// 二項演算子。precが大きいほど強く結びつき、0なら二項演算子ではない
+typedef struct {
+    NodeKind kind;
+    int8_t prec;
+    bool swap;  // a > bをb < aにする
+} BinaryOp;
+
+#define PREC_ASSIGN 1  // 代入だけは右結合
+
+static BinaryOp binary_op(const Token *tok) {
+    if (tok->kind != TK_RESERVED) {
+        return (BinaryOp){};
     }
-    return node;
+    if (tok->len == 2) {
+        switch (tok->str[0]) {
+            case '=':
+                return (BinaryOp){ND_EQ, 2, false};
+            case '!':
+                return (BinaryOp){ND_NE, 2, false};
+            case '<':
+                return (BinaryOp){ND_LE, 3, false};
+            case '>':
+                return (BinaryOp){ND_LE, 3, true};
+        }
+        return (BinaryOp){};
+    }
+    switch (tok->str[0]) {
+        case '=':
+            return (BinaryOp){ND_ASSIGN, PREC_ASSIGN, false};
+        case '<':
+            return (BinaryOp){ND_LT, 3, false};
+        case '>':
+            return (BinaryOp){ND_LT, 3, true};
+        case '+':
+            return (BinaryOp){ND_ADD, 4, false};
+        case '-':
+            return (BinaryOp){ND_SUB, 4, false};
+        case '*':
+            return (BinaryOp){ND_MUL, 5, false};
+        case '/':
+            return (BinaryOp){ND_DIV, 5, false};
+    }
+    return (BinaryOp){};
 }
 
-// equality = relational ("==" relational | "!=" relational)*
-Node *equality(void) {
-    Node *node = relational();
-
-    for (;;) {
-        if (consume("==")) {
-            node = new_binary(ND_EQ, node, relational());
-        } else if (consume("!=")) {
-            node = new_binary(ND_NE, node, relational());
-        } else {
-            return node;
+typedef enum {
+    PF_BINARY,  // 左辺と演算子を読んで右辺を待っている
+    PF_NEG,     // 前置の-
+    PF_DEREF,   // 前置の*
+    PF_ADDR,    // 前置の&
+    PF_PAREN,   // "("の後で")"を待っている
+    PF_CALL,    // 呼び出しの引数を読んでいる
+} ParseFrameKind;
+
+typedef struct {
+    ParseFrameKind kind;
+    BinaryOp op;  // PF_BINARY
+    Node *node;   // PF_BINARY: 左辺, PF_CALL: 呼び出し
+    Node *tail;   // PF_CALL: 最後に読んだ引数
+} ParseFrame;
+
+// 式の解析のスタック。アリーナ上に置き、アリーナが解放されたら作り直す
+static _Thread_local ParseFrame *s_frames;
+static _Thread_local int32_t s_nframes;
+static _Thread_local int32_t s_frames_cap;
+static _Thread_local uint64_t s_generation;
+
+static ParseFrame *push_frame(ParseFrameKind kind) {
+    if (s_nframes == s_frames_cap) {
+        s_frames_cap = s_frames_cap ? s_frames_cap * 2 : 64;
+        ParseFrame *p = arena_alloc(sizeof(ParseFrame) * s_frames_cap);
+        if (s_nframes > 0) {
+            memcpy(p, s_frames, sizeof(ParseFrame) * s_nframes);
         }
+        s_frames = p;
     }
+    ParseFrame *f = &s_frames[s_nframes++];
+    *f = (ParseFrame){.kind = kind};
+    return f;
 }
 
-// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
-Node *relational(void) {
-    Node *node = add();
-
-    for (;;) {
-        if (consume("<=")) {
-            node = new_binary(ND_LE, node, add());
-        } else if (consume("<")) {
-            node = new_binary(ND_LT, node, add());
-        } else if (consume(">=")) {
-            node = new_binary(ND_LE, add(), node);
-        } else if (consume(">")) {
-            node = new_binary(ND_LT, add(), node);
-        } else {
-            return node;
+// 変数か数か呼び出しの始まりを読む。呼び出しの引数を読み始めたらNULLを返す
+static Node *operand(void) {
+    Token *tok = consume_ident();
+    if (!tok) {
+        return new_num(expect_number());
+    }
+    if (consume("(")) {
+        Node *node = new_node(ND_FUNCALL);
+        node->symbolname = tok->ident->name;
+        node->call_begin = tok->str;
+        if (!peek(")")) {
+            push_frame(PF_CALL)->node = node;
+            return NULL;
         }
+        node->call_end = s_token->str;
+        expect(")");
+        return node;
     }
-}
 
-// add = mul ("+" mul | "-" mul)*
-Node *add(void) {
-    Node *node = mul();
+    Node *node = new_node(ND_LVAR);
+    LVar *lvar = find_lvar(tok);
+    if (!lvar) {
+        lvar = new_lvar(tok->ident, ty_int);
+    }
+    use_lvar(lvar, tok->str);
+    node->lvar = lvar;
+    return node;
+}
 
-    for (;;) {
-        if (consume("+")) {
-            node = new_binary(ND_ADD, node, mul());
-        } else if (consume("-")) {
-            node = new_binary(ND_SUB, node, mul());
-        } else {
-            return node;
+// 優先順位がprec以上の二項演算子と前置演算子をスタックから下ろしてnodeにまとめる
+static Node *reduce(int32_t base, Node *node, int8_t prec) {
+    while (s_nframes > base) {
+        ParseFrame *f = &s_frames[s_nframes - 1];
+        switch (f->kind) {
+            case PF_NEG:
+                node = new_binary(ND_SUB, new_num(0), node);
+                break;
+            case PF_DEREF:
+                node = new_binary(ND_DEREF, node, NULL);
+                break;
+            case PF_ADDR:
+                node = new_binary(ND_ADDR, node, NULL);
+                break;
+            case PF_BINARY:
+                if (f->op.prec < prec) {
+                    return node;
+                }
+                node = f->op.swap ? new_binary(f->op.kind, node, f->node) : new_binary(f->op.kind, f->node, node);
+                break;
+            default:
+                return node;
         }
+        s_nframes--;
     }
+    return node;
 }
 
-// mul = unary ("*" unary | "/" unary)*
-Node *mul(void) {
-    Node *node = unary();
-
+Node *expr(void) {
+    int32_t base = s_nframes;
     for (;;) {
-        if (consume("*")) {
-            node = new_binary(ND_MUL, node, unary());
-        } else if (consume("/")) {
-            node = new_binary(ND_DIV, node, unary());
-        } else {
-            return node;
+        // 前置演算子と"("を積み、被演算子を1つ読む
+        Node *node = NULL;
+        while (!node) {
+            if (consume("(")) {
+                push_frame(PF_PAREN);
+            } else if (consume("+")) {
+                continue;
+            } else if (consume("-")) {
+                push_frame(PF_NEG);
+            } else if (consume("*")) {
+                push_frame(PF_DEREF);
+            } else if (consume("&")) {
+                s_fn->addr_taken = true;
+                push_frame(PF_ADDR);
+            } else if (!(node = operand())) {
+                continue;  // 最初の引数を読む
+            }
         }
-    }
-}
 
-// unary = ("+" | "-")? unary | primary
-Node *unary(void) {
-    if (consume("+")) {
-        return unary();
-    }
-    if (consume("-")) {
-        return new_binary(ND_SUB, new_num(0), unary());
-    }
-    if (consume("*")) {
-        return new_binary(ND_DEREF, unary(), NULL);
-    }
-    if (consume("&")) {
-        return new_binary(ND_ADDR, unary(), NULL);
-    }
-    return primary();
-}
+        // 二項演算子が続く限り、結合の強いものから木にまとめる。
+        // 続かなければ閉じ括弧か引数の区切りで、その中の式ができあがる
+        for (;;) {
+            BinaryOp op = binary_op(s_token);
+            if (op.prec) {
+                // 代入は右結合なので、同じ優先順位の代入はまだまとめない
+                node = reduce(base, node, op.prec == PREC_ASSIGN ? op.prec + 1 : op.prec);
+                s_token = s_token->next;
+                ParseFrame *f = push_frame(PF_BINARY);
+                f->op = op;
+                f->node = node;
+                break;
+            }
 
-// primary = num
-//         | ident ("(" expr? ","? ")")?
-//         | "(" expr ")"
-Node *primary(void) {
-    if (consume("(")) {
-        Node *node = expr();
-        expect(")");
-        return node;
-    }
+            node = reduce(base, node, 0);
+            if (s_nframes == base) {
+                return node;
+            }
+            ParseFrame *f = &s_frames[s_nframes - 1];
+            if (f->kind == PF_PAREN) {
+                expect(")");
+                s_nframes--;
+                continue;
+            }
 
-    Token *tok = consume_ident();
-    if (tok) {
-        Node *node = calloc(1, sizeof(Node));
-
-        if (consume("(")) {
-            Node head = {};
-            Node *cur = &head;
-            while (!peek(")")) {
-                cur = cur->next = expr();
-                if (!consume(",")) {
-                    break;
-                }
+            // PF_CALL: 引数を1つ読み終えた
+            f->tail = f->tail ? (f->tail->next = node) : (f->node->args = node);
+            if (consume(",") && !peek(")")) {
+                break;
             }
+            node = f->node;
+            node->call_end = s_token->str;
             expect(")");
-            node->kind = ND_FUNCALL;
-            node->args = head.next;
-            node->symbolname = strndup(tok->str, tok->len);
-        } else {
-            node->kind = ND_LVAR;
-            LVar *lvar = find_lvar(tok);
-            node->symbolname = strndup(tok->str, tok->len);
-            Type *ty = ty_int;
-            ty->name = s_token;
-            if (!lvar) {
-                lvar = new_lvar(node->symbolname, ty);
-            }
-            node->offset = lvar->offset;
+            s_nframes--;
         }
-
-        return node;
     }
+}
 
-    return new_num(expect_number());
+static void start_parse(Token *tok) {
+    s_token = tok;
+    if (s_generation != arena_generation()) {
+        s_generation = arena_generation();
+        s_frames = NULL;
+        s_frames_cap = 0;
+    }
+    s_nframes = 0;
+    s_loop_depth = 0;  // 前の入力がループの途中のエラーで終わっていても数え直す
 }
 
 Function *parse(Token *token_in) {
-    s_token = token_in;
+    start_parse(token_in);
     return program();
+}
+
+// tokから始まる関数定義を1つだけ構文解析する (--incremental)
+Function *parse_function(Token *tok) {
+    start_parse(tok);
+    return function();
 }
\ No newline at end of file
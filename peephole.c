@@ -0,0 +1,349 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "9cc.h"
+
+// スタックマシン版の命令列に対するのぞき穴最適化。
+//
+// 式の途中結果を毎回push/popし、変数を読むたびにアドレスを計算するので、
+// 出力には決まった形の無駄が多い。命令列を構造のまま見て、変化がなくなるまで
+// パターンを書き換える。コメントはcodegen.cが別に持っているので、
+// --no-asm-commentsでも同じ命令列になる。
+//
+// codegen.cはラベルやジャンプをまたいでrax以外の値を持ち越さないので、
+// そこではrax以外のレジスタを死んでいるとみなしてよい。
+
+const char *peephole_rule_names[] = {
+    [PH_LEA_LOAD] = "lea-load",         [PH_OPERAND] = "operand",         [PH_IMM_OPERAND] = "imm-operand",
+    [PH_MEM_OPERAND] = "mem-operand",   [PH_PUSH_POP] = "push-pop",       [PH_MOV_RETARGET] = "mov-retarget",
+    [PH_STORE_DIRECT] = "store-direct",
+};
+
+static uint32_t bit(Reg r) { return 1u << (r == REG_AL ? REG_RAX : r); }
+
+static uint32_t operand_reads(const Operand *op) {
+    return op->kind == OPND_REG || op->kind == OPND_MEM ? bit(op->reg) : 0;
+}
+
+static bool is_reg(const Operand *op, Reg r) { return op->kind == OPND_REG && op->reg == r; }
+
+static bool is_barrier(const Insn *in) {
+    return in->op == I_LABEL || (I_JMP <= in->op && in->op <= I_JGE) || in->op == I_CALL || in->op == I_TAILJMP;
+}
+
+// 命令が読むレジスタと書くレジスタ
+static void insn_regs(const Insn *in, uint32_t *reads, uint32_t *writes) {
+    uint32_t r = 0;
+    uint32_t w = 0;
+    switch (in->op) {
+        case I_MOV:
+        case I_MOVZB:
+            r = operand_reads(&in->src);
+            if (in->dst.kind == OPND_REG) {
+                w = bit(in->dst.reg);
+            } else {
+                r |= operand_reads(&in->dst);
+            }
+            break;
+        case I_LEA:
+            r = bit(in->src.reg);
+            w = bit(in->dst.reg);
+            break;
+        case I_PUSH:
+            r = operand_reads(&in->dst) | bit(REG_RSP);
+            w = bit(REG_RSP);
+            break;
+        case I_POP:
+            r = bit(REG_RSP);
+            w = bit(in->dst.reg) | bit(REG_RSP);
+            break;
+        case I_ADD:
+        case I_SUB:
+        case I_IMUL:
+        case I_SHL:
+        case I_SAR:
+        case I_SHR:
+            r = operand_reads(&in->dst) | operand_reads(&in->src);
+            w = bit(in->dst.reg);
+            break;
+        case I_CMP:
+            r = operand_reads(&in->dst) | operand_reads(&in->src);
+            break;
+        case I_SETE:
+        case I_SETNE:
+        case I_SETL:
+        case I_SETLE:
+            r = bit(REG_RAX);
+            w = bit(REG_RAX);
+            break;
+        case I_CQO:
+            r = bit(REG_RAX);
+            w = bit(REG_RDX);
+            break;
+        case I_IDIV:
+            r = bit(REG_RAX) | bit(REG_RDX) | operand_reads(&in->dst);
+            w = bit(REG_RAX) | bit(REG_RDX);
+            break;
+        case I_CALL:
+        case I_TAILJMP:
+            r = bit(REG_RAX) | bit(REG_RDI) | bit(REG_RSI) | bit(REG_RDX) | bit(REG_RCX) | bit(REG_R8) |
+                bit(REG_R9) | bit(REG_RSP);
+            w = r & ~bit(REG_RSP);
+            break;
+        default:
+            break;
+    }
+    *reads = r;
+    *writes = w;
+}
+
+// iの次にある、消していない命令の位置
+static int32_t next(const Insn *insns, int32_t n, int32_t i) {
+    for (i++; i < n && insns[i].op == I_NOP; i++) {
+    }
+    return i;
+}
+
+// i番目の命令の後でregの値がもう読まれないか
+static bool dead_after(const Insn *insns, int32_t n, int32_t i, Reg reg) {
+    for (int32_t j = next(insns, n, i); j < n; j = next(insns, n, j)) {
+        uint32_t r;
+        uint32_t w;
+        insn_regs(&insns[j], &r, &w);
+        if (r & bit(reg)) {
+            return false;
+        }
+        if (w & bit(reg)) {
+            return true;
+        }
+        if (is_barrier(&insns[j])) {
+            return reg != REG_RAX;
+        }
+    }
+    // 関数の末尾ではraxが返り値になる
+    return reg != REG_RAX;
+}
+
+static void kill(Insn *in) { in->op = I_NOP; }
+
+// lea R, [rbp-N]; mov R, [R] -> mov R, [rbp-N]
+static bool lea_load(Insn *insns, int32_t n, int32_t i) {
+    Insn *lea = &insns[i];
+    int32_t j = next(insns, n, i);
+    if (lea->op != I_LEA || j == n) {
+        return false;
+    }
+    Insn *load = &insns[j];
+    Reg r = lea->dst.reg;
+    if (load->op != I_MOV || !is_reg(&load->dst, r) || load->src.kind != OPND_MEM || load->src.reg != r) {
+        return false;
+    }
+    lea->op = I_MOV;
+    lea->src.val += load->src.val;
+    kill(load);
+    return true;
+}
+
+// push rax; mov rax, X; mov rdi, rax; pop rax -> mov rdi, X
+// 二項演算の右辺が定数か変数のときの形。raxは元の値のまま戻るので、Xを直接rdiに入れる
+static bool operand(Insn *insns, int32_t n, int32_t i) {
+    int32_t j = next(insns, n, i);
+    int32_t k = next(insns, n, j);
+    int32_t l = next(insns, n, k);
+    if (l == n) {
+        return false;
+    }
+    Insn *push = &insns[i];
+    Insn *load = &insns[j];
+    Insn *mov = &insns[k];
+    Insn *pop = &insns[l];
+    if (push->op != I_PUSH || !is_reg(&push->dst, REG_RAX) || (load->op != I_MOV && load->op != I_LEA) ||
+        !is_reg(&load->dst, REG_RAX) || mov->op != I_MOV || mov->dst.kind != OPND_REG ||
+        !is_reg(&mov->src, REG_RAX) || pop->op != I_POP || !is_reg(&pop->dst, REG_RAX)) {
+        return false;
+    }
+    *push = *load;
+    push->dst = mov->dst;
+    kill(load);
+    kill(mov);
+    kill(pop);
+    return true;
+}
+
+// mov rdi, X; op rax, rdi -> op rax, X (Xは32ビットに収まる即値かメモリ)
+// 書き換えたらPH_IMM_OPERANDかPH_MEM_OPERAND、しなければ-1を返す
+static int32_t fold_operand(Insn *insns, int32_t n, int32_t i) {
+    Insn *mov = &insns[i];
+    int32_t j = next(insns, n, i);
+    if (mov->op != I_MOV || mov->dst.kind != OPND_REG || j == n) {
+        return -1;
+    }
+    Insn *op = &insns[j];
+    if (op->op != I_ADD && op->op != I_SUB && op->op != I_IMUL && op->op != I_CMP) {
+        return -1;
+    }
+    if (!is_reg(&op->dst, REG_RAX) || !is_reg(&op->src, mov->dst.reg) || mov->dst.reg == REG_RAX) {
+        return -1;
+    }
+    bool imm = mov->src.kind == OPND_IMM && mov->src.val == (int32_t)mov->src.val;
+    if (!imm && mov->src.kind != OPND_MEM) {
+        return -1;
+    }
+    if (!dead_after(insns, n, j, mov->dst.reg)) {
+        return -1;
+    }
+    op->src = mov->src;
+    kill(mov);
+    return imm ? PH_IMM_OPERAND : PH_MEM_OPERAND;
+}
+
+// push rax; S; pop R -> mov R, rax; S (SがRもスタックも触らない場合)
+// R = raxなら、Sがraxを書き換えなければpushとpopを両方消す
+static bool push_pop(Insn *insns, int32_t n, int32_t i) {
+    Insn *push = &insns[i];
+    if (push->op != I_PUSH || !is_reg(&push->dst, REG_RAX)) {
+        return false;
+    }
+    int32_t j = next(insns, n, i);
+    uint32_t reads = 0;
+    uint32_t writes = 0;
+    for (; j < n && insns[j].op != I_POP; j = next(insns, n, j)) {
+        uint32_t r;
+        uint32_t w;
+        insn_regs(&insns[j], &r, &w);
+        if (is_barrier(&insns[j]) || ((r | w) & bit(REG_RSP))) {
+            return false;
+        }
+        reads |= r;
+        writes |= w;
+    }
+    if (j == n) {
+        return false;
+    }
+    Insn *pop = &insns[j];
+    Reg r = pop->dst.reg;
+    if (r == REG_RAX) {
+        if (writes & bit(REG_RAX)) {
+            return false;
+        }
+        kill(push);
+        kill(pop);
+        return true;
+    }
+    if ((reads | writes) & bit(r)) {
+        return false;
+    }
+    push->op = I_MOV;
+    push->dst = pop->dst;
+    push->src = (Operand){OPND_REG, REG_RAX, 0, NULL};
+    kill(pop);
+    return true;
+}
+
+// mov rax, X; mov R, rax -> mov R, X (この後raxを読まない場合)
+static bool mov_retarget(Insn *insns, int32_t n, int32_t i) {
+    Insn *def = &insns[i];
+    int32_t j = next(insns, n, i);
+    if ((def->op != I_MOV && def->op != I_LEA) || !is_reg(&def->dst, REG_RAX) || j == n) {
+        return false;
+    }
+    Insn *mov = &insns[j];
+    if (mov->op != I_MOV || mov->dst.kind != OPND_REG || mov->dst.reg == REG_RAX || !is_reg(&mov->src, REG_RAX)) {
+        return false;
+    }
+    if (!dead_after(insns, n, j, REG_RAX)) {
+        return false;
+    }
+    def->dst = mov->dst;
+    kill(mov);
+    return true;
+}
+
+// lea R, [rbp-N]; S; mov [R], rax -> S; mov [rbp-N], rax (SがRを触らない場合)
+static bool store_direct(Insn *insns, int32_t n, int32_t i) {
+    Insn *lea = &insns[i];
+    if (lea->op != I_LEA || lea->src.reg != REG_RBP) {
+        return false;
+    }
+    Reg r = lea->dst.reg;
+    for (int32_t j = next(insns, n, i); j < n; j = next(insns, n, j)) {
+        Insn *in = &insns[j];
+        uint32_t reads;
+        uint32_t writes;
+        insn_regs(in, &reads, &writes);
+        if (in->op == I_MOV && in->dst.kind == OPND_MEM && in->dst.reg == r && !(operand_reads(&in->src) & bit(r))) {
+            if (!dead_after(insns, n, j, r)) {
+                return false;
+            }
+            in->dst.reg = REG_RBP;
+            in->dst.val += lea->src.val;
+            kill(lea);
+            return true;
+        }
+        if (is_barrier(in) || ((reads | writes) & bit(r))) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// i番目の命令から始まるパターンを1つ書き換え、そのパターンを返す。なければ-1
+static int32_t rewrite(Insn *insns, int32_t n, int32_t i) {
+    switch (insns[i].op) {
+        case I_LEA:
+            if (lea_load(insns, n, i)) {
+                return PH_LEA_LOAD;
+            }
+            if (mov_retarget(insns, n, i)) {
+                return PH_MOV_RETARGET;
+            }
+            if (store_direct(insns, n, i)) {
+                return PH_STORE_DIRECT;
+            }
+            return -1;
+        case I_PUSH:
+            if (operand(insns, n, i)) {
+                return PH_OPERAND;
+            }
+            if (push_pop(insns, n, i)) {
+                return PH_PUSH_POP;
+            }
+            return -1;
+        case I_MOV: {
+            int32_t rule = fold_operand(insns, n, i);
+            if (rule >= 0) {
+                return rule;
+            }
+            if (mov_retarget(insns, n, i)) {
+                return PH_MOV_RETARGET;
+            }
+            return -1;
+        }
+        default:
+            return -1;
+    }
+}
+
+// 命令列をその場で書き換えて詰め、新しい命令数を返す。
+// パターンごとの書き換え回数をcountsに足す
+int32_t peephole(Insn *insns, int32_t n, int32_t *counts) {
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int32_t i = 0; i < n; i++) {
+            // 書き換えた位置から新しいパターンが始まることが多いので、その場でやり直す
+            for (int32_t rule; insns[i].op != I_NOP && (rule = rewrite(insns, n, i)) >= 0;) {
+                counts[rule]++;
+                changed = true;
+            }
+        }
+        // 消した命令を詰めて、次の周回でnextが読み飛ばす量を減らす
+        int32_t m = 0;
+        for (int32_t i = 0; i < n; i++) {
+            if (insns[i].op != I_NOP) {
+                insns[m++] = insns[i];
+            }
+        }
+        n = m;
+    }
+    return n;
+}
@@ -0,0 +1,122 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "9cc.h"
+
+// ワークスティーリング方式のスレッドプール。
+//
+// タスクは0からntasks-1までの番号で、最初に各ワーカーの両端キューへ
+// 連続した範囲で配っておく。ワーカーは自分のキューの先頭から取り出し、
+// 空になったら他のワーカーのキューの末尾から盗む。タスクが新しいタスクを
+// 作ることはないので、全てのキューが空になれば終わりである。
+
+typedef struct {
+    pthread_mutex_t lock;
+    int64_t head;  // 次に自分で取り出す位置
+    int64_t tail;  // 盗まれる側の末尾 (この位置は含まない)
+} Deque;
+
+typedef struct {
+    Deque *deques;
+    int32_t nworkers;
+    TaskFn fn;
+    void *arg;
+} Pool;
+
+typedef struct {
+    Pool *pool;
+    int32_t id;
+} Worker;
+
+static bool pop_front(Deque *dq, int64_t *task) {
+    pthread_mutex_lock(&dq->lock);
+    bool ok = dq->head < dq->tail;
+    if (ok) {
+        *task = dq->head++;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+static bool steal_back(Deque *dq, int64_t *task) {
+    pthread_mutex_lock(&dq->lock);
+    bool ok = dq->head < dq->tail;
+    if (ok) {
+        *task = --dq->tail;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+static void *worker_main(void *p) {
+    Worker *w = p;
+    Pool *pool = w->pool;
+    int64_t task;
+    for (;;) {
+        if (pop_front(&pool->deques[w->id], &task)) {
+            pool->fn(pool->arg, task);
+            continue;
+        }
+        bool stolen = false;
+        for (int32_t i = 1; i < pool->nworkers && !stolen; i++) {
+            stolen = steal_back(&pool->deques[(w->id + i) % pool->nworkers], &task);
+        }
+        if (!stolen) {
+            break;
+        }
+        pool->fn(pool->arg, task);
+    }
+    return NULL;
+}
+
+// 作ったスレッドでは、終わる前にタスクがスレッドごとのアリーナに確保したものを解放する
+static void *thread_main(void *p) {
+    worker_main(p);
+    arena_free_all();
+    return NULL;
+}
+
+// fn(arg, i)をi = 0..ntasks-1について最大nthreadsスレッドで実行し、全て終わるまで待つ。
+// nthreadsが1以下なら呼び出したスレッドで順に実行する。
+void run_parallel(int32_t nthreads, int64_t ntasks, TaskFn fn, void *arg) {
+    if (nthreads > ntasks) {
+        nthreads = ntasks;
+    }
+    if (nthreads <= 1) {
+        for (int64_t i = 0; i < ntasks; i++) {
+            fn(arg, i);
+        }
+        return;
+    }
+
+    Pool pool = {.nworkers = nthreads, .fn = fn, .arg = arg};
+    pool.deques = calloc(nthreads, sizeof(Deque));
+    Worker *workers = calloc(nthreads, sizeof(Worker));
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    for (int32_t i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+        pool.deques[i].head = ntasks * i / nthreads;
+        pool.deques[i].tail = ntasks * (i + 1) / nthreads;
+        workers[i] = (Worker){&pool, i};
+    }
+
+    // 呼び出したスレッドもワーカー0として働く
+    for (int32_t i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, thread_main, &workers[i])) {
+            error("pool: スレッドを作れません");
+        }
+    }
+    worker_main(&workers[0]);
+    for (int32_t i = 1; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int32_t i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    }
+    free(pool.deques);
+    free(workers);
+    free(threads);
+}
@@ -0,0 +1,281 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// 線形走査 (linear scan) によるレジスタ割り当て。
+// ブロック単位の生存解析から各仮想レジスタの生存区間を求め、
+// 区間の開始位置順に物理レジスタを割り当てる。足りなければスピルする。
+
+// 割り当て対象のレジスタ。先頭NUM_CALLER_SAVED個がcaller-saved。
+// rax, rdx, r11はidivとスピルの一時レジスタ用に空けておく。
+const char *reg_names[] = {"rdi", "rsi", "rcx", "r8", "r9", "r10", "rbx", "r12", "r13", "r14", "r15"};
+const int32_t num_alloc_regs = sizeof(reg_names) / sizeof(*reg_names);
+#define NUM_CALLER_SAVED 6
+
+typedef struct {
+    int32_t vreg;
+    int32_t start;
+    int32_t end;
+    bool cross_call;  // 区間の途中にcallがある
+} Interval;
+
+typedef struct {
+    uint64_t *bits;
+} BitSet;
+
+static _Thread_local int32_t s_words;
+
+static BitSet new_bitset(void) { return (BitSet){calloc(s_words ? s_words : 1, sizeof(uint64_t))}; }
+static void bs_set(BitSet bs, int32_t i) { bs.bits[i / 64] |= (uint64_t)1 << (i % 64); }
+static bool bs_get(BitSet bs, int32_t i) { return bs.bits[i / 64] >> (i % 64) & 1; }
+
+// live-in/live-outを不動点まで反復して求める
+static void compute_liveness(BasicBlock **blocks, int32_t nblocks, BitSet *live_in, BitSet *live_out) {
+    BitSet *use = calloc(nblocks, sizeof(BitSet));
+    BitSet *def = calloc(nblocks, sizeof(BitSet));
+    for (int32_t i = 0; i < nblocks; i++) {
+        use[i] = new_bitset();
+        def[i] = new_bitset();
+        live_in[i] = new_bitset();
+        live_out[i] = new_bitset();
+        for (IR *ir = blocks[i]->first; ir; ir = ir->next) {
+            int32_t uses[ir_max_uses(ir)];
+            int32_t n = ir_uses(ir, uses);
+            for (int32_t j = 0; j < n; j++) {
+                if (!bs_get(def[i], uses[j])) {
+                    bs_set(use[i], uses[j]);
+                }
+            }
+            if (ir->dst >= 0) {
+                bs_set(def[i], ir->dst);
+            }
+        }
+    }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int32_t i = nblocks - 1; i >= 0; i--) {
+            BasicBlock *succ[2];
+            int32_t nsucc = ir_successors(blocks[i], succ);
+            for (int32_t w = 0; w < s_words; w++) {
+                uint64_t out = 0;
+                for (int32_t j = 0; j < nsucc; j++) {
+                    out |= live_in[succ[j]->id].bits[w];
+                }
+                uint64_t in = use[i].bits[w] | (out & ~def[i].bits[w]);
+                if (out != live_out[i].bits[w] || in != live_in[i].bits[w]) {
+                    live_out[i].bits[w] = out;
+                    live_in[i].bits[w] = in;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    for (int32_t i = 0; i < nblocks; i++) {
+        free(use[i].bits);
+        free(def[i].bits);
+    }
+    free(use);
+    free(def);
+}
+
+static void extend(Interval *iv, int32_t pos) {
+    if (pos < iv->start) {
+        iv->start = pos;
+    }
+    if (pos > iv->end) {
+        iv->end = pos;
+    }
+}
+
+static int compare_start(const void *a, const void *b) {
+    const Interval *x = a;
+    const Interval *y = b;
+    if (x->start != y->start) {
+        return x->start < y->start ? -1 : 1;
+    }
+    return x->vreg - y->vreg;
+}
+
+// 命令にレイアウト順の位置を振り、仮想レジスタごとの生存区間を作る
+static Interval *build_intervals(IRFunc *irf, int32_t *num_intervals) {
+    int32_t nblocks = 0;
+    for (BasicBlock *bb = irf->blocks; bb; bb = bb->next) {
+        nblocks++;
+    }
+    BasicBlock **blocks = calloc(nblocks, sizeof(BasicBlock *));
+    for (BasicBlock *bb = irf->blocks; bb; bb = bb->next) {
+        blocks[bb->id] = bb;
+    }
+
+    s_words = (irf->num_vregs + 63) / 64;
+    BitSet *live_in = calloc(nblocks, sizeof(BitSet));
+    BitSet *live_out = calloc(nblocks, sizeof(BitSet));
+    compute_liveness(blocks, nblocks, live_in, live_out);
+
+    Interval *ivs = calloc(irf->num_vregs ? irf->num_vregs : 1, sizeof(Interval));
+    for (int32_t v = 0; v < irf->num_vregs; v++) {
+        ivs[v] = (Interval){v, INT_MAX, -1, false};
+    }
+
+    int32_t pos = 0;
+    int32_t ncalls = 0;
+    int32_t cap_calls = 16;
+    int32_t *calls = malloc(sizeof(int32_t) * cap_calls);
+    int32_t nargs = 0;
+    for (int32_t i = 0; i < nblocks; i++) {
+        int32_t bstart = pos;
+        for (IR *ir = blocks[i]->first; ir; ir = ir->next, pos += 2) {
+            int32_t uses[ir_max_uses(ir)];
+            int32_t n = ir_uses(ir, uses);
+            for (int32_t j = 0; j < n; j++) {
+                extend(&ivs[uses[j]], pos);
+            }
+            if (ir->dst >= 0) {
+                extend(&ivs[ir->dst], pos);
+            }
+            if (ir->op == IR_ARG) {
+                nargs++;
+            }
+            if (ir->op == IR_CALL) {
+                if (ncalls == cap_calls) {
+                    cap_calls *= 2;
+                    calls = realloc(calls, sizeof(int32_t) * cap_calls);
+                }
+                calls[ncalls++] = pos;
+            }
+        }
+        int32_t bend = pos - 2;
+        for (int32_t w = 0; w < s_words; w++) {
+            for (uint64_t bits = live_in[i].bits[w]; bits; bits &= bits - 1) {
+                extend(&ivs[w * 64 + __builtin_ctzll(bits)], bstart);
+            }
+            for (uint64_t bits = live_out[i].bits[w]; bits; bits &= bits - 1) {
+                extend(&ivs[w * 64 + __builtin_ctzll(bits)], bend);
+            }
+        }
+    }
+
+    // 引数はエントリで並列に受け取るので、受け取り終わるまで同時に生きているとみなす
+    for (IR *ir = irf->blocks->first; ir && ir->op == IR_ARG; ir = ir->next) {
+        extend(&ivs[ir->dst], 0);
+        extend(&ivs[ir->dst], nargs * 2);
+    }
+
+    // callの位置は昇順に並んでいるので、区間の開始より後の最初のcallを二分探索する
+    for (int32_t v = 0; v < irf->num_vregs; v++) {
+        int32_t lo = 0;
+        int32_t hi = ncalls;
+        while (lo < hi) {
+            int32_t mid = (lo + hi) / 2;
+            if (calls[mid] <= ivs[v].start) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        ivs[v].cross_call = lo < ncalls && calls[lo] < ivs[v].end;
+    }
+
+    // 一度も現れない仮想レジスタは除く
+    int32_t n = 0;
+    for (int32_t v = 0; v < irf->num_vregs; v++) {
+        if (ivs[v].end >= 0) {
+            ivs[n++] = ivs[v];
+        }
+    }
+    qsort(ivs, n, sizeof(Interval), compare_start);
+    *num_intervals = n;
+
+    for (int32_t i = 0; i < nblocks; i++) {
+        free(live_in[i].bits);
+        free(live_out[i].bits);
+    }
+    free(live_in);
+    free(live_out);
+    free(blocks);
+    free(calls);
+    return ivs;
+}
+
+static bool reg_allowed(const Interval *iv, int32_t reg) { return !iv->cross_call || reg >= NUM_CALLER_SAVED; }
+
+RegAlloc *allocate_registers(IRFunc *irf) {
+    RegAlloc *ra = arena_alloc(sizeof(RegAlloc));
+    ra->locs = arena_alloc(sizeof(Location) * irf->num_vregs);
+    for (int32_t v = 0; v < irf->num_vregs; v++) {
+        ra->locs[v] = (Location){-1, -1};
+    }
+
+    int32_t n;
+    Interval *ivs = build_intervals(irf, &n);
+
+    // activeは終了位置の昇順に並べる
+    Interval *active[num_alloc_regs];
+    int32_t nactive = 0;
+    bool used[num_alloc_regs];
+    memset(used, 0, sizeof(used));
+
+    for (int32_t i = 0; i < n; i++) {
+        Interval *cur = &ivs[i];
+
+        // curの開始位置で終わる区間のレジスタは、同じ命令の定義先に再利用してよい
+        int32_t k = 0;
+        for (int32_t j = 0; j < nactive; j++) {
+            if (active[j]->end <= cur->start) {
+                used[ra->locs[active[j]->vreg].reg] = false;
+            } else {
+                active[k++] = active[j];
+            }
+        }
+        nactive = k;
+
+        int32_t reg = -1;
+        for (int32_t r = 0; r < num_alloc_regs; r++) {
+            if (!used[r] && reg_allowed(cur, r)) {
+                reg = r;
+                break;
+            }
+        }
+
+        if (reg < 0) {
+            // 終了位置が最も遠い区間をスピルする
+            int32_t victim = -1;
+            for (int32_t j = nactive - 1; j >= 0; j--) {
+                if (reg_allowed(cur, ra->locs[active[j]->vreg].reg)) {
+                    victim = j;
+                    break;
+                }
+            }
+            if (victim < 0 || active[victim]->end <= cur->end) {
+                ra->locs[cur->vreg] = (Location){-1, ra->num_spills++};
+                continue;
+            }
+            reg = ra->locs[active[victim]->vreg].reg;
+            ra->locs[active[victim]->vreg] = (Location){-1, ra->num_spills++};
+            for (int32_t j = victim; j < nactive - 1; j++) {
+                active[j] = active[j + 1];
+            }
+            nactive--;
+        }
+
+        ra->locs[cur->vreg] = (Location){reg, -1};
+        used[reg] = true;
+        if (reg >= NUM_CALLER_SAVED) {
+            ra->used_callee |= 1u << reg;
+        }
+        int32_t j = nactive++;
+        for (; j > 0 && active[j - 1]->end > cur->end; j--) {
+            active[j] = active[j - 1];
+        }
+        active[j] = cur;
+    }
+
+    free(ivs);
+    return ra;
+}
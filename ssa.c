@@ -0,0 +1,855 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// IRをSSA形式に変換して最適化し、通常のIRに戻す。
+//
+// 1. 到達不能なブロックを取り除き、先行ブロックと支配木を求める
+// 2. 仮想レジスタに昇格したローカル変数ごとに、代入のあるブロックの
+//    反復支配辺境にφを置き、支配木をたどって定義ごとに名前を付け替える
+// 3. コピー伝播、定数畳み込み、条件が定数の分岐の除去、ブロックの連結、
+//    不要な命令の削除を変化がなくなるまで繰り返す
+// 4. クリティカルエッジを分割し、φを先行ブロック末尾の並列コピーに置き換える
+//
+// 変数をメモリに置く関数 (mem_locals) ではφは置かず、3だけを行う。
+
+static _Thread_local IRFunc *s_irf;
+static _Thread_local BasicBlock **s_blocks;  // id -> ブロック
+static _Thread_local int32_t s_nblocks;
+static _Thread_local BasicBlock **s_rpo;  // 到達可能なブロックの逆後順
+static _Thread_local int32_t *s_rpo_index;
+static _Thread_local IR **s_def;       // 仮想レジスタ -> 定義する命令
+static _Thread_local int32_t *s_repl;  // 仮想レジスタ -> コピー伝播での置き換え先
+static _Thread_local bool s_cfg_changed;
+
+typedef struct {
+    int32_t *data;
+    int32_t len;
+    int32_t cap;
+} IntVec;
+
+static void vec_push(IntVec *v, int32_t x) {
+    if (v->len == v->cap) {
+        v->cap = v->cap ? v->cap * 2 : 4;
+        v->data = realloc(v->data, sizeof(int32_t) * v->cap);
+    }
+    v->data[v->len++] = x;
+}
+
+static int32_t new_vreg(void) { return s_irf->num_vregs++; }
+
+static bool is_phi(const IR *ir) { return ir && ir->op == IR_PHI; }
+
+static void remove_ir(BasicBlock *bb, IR *prev, IR *ir) {
+    if (prev) {
+        prev->next = ir->next;
+    } else {
+        bb->first = ir->next;
+    }
+    if (bb->last == ir) {
+        bb->last = prev;
+    }
+}
+
+// 到達可能なブロックだけをレイアウトに残してidを振り直し、
+// 先行ブロックと逆後順を求める。消えた先行ブロックから来るφの引数も除く
+static void compute_cfg(void) {
+    int32_t n = 0;
+    for (BasicBlock *bb = s_irf->blocks; bb; bb = bb->next) {
+        bb->id = n++;
+        bb->npreds = 0;
+        if (bb->last && bb->last->op == IR_BR && bb->last->then == bb->last->els) {
+            bb->last->op = IR_JMP;
+            bb->last->a = -1;
+        }
+    }
+
+    // 後続の番号を覚えながら深さ優先でたどり、帰りがけ順に並べる
+    bool *seen = calloc(n, sizeof(bool));
+    BasicBlock **post = malloc(sizeof(BasicBlock *) * n);
+    BasicBlock **stack = malloc(sizeof(BasicBlock *) * n);
+    int32_t *next_succ = malloc(sizeof(int32_t) * n);
+    int32_t npost = 0;
+    int32_t sp = 0;
+    stack[sp] = s_irf->blocks;
+    next_succ[sp++] = 0;
+    seen[0] = true;
+    while (sp > 0) {
+        BasicBlock *succ[2];
+        int32_t nsucc = ir_successors(stack[sp - 1], succ);
+        if (next_succ[sp - 1] == nsucc) {
+            post[npost++] = stack[--sp];
+            continue;
+        }
+        BasicBlock *s = succ[next_succ[sp - 1]++];
+        if (!seen[s->id]) {
+            seen[s->id] = true;
+            stack[sp] = s;
+            next_succ[sp++] = 0;
+        }
+    }
+
+    BasicBlock **link = &s_irf->blocks;
+    for (BasicBlock *bb = s_irf->blocks; bb; bb = bb->next) {
+        if (seen[bb->id]) {
+            *link = bb;
+            link = &bb->next;
+        }
+    }
+    *link = NULL;
+
+    s_nblocks = npost;
+    s_blocks = realloc(s_blocks, sizeof(BasicBlock *) * npost);
+    s_rpo = realloc(s_rpo, sizeof(BasicBlock *) * npost);
+    s_rpo_index = realloc(s_rpo_index, sizeof(int32_t) * npost);
+    int32_t id = 0;
+    for (BasicBlock *bb = s_irf->blocks; bb; bb = bb->next) {
+        bb->id = id;
+        s_blocks[id++] = bb;
+    }
+    for (int32_t i = 0; i < npost; i++) {
+        s_rpo[i] = post[npost - 1 - i];
+        s_rpo_index[s_rpo[i]->id] = i;
+    }
+
+    for (BasicBlock *bb = s_irf->blocks; bb; bb = bb->next) {
+        BasicBlock *succ[2];
+        int32_t nsucc = ir_successors(bb, succ);
+        for (int32_t i = 0; i < nsucc; i++) {
+            succ[i]->npreds++;
+        }
+    }
+    for (BasicBlock *bb = s_irf->blocks; bb; bb = bb->next) {
+        bb->preds = arena_alloc(sizeof(BasicBlock *) * (bb->npreds ? bb->npreds : 1));
+        bb->npreds = 0;
+    }
+    for (BasicBlock *bb = s_irf->blocks; bb; bb = bb->next) {
+        BasicBlock *succ[2];
+        int32_t nsucc = ir_successors(bb, succ);
+        for (int32_t i = 0; i < nsucc; i++) {
+            succ[i]->preds[succ[i]->npreds++] = bb;
+        }
+    }
+
+    for (BasicBlock *bb = s_irf->blocks; bb; bb = bb->next) {
+        for (IR *ir = bb->first; is_phi(ir); ir = ir->next) {
+            int32_t k = 0;
+            for (int32_t i = 0; i < ir->nargs; i++) {
+                for (int32_t j = 0; j < bb->npreds; j++) {
+                    if (ir->from[i] == bb->preds[j]) {
+                        ir->args[k] = ir->args[i];
+                        ir->from[k++] = ir->from[i];
+                        break;
+                    }
+                }
+            }
+            ir->nargs = k;
+        }
+    }
+
+    free(seen);
+    free(post);
+    free(stack);
+    free(next_succ);
+}
+
+// 無条件ジャンプでしか入れないブロックを、ジャンプ元のブロックの後ろにつなげる。
+// つないだブロックは空になり、次のcompute_cfg()で取り除かれる
+static bool merge_blocks(void) {
+    bool changed = false;
+    for (BasicBlock *bb = s_irf->blocks; bb; bb = bb->next) {
+        while (bb->last && bb->last->op == IR_JMP) {
+            BasicBlock *s = bb->last->then;
+            if (s == bb || s == s_irf->blocks || s->npreds != 1 || is_phi(s->first)) {
+                break;
+            }
+            IR *prev = NULL;
+            for (IR *ir = bb->first; ir != bb->last; ir = ir->next) {
+                prev = ir;
+            }
+            remove_ir(bb, prev, bb->last);
+            if (bb->last) {
+                bb->last->next = s->first;
+            } else {
+                bb->first = s->first;
+            }
+            bb->last = s->last;
+            s->first = NULL;
+            s->last = NULL;
+            s->npreds = 0;
+
+            BasicBlock *succ[2];
+            int32_t nsucc = ir_successors(bb, succ);
+            for (int32_t i = 0; i < nsucc; i++) {
+                for (int32_t j = 0; j < succ[i]->npreds; j++) {
+                    if (succ[i]->preds[j] == s) {
+                        succ[i]->preds[j] = bb;
+                    }
+                }
+                for (IR *phi = succ[i]->first; is_phi(phi); phi = phi->next) {
+                    for (int32_t j = 0; j < phi->nargs; j++) {
+                        if (phi->from[j] == s) {
+                            phi->from[j] = bb;
+                        }
+                    }
+                }
+            }
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Cooper, Harvey, Kennedy "A Simple, Fast Dominance Algorithm"
+static int32_t intersect(const int32_t *idom, int32_t a, int32_t b) {
+    while (a != b) {
+        while (s_rpo_index[a] > s_rpo_index[b]) {
+            a = idom[a];
+        }
+        while (s_rpo_index[b] > s_rpo_index[a]) {
+            b = idom[b];
+        }
+    }
+    return a;
+}
+
+static int32_t *compute_idom(void) {
+    int32_t *idom = malloc(sizeof(int32_t) * s_nblocks);
+    for (int32_t i = 0; i < s_nblocks; i++) {
+        idom[i] = -1;
+    }
+    idom[0] = 0;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int32_t i = 1; i < s_nblocks; i++) {
+            BasicBlock *bb = s_rpo[i];
+            int32_t dom = -1;
+            for (int32_t j = 0; j < bb->npreds; j++) {
+                int32_t p = bb->preds[j]->id;
+                if (idom[p] >= 0) {
+                    dom = dom < 0 ? p : intersect(idom, p, dom);
+                }
+            }
+            if (idom[bb->id] != dom) {
+                idom[bb->id] = dom;
+                changed = true;
+            }
+        }
+    }
+    return idom;
+}
+
+static IR *new_phi(BasicBlock *bb, int32_t dst, int32_t var) {
+    IR *phi = arena_alloc(sizeof(IR));
+    phi->op = IR_PHI;
+    phi->dst = dst;
+    phi->a = -1;
+    phi->b = -1;
+    phi->imm = var;
+    phi->nargs = bb->npreds;
+    phi->args = arena_alloc(sizeof(int32_t) * bb->npreds);
+    phi->from = arena_alloc(sizeof(BasicBlock *) * bb->npreds);
+    for (int32_t i = 0; i < bb->npreds; i++) {
+        phi->args[i] = -1;
+        phi->from[i] = bb->preds[i];
+    }
+    phi->next = bb->first;
+    bb->first = phi;
+    return phi;
+}
+
+// 変数ごとの名前のスタックの先頭で、ブロック内の読み出しと後続のφの引数を置き換える
+static void rename_block(BasicBlock *bb, const int32_t *var_of, int32_t nvregs, IntVec *names, IntVec *log) {
+    for (IR *ir = bb->first; ir; ir = ir->next) {
+        if (!is_phi(ir)) {
+            int32_t *slots[ir_max_uses(ir)];
+            int32_t n = ir_use_slots(ir, slots);
+            for (int32_t i = 0; i < n; i++) {
+                int32_t k = *slots[i] < nvregs ? var_of[*slots[i]] : -1;
+                if (k >= 0) {
+                    *slots[i] = names[k].data[names[k].len - 1];
+                }
+            }
+        }
+        if (ir->dst >= 0 && ir->dst < nvregs && var_of[ir->dst] >= 0) {
+            int32_t k = var_of[ir->dst];
+            ir->dst = new_vreg();
+            vec_push(&names[k], ir->dst);
+            vec_push(log, k);
+        }
+    }
+
+    BasicBlock *succ[2];
+    int32_t nsucc = ir_successors(bb, succ);
+    for (int32_t i = 0; i < nsucc; i++) {
+        for (IR *phi = succ[i]->first; is_phi(phi); phi = phi->next) {
+            IntVec *name = &names[phi->imm];
+            for (int32_t j = 0; j < phi->nargs; j++) {
+                if (phi->from[j] == bb) {
+                    phi->args[j] = name->data[name->len - 1];
+                }
+            }
+        }
+    }
+}
+
+// 変数に昇格した仮想レジスタをSSA形式にする
+static void build_ssa(void) {
+    Function *fn = s_irf->fn;
+    int32_t nvregs = s_irf->num_vregs;
+    int32_t nvars = 0;
+    for (LVar *var = fn->locals; var; var = var->next) {
+        nvars++;
+    }
+    if (nvars == 0) {
+        return;
+    }
+    LVar **vars = malloc(sizeof(LVar *) * nvars);
+    int32_t *var_of = malloc(sizeof(int32_t) * nvregs);
+    for (int32_t v = 0; v < nvregs; v++) {
+        var_of[v] = -1;
+    }
+    int32_t k = 0;
+    for (LVar *var = fn->locals; var; var = var->next) {
+        vars[k] = var;
+        var_of[var->vreg] = k++;
+    }
+
+    // 引数でない変数は、代入前に読んでもよいようにエントリで0にしておく
+    BasicBlock *entry = s_irf->blocks;
+    IR **link = &entry->first;
+    while ((*link)->op == IR_ARG) {
+        link = &(*link)->next;
+    }
+    for (int32_t i = 0; i < nvars; i++) {
+        bool is_param = false;
+        for (IR *ir = entry->first; ir->op == IR_ARG; ir = ir->next) {
+            is_param |= ir->dst == vars[i]->vreg;
+        }
+        if (!is_param) {
+            IR *ir = arena_alloc(sizeof(IR));
+            ir->op = IR_IMM;
+            ir->dst = vars[i]->vreg;
+            ir->a = -1;
+            ir->b = -1;
+            ir->next = *link;
+            *link = ir;
+            link = &ir->next;
+        }
+    }
+
+    // 支配辺境
+    int32_t *idom = compute_idom();
+    IntVec *df = calloc(s_nblocks, sizeof(IntVec));
+    for (int32_t b = 0; b < s_nblocks; b++) {
+        BasicBlock *bb = s_blocks[b];
+        if (bb->npreds < 2) {
+            continue;
+        }
+        for (int32_t j = 0; j < bb->npreds; j++) {
+            for (int32_t r = bb->preds[j]->id; r != idom[b]; r = idom[r]) {
+                if (df[r].len == 0 || df[r].data[df[r].len - 1] != b) {
+                    vec_push(&df[r], b);
+                }
+            }
+        }
+    }
+
+    // 変数ごとに代入のあるブロックを集め、反復支配辺境にφを置く
+    IntVec *defs = calloc(nvars, sizeof(IntVec));
+    for (int32_t b = 0; b < s_nblocks; b++) {
+        for (IR *ir = s_blocks[b]->first; ir; ir = ir->next) {
+            if (ir->dst >= 0 && var_of[ir->dst] >= 0) {
+                IntVec *d = &defs[var_of[ir->dst]];
+                if (d->len == 0 || d->data[d->len - 1] != b) {
+                    vec_push(d, b);
+                }
+            }
+        }
+    }
+    int32_t *has_phi = malloc(sizeof(int32_t) * s_nblocks);
+    int32_t *queued = malloc(sizeof(int32_t) * s_nblocks);
+    for (int32_t b = 0; b < s_nblocks; b++) {
+        has_phi[b] = -1;
+        queued[b] = -1;
+    }
+    for (int32_t i = 0; i < nvars; i++) {
+        IntVec *work = &defs[i];
+        for (int32_t j = 0; j < work->len; j++) {
+            queued[work->data[j]] = i;
+        }
+        while (work->len > 0) {
+            int32_t b = work->data[--work->len];
+            for (int32_t j = 0; j < df[b].len; j++) {
+                int32_t d = df[b].data[j];
+                if (has_phi[d] == i) {
+                    continue;
+                }
+                new_phi(s_blocks[d], vars[i]->vreg, i);
+                has_phi[d] = i;
+                if (queued[d] != i) {
+                    queued[d] = i;
+                    vec_push(work, d);
+                }
+            }
+        }
+    }
+
+    // 支配木を前順にたどって名前を付け替える。深い入れ子でも
+    // 再帰しないよう、ブロックを出るときの印 (-id-1) も明示的なスタックに積む
+    int32_t *first_child = malloc(sizeof(int32_t) * s_nblocks);
+    int32_t *sibling = malloc(sizeof(int32_t) * s_nblocks);
+    for (int32_t b = 0; b < s_nblocks; b++) {
+        first_child[b] = -1;
+    }
+    for (int32_t b = s_nblocks - 1; b > 0; b--) {
+        sibling[b] = first_child[idom[b]];
+        first_child[idom[b]] = b;
+    }
+    IntVec *names = calloc(nvars, sizeof(IntVec));
+    IntVec log = {0};  // 名前を積んだ変数の履歴
+    IntVec work = {0};
+    int32_t *mark = malloc(sizeof(int32_t) * s_nblocks);
+    vec_push(&work, 0);
+    while (work.len > 0) {
+        int32_t b = work.data[--work.len];
+        if (b < 0) {
+            for (b = -b - 1; log.len > mark[b];) {
+                names[log.data[--log.len]].len--;
+            }
+            continue;
+        }
+        mark[b] = log.len;
+        vec_push(&work, -b - 1);
+        rename_block(s_blocks[b], var_of, nvregs, names, &log);
+        for (int32_t c = first_child[b]; c >= 0; c = sibling[c]) {
+            vec_push(&work, c);
+        }
+    }
+
+    for (int32_t i = 0; i < nvars; i++) {
+        free(names[i].data);
+        free(defs[i].data);
+    }
+    for (int32_t b = 0; b < s_nblocks; b++) {
+        free(df[b].data);
+    }
+    free(names);
+    free(defs);
+    free(df);
+    free(log.data);
+    free(work.data);
+    free(mark);
+    free(first_child);
+    free(sibling);
+    free(has_phi);
+    free(queued);
+    free(idom);
+    free(var_of);
+    free(vars);
+}
+
+static int32_t resolve(int32_t v) {
+    while (s_repl[v] != v) {
+        s_repl[v] = s_repl[s_repl[v]];
+        v = s_repl[v];
+    }
+    return v;
+}
+
+static bool is_imm(int32_t v, int64_t *val) {
+    IR *def = s_def[v];
+    if (def && def->op == IR_IMM) {
+        *val = def->imm;
+        return true;
+    }
+    return false;
+}
+
+// オペランドが全て定数ならirをIR_IMMに書き換える
+static bool fold(IR *ir) {
+    int64_t a;
+    int64_t b;
+    int64_t val;
+    switch (ir->op) {
+        case IR_SHL:
+        case IR_SAR:
+            if (!is_imm(ir->a, &a)) {
+                return false;
+            }
+            val = ir->op == IR_SHL ? (int64_t)((uint64_t)a << ir->imm) : a / ((int64_t)1 << ir->imm);
+            break;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_EQ:
+        case IR_NE:
+        case IR_LT:
+        case IR_LE:
+            if (!is_imm(ir->a, &a) || !is_imm(ir->b, &b)) {
+                return false;
+            }
+            if (ir->op == IR_DIV && (b == 0 || (a == INT64_MIN && b == -1))) {
+                return false;
+            }
+            switch (ir->op) {
+                case IR_ADD:
+                    val = (int64_t)((uint64_t)a + (uint64_t)b);
+                    break;
+                case IR_SUB:
+                    val = (int64_t)((uint64_t)a - (uint64_t)b);
+                    break;
+                case IR_MUL:
+                    val = (int64_t)((uint64_t)a * (uint64_t)b);
+                    break;
+                case IR_DIV:
+                    val = a / b;
+                    break;
+                case IR_EQ:
+                    val = a == b;
+                    break;
+                case IR_NE:
+                    val = a != b;
+                    break;
+                case IR_LT:
+                    val = a < b;
+                    break;
+                default:
+                    val = a <= b;
+                    break;
+            }
+            break;
+        default:
+            return false;
+    }
+    ir->op = IR_IMM;
+    ir->imm = val;
+    ir->a = -1;
+    ir->b = -1;
+    return true;
+}
+
+// 全ての引数が同じ値 (または自分自身) のφならその値を返す
+static int32_t trivial_phi(IR *phi) {
+    int32_t same = -1;
+    for (int32_t i = 0; i < phi->nargs; i++) {
+        int32_t v = phi->args[i];
+        if (v == phi->dst || v == same) {
+            continue;
+        }
+        if (same >= 0) {
+            return -1;
+        }
+        same = v;
+    }
+    return same;
+}
+
+// コピー伝播と定数畳み込み。支配するブロックから順に見るので、
+// ループの戻り辺から来るφの引数以外は一度で置き換わる
+static bool simplify(void) {
+    bool changed = false;
+    for (int32_t i = 0; i < s_nblocks; i++) {
+        BasicBlock *bb = s_rpo[i];
+        IR *prev = NULL;
+        for (IR *ir = bb->first; ir; ir = ir->next) {
+            int32_t *slots[ir_max_uses(ir)];
+            int32_t n = ir_use_slots(ir, slots);
+            for (int32_t j = 0; j < n; j++) {
+                int32_t v = resolve(*slots[j]);
+                if (v != *slots[j]) {
+                    *slots[j] = v;
+                    changed = true;
+                }
+            }
+
+            int32_t same = ir->op == IR_MOV ? ir->a : is_phi(ir) ? trivial_phi(ir) : -1;
+            if (same >= 0) {
+                s_repl[ir->dst] = same;
+                remove_ir(bb, prev, ir);
+                changed = true;
+                continue;
+            }
+
+            int64_t cond;
+            if (ir->op == IR_BR && is_imm(ir->a, &cond)) {
+                ir->op = IR_JMP;
+                ir->then = cond ? ir->then : ir->els;
+                ir->els = NULL;
+                ir->a = -1;
+                s_cfg_changed = true;
+                changed = true;
+            }
+            changed |= fold(ir);
+            prev = ir;
+        }
+    }
+    return changed;
+}
+
+static bool has_side_effect(const IR *ir) {
+    switch (ir->op) {
+        case IR_STORE:
+        case IR_STORE_VAR:
+        case IR_CALL:
+        case IR_TAILCALL:
+        case IR_RET:
+        case IR_JMP:
+        case IR_BR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void mark_uses(IR *ir, IntVec *work) {
+    int32_t uses[ir_max_uses(ir)];
+    int32_t n = ir_uses(ir, uses);
+    for (int32_t i = 0; i < n; i++) {
+        vec_push(work, resolve(uses[i]));
+    }
+}
+
+// 副作用のある命令から使われている値をたどり、どこからも使われない命令を消す
+static bool eliminate_dead_code(void) {
+    bool *live = calloc(s_irf->num_vregs, sizeof(bool));
+    IntVec work = {0};
+    for (BasicBlock *bb = s_irf->blocks; bb; bb = bb->next) {
+        for (IR *ir = bb->first; ir; ir = ir->next) {
+            if (has_side_effect(ir)) {
+                mark_uses(ir, &work);
+            }
+        }
+    }
+    while (work.len > 0) {
+        int32_t v = work.data[--work.len];
+        if (!live[v]) {
+            live[v] = true;
+            if (s_def[v]) {
+                mark_uses(s_def[v], &work);
+            }
+        }
+    }
+
+    bool changed = false;
+    for (BasicBlock *bb = s_irf->blocks; bb; bb = bb->next) {
+        IR *prev = NULL;
+        for (IR *ir = bb->first; ir; ir = ir->next) {
+            if (!has_side_effect(ir) && ir->dst >= 0 && !live[ir->dst]) {
+                remove_ir(bb, prev, ir);
+                changed = true;
+            } else {
+                prev = ir;
+            }
+        }
+    }
+    free(live);
+    free(work.data);
+    return changed;
+}
+
+static IR *new_mov(int32_t dst, int32_t src) {
+    IR *ir = arena_alloc(sizeof(IR));
+    ir->op = IR_MOV;
+    ir->dst = dst;
+    ir->a = src;
+    ir->b = -1;
+    return ir;
+}
+
+// bbの終端命令の直前に、dsts[i] = srcs[i]を同時に行うコピーを並べる。
+// ある転送先が他の転送元になっている間は後回しにし、循環していれば一時レジスタで崩す
+static void insert_parallel_copy(BasicBlock *bb, int32_t *dsts, int32_t *srcs, int32_t n) {
+    IR **link = &bb->first;
+    while (*link != bb->last) {
+        link = &(*link)->next;
+    }
+    while (n > 0) {
+        int32_t ready = -1;
+        for (int32_t i = 0; i < n && ready < 0; i++) {
+            ready = i;
+            for (int32_t j = 0; j < n; j++) {
+                if (j != i && srcs[j] == dsts[i]) {
+                    ready = -1;
+                    break;
+                }
+            }
+        }
+        IR *mov;
+        if (ready >= 0) {
+            mov = new_mov(dsts[ready], srcs[ready]);
+            dsts[ready] = dsts[--n];
+            srcs[ready] = srcs[n];
+        } else {
+            int32_t tmp = new_vreg();
+            mov = new_mov(tmp, dsts[0]);
+            for (int32_t j = 0; j < n; j++) {
+                if (srcs[j] == dsts[0]) {
+                    srcs[j] = tmp;
+                }
+            }
+        }
+        mov->next = *link;
+        *link = mov;
+        link = &mov->next;
+    }
+}
+
+// φを先行ブロック末尾のコピーに置き換えてSSA形式を抜ける
+static void destruct_ssa(void) {
+    for (int32_t b = 0; b < s_nblocks; b++) {
+        BasicBlock *bb = s_blocks[b];
+        int32_t nphis = 0;
+        for (IR *ir = bb->first; is_phi(ir); ir = ir->next) {
+            nphis++;
+        }
+        if (nphis == 0) {
+            continue;
+        }
+
+        for (int32_t j = 0; j < bb->npreds; j++) {
+            BasicBlock *pred = bb->preds[j];
+            BasicBlock *at = pred;
+            if (pred->last->op == IR_BR) {
+                // クリティカルエッジの途中にコピー用のブロックを挟む
+                at = arena_alloc(sizeof(BasicBlock));
+                at->next = pred->next;
+                pred->next = at;
+                IR *jmp = arena_alloc(sizeof(IR));
+                jmp->op = IR_JMP;
+                jmp->dst = -1;
+                jmp->a = -1;
+                jmp->b = -1;
+                jmp->then = bb;
+                at->first = jmp;
+                at->last = jmp;
+                if (pred->last->then == bb) {
+                    pred->last->then = at;
+                } else {
+                    pred->last->els = at;
+                }
+            }
+
+            int32_t dsts[nphis];
+            int32_t srcs[nphis];
+            int32_t n = 0;
+            for (IR *phi = bb->first; is_phi(phi); phi = phi->next) {
+                for (int32_t i = 0; i < phi->nargs; i++) {
+                    if (phi->from[i] == pred && phi->args[i] != phi->dst) {
+                        dsts[n] = phi->dst;
+                        srcs[n++] = phi->args[i];
+                    }
+                }
+            }
+            insert_parallel_copy(at, dsts, srcs, n);
+        }
+
+        while (is_phi(bb->first)) {
+            bb->first = bb->first->next;
+        }
+    }
+
+    int32_t id = 0;
+    for (BasicBlock *bb = s_irf->blocks; bb; bb = bb->next) {
+        bb->id = id++;
+    }
+}
+
+// 名前の付け替えと不要な命令の削除で番号が疎らになるので、
+// レジスタ割り当てのビット集合が小さくなるよう詰め直す
+static void compact_vregs(void) {
+    int32_t *map = malloc(sizeof(int32_t) * s_irf->num_vregs);
+    for (int32_t v = 0; v < s_irf->num_vregs; v++) {
+        map[v] = -1;
+    }
+    int32_t n = 0;
+    for (BasicBlock *bb = s_irf->blocks; bb; bb = bb->next) {
+        for (IR *ir = bb->first; ir; ir = ir->next) {
+            int32_t *slots[ir_max_uses(ir)];
+            int32_t nslots = ir_use_slots(ir, slots);
+            for (int32_t i = 0; i < nslots; i++) {
+                if (map[*slots[i]] < 0) {
+                    map[*slots[i]] = n++;
+                }
+                *slots[i] = map[*slots[i]];
+            }
+            if (ir->dst >= 0) {
+                if (map[ir->dst] < 0) {
+                    map[ir->dst] = n++;
+                }
+                ir->dst = map[ir->dst];
+            }
+        }
+    }
+    s_irf->num_vregs = n;
+    free(map);
+}
+
+static void dump(FILE *dst) {
+    char *buf;
+    size_t len;
+    FILE *out = open_memstream(&buf, &len);
+    dump_ir(s_irf, out);
+    fclose(out);
+    // -jで並列に生成していても関数の途中で混ざらないよう、一度に書く
+    fputs(buf, dst);
+    free(buf);
+}
+
+// opts->ir_dumpがあれば、SSA形式から戻す前のIRを書く
+void optimize_ir(IRFunc *irf, const CompileOptions *opts) {
+    s_irf = irf;
+    s_cfg_changed = false;
+    compute_cfg();
+    if (!irf->mem_locals) {
+        build_ssa();
+    }
+
+    s_def = calloc(irf->num_vregs, sizeof(IR *));
+    s_repl = malloc(sizeof(int32_t) * irf->num_vregs);
+    for (int32_t v = 0; v < irf->num_vregs; v++) {
+        s_repl[v] = v;
+    }
+    for (BasicBlock *bb = irf->blocks; bb; bb = bb->next) {
+        for (IR *ir = bb->first; ir; ir = ir->next) {
+            if (ir->dst >= 0) {
+                s_def[ir->dst] = ir;
+            }
+        }
+    }
+
+    for (bool changed = true; changed;) {
+        changed = simplify();
+        if (s_cfg_changed) {
+            s_cfg_changed = false;
+            compute_cfg();
+        }
+        if (merge_blocks()) {
+            compute_cfg();
+            changed = true;
+        }
+        changed |= eliminate_dead_code();
+    }
+
+    if (opts->ir_dump) {
+        dump(opts->ir_dump);
+    }
+    destruct_ssa();
+    compact_vregs();
+
+    free(s_def);
+    free(s_repl);
+    free(s_blocks);
+    free(s_rpo);
+    free(s_rpo_index);
+    s_def = NULL;
+    s_repl = NULL;
+    s_blocks = NULL;
+    s_rpo = NULL;
+    s_rpo_index = NULL;
+}
@@ -0,0 +1,92 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "9cc.h"
+
+// --statsの計測。フェーズの区切りごとにstats_phase()を呼ぶと、前の区切りからの
+// 経過時間 (壁時計) とアリーナに確保したバイト数をそのフェーズに足す。
+// アリーナはスレッドごとなので、-jで関数ごとに並列に生成したときの
+// 確保量は呼び出したスレッドの分だけになる。
+
+static const char *s_phase_names[NUM_PHASES] = {
+    "tokenize", "parse", "inline", "fold", "loop_opt", "add_type", "generate_code", "assemble",
+};
+
+int64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_start(PhaseStats *st) {
+    *st = (PhaseStats){};
+    st->last_ns = stats_now_ns();
+    st->last_bytes = arena_stats().used_bytes;
+}
+
+void stats_phase(PhaseStats *st, Phase phase) {
+    int64_t ns = stats_now_ns();
+    size_t bytes = arena_stats().used_bytes;
+    st->ns[phase] += ns - st->last_ns;
+    st->alloc_bytes[phase] += bytes - st->last_bytes;
+    st->last_ns = ns;
+    st->last_bytes = bytes;
+}
+
+// JSONの文字列としてsを書く。バッファには6 * strlen(s) + 3バイト必要
+static char *put_string(char *p, const char *s) {
+    *p++ = '"';
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < 0x20) {
+            p += sprintf(p, "\\u%04x", c);
+        } else {
+            *p++ = c;
+        }
+    }
+    *p++ = '"';
+    return p;
+}
+
+// 計測結果を1行のJSONでoutに書く。並列にコンパイルした複数の入力の行が
+// 混ざらないように、1行を組み立ててから一度に書く。アリーナを解放する前に呼ぶ
+void print_stats_json(FILE *out, const char *input, const char *backend, const PhaseStats *st, size_t asm_bytes) {
+    ArenaStats arena = arena_stats();
+    char *buf = malloc(2048 + 6 * strlen(input));
+    char *p = buf;
+    p += sprintf(p, "{\"input\":");
+    p = put_string(p, input);
+    p += sprintf(p, ",\"backend\":\"%s\",\"phases\":{", backend);
+    int64_t total = 0;
+    for (int32_t i = 0; i < NUM_PHASES; i++) {
+        p += sprintf(p, "%s\"%s\":{\"ns\":%ld,\"alloc_bytes\":%zu}", i ? "," : "", s_phase_names[i], (long)st->ns[i],
+                     st->alloc_bytes[i]);
+        total += st->ns[i];
+    }
+    total += st->cache_ns;
+    p += sprintf(p, "},\"total_ns\":%ld", (long)total);
+    if (st->cache) {
+        // 当たり外れはこの入力の結果、hitsとmissesはプロセス全体の累計
+        int64_t hits, misses;
+        cache_counts(&hits, &misses);
+        p += sprintf(p, ",\"cache\":{\"result\":\"%s\",\"ns\":%ld,\"hits\":%ld,\"misses\":%ld", st->cache,
+                     (long)st->cache_ns, (long)hits, (long)misses);
+        if (st->fns_reused + st->fns_compiled > 0) {
+            p += sprintf(p, ",\"functions\":{\"reused\":%d,\"compiled\":%d}", st->fns_reused, st->fns_compiled);
+        }
+        *p++ = '}';
+    }
+    p += sprintf(p, ",\"counts\":{\"tokens\":%zu,\"nodes\":%zu,\"lvars\":%zu,\"types\":%zu}", arena.num_objs[OBJ_TOKEN],
+                 arena.num_objs[OBJ_NODE], arena.num_objs[OBJ_LVAR], arena.num_objs[OBJ_TYPE]);
+    p += sprintf(p, ",\"arena\":{\"allocs\":%zu,\"used_bytes\":%zu,\"reserved_bytes\":%zu}", arena.num_allocs,
+                 arena.used_bytes, arena.reserved_bytes);
+    p += sprintf(p, ",\"asm_bytes\":%zu}\n", asm_bytes);
+    fwrite(buf, 1, p - buf, out);
+    free(buf);
+}
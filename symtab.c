@@ -0,0 +1,203 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "9cc.h"
+
+// ローカル変数の記号表とスタックフレームの配置。
+//
+// 記号表はIdentの番号をキーにしたハッシュ表で、ブロックに入るたびに
+// スコープを積み、出るときにそのスコープで宣言した名前を取り除く。
+// 内側のスコープの束縛は外側の同名の束縛より先に見つかる。
+
+typedef struct Symbol Symbol;
+struct Symbol {
+    Symbol *next_in_bucket;
+    Symbol *next_in_scope;
+    Ident *ident;
+    LVar *var;
+};
+
+typedef struct Scope Scope;
+struct Scope {
+    Scope *up;
+    Symbol *syms;  // このスコープで宣言した名前 (新しい順)
+};
+
+static _Thread_local Symbol **s_buckets;
+static _Thread_local uint32_t s_nbuckets;  // 2のべき乗
+static _Thread_local uint32_t s_count;
+static _Thread_local uint64_t s_generation;
+
+static _Thread_local Scope *s_scope;     // 最も内側のスコープ
+static _Thread_local Scope *s_fn_scope;  // 関数本体のスコープ
+
+static Symbol **bucket(Ident *ident) { return &s_buckets[(uint32_t)ident->id * 2654435761u & (s_nbuckets - 1)]; }
+
+static void rehash(uint32_t nbuckets) {
+    Symbol **old = s_buckets;
+    uint32_t old_n = s_nbuckets;
+    s_buckets = arena_alloc(sizeof(Symbol *) * nbuckets);
+    s_nbuckets = nbuckets;
+    // 同じ名前の束縛の順序 (内側が先) を保つため、各バケットを末尾から積み直す
+    for (uint32_t i = 0; i < old_n; i++) {
+        Symbol *rev = NULL;
+        for (Symbol *sym = old[i]; sym;) {
+            Symbol *next = sym->next_in_bucket;
+            sym->next_in_bucket = rev;
+            rev = sym;
+            sym = next;
+        }
+        for (Symbol *sym = rev; sym;) {
+            Symbol *next = sym->next_in_bucket;
+            Symbol **b = bucket(sym->ident);
+            sym->next_in_bucket = *b;
+            *b = sym;
+            sym = next;
+        }
+    }
+}
+
+void enter_scope(void) {
+    if (!s_buckets || s_generation != arena_generation()) {
+        s_generation = arena_generation();
+        s_buckets = NULL;
+        s_nbuckets = 0;
+        s_count = 0;
+        s_scope = s_fn_scope = NULL;
+        rehash(256);
+    }
+    Scope *sc = arena_alloc(sizeof(Scope));
+    sc->up = s_scope;
+    s_scope = sc;
+    if (!s_fn_scope) {
+        s_fn_scope = sc;
+    }
+}
+
+void leave_scope(void) {
+    for (Symbol *sym = s_scope->syms; sym; sym = sym->next_in_scope) {
+        Symbol **p = bucket(sym->ident);
+        while (*p != sym) {
+            p = &(*p)->next_in_bucket;
+        }
+        *p = sym->next_in_bucket;
+        s_count--;
+    }
+    if (s_scope == s_fn_scope) {
+        s_fn_scope = NULL;
+    }
+    s_scope = s_scope->up;
+}
+
+LVar *find_var(Ident *ident) {
+    for (Symbol *sym = *bucket(ident); sym; sym = sym->next_in_bucket) {
+        if (sym->ident == ident) {
+            return sym->var;
+        }
+    }
+    return NULL;
+}
+
+// 変数を宣言する。宣言のない言語なので、暗黙の変数は関数のスコープに置く。
+// 同じスコープに同名の変数がないことは呼び出し側で確認しておくこと。
+void declare_var(LVar *var, bool fn_scope) {
+    Scope *sc = fn_scope ? s_fn_scope : s_scope;
+    Symbol *sym = arena_alloc(sizeof(Symbol));
+    sym->ident = var->ident;
+    sym->var = var;
+    sym->next_in_scope = sc->syms;
+    sc->syms = sym;
+
+    // 見つからなかった名前を宣言するので、同名の束縛より前に置いてよい
+    Symbol **b = bucket(var->ident);
+    sym->next_in_bucket = *b;
+    *b = sym;
+
+    if (++s_count > s_nbuckets * 2) {
+        rehash(s_nbuckets * 2);
+    }
+}
+
+// Round up `n` to the nearest multiple of `align`. For instance,
+// align_to(5, 8) returns 8 and align_to(11, 8) returns 16.
+int32_t align_to(int32_t n, int32_t align) { return (n + align - 1) / align * align; }
+
+typedef struct {
+    int32_t offset;
+    int32_t size;
+    int32_t align;
+} Slot;
+
+static int compare_use_begin(const void *a, const void *b) {
+    const LVar *x = *(LVar *const *)a;
+    const LVar *y = *(LVar *const *)b;
+    if (x->use_begin != y->use_begin) {
+        return x->use_begin < y->use_begin ? -1 : 1;
+    }
+    return x->offset - y->offset;
+}
+
+// ローカル変数にRBPからのオフセットを割り当て、fn->stack_sizeを決める。
+//
+// アドレスを取る関数では、ポインタ演算で隣の変数を指せるように宣言順に並べる。
+// そうでなければ、使われるソース上の範囲が重ならない変数同士でスロットを共有する。
+// 範囲はループの中で使われた場合にループ全体へ広げてあるので、値が
+// 生きている間に他の変数に上書きされることはない。
+void assign_lvar_offsets(Function *fn) {
+    int32_t nvars = 0;
+    for (LVar *var = fn->locals; var; var = var->next) {
+        nvars++;
+    }
+    // localsは新しい順なので、宣言順に並べ直す
+    LVar **vars = malloc(sizeof(LVar *) * (nvars ? nvars : 1));
+    int32_t i = nvars;
+    for (LVar *var = fn->locals; var; var = var->next) {
+        vars[--i] = var;
+        var->offset = i;  // 並べ替えで同順位のときに宣言順を保つ
+    }
+
+    int32_t size = 0;
+    if (fn->addr_taken) {
+        for (i = 0; i < nvars; i++) {
+            size = align_to(size + vars[i]->ty->size, vars[i]->ty->align);
+            vars[i]->offset = size;
+        }
+    } else {
+        qsort(vars, nvars, sizeof(LVar *), compare_use_begin);
+        LVar **active = malloc(sizeof(LVar *) * (nvars ? nvars : 1));
+        Slot *free_slots = malloc(sizeof(Slot) * (nvars ? nvars : 1));
+        int32_t nactive = 0;
+        int32_t nfree = 0;
+        for (i = 0; i < nvars; i++) {
+            LVar *var = vars[i];
+            int32_t k = 0;
+            for (int32_t j = 0; j < nactive; j++) {
+                if (active[j]->use_end < var->use_begin) {
+                    free_slots[nfree++] = (Slot){active[j]->offset, active[j]->ty->size, active[j]->ty->align};
+                } else {
+                    active[k++] = active[j];
+                }
+            }
+            nactive = k;
+
+            var->offset = -1;
+            for (int32_t j = nfree - 1; j >= 0; j--) {
+                if (free_slots[j].size == var->ty->size && free_slots[j].align == var->ty->align) {
+                    var->offset = free_slots[j].offset;
+                    free_slots[j] = free_slots[--nfree];
+                    break;
+                }
+            }
+            if (var->offset < 0) {
+                size = align_to(size + var->ty->size, var->ty->align);
+                var->offset = size;
+            }
+            active[nactive++] = var;
+        }
+        free(active);
+        free(free_slots);
+    }
+    free(vars);
+    fn->stack_size = align_to(size, 16);
+}
@@ -0,0 +1,63 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "9cc.h"
+
+// returnする値が関数呼び出しそのものなら、その呼び出しは末尾呼び出しにできる。
+// 自分自身の呼び出しは引数を仮引数に代入して関数の先頭へ戻るループにし、
+// ほかの関数の呼び出しはフレームを片付けてからjmpで飛ぶ。どちらもスタックを伸ばさない。
+//
+// &を使う関数は、呼び出し先にフレームの中を指すポインタを渡しているかもしれないので
+// フレームを手放さない。引数はレジスタで渡せる6個までに限る。
+// インライン展開した本体の中のreturnは関数から抜けないので、呼び出し側で除くこと。
+
+// opts->tail_callsが偽なら末尾呼び出しにしない
+TailCall tail_call_kind(const Function *fn, const Node *ret, const CompileOptions *opts) {
+    if (!opts->tail_calls || fn->addr_taken || ret->kind != ND_RETURN || ret->lhs->kind != ND_FUNCALL) {
+        return TAIL_NONE;
+    }
+    const Node *call = ret->lhs;
+    int32_t nargs = 0;
+    for (Node *n = call->args; n; n = n->next) {
+        nargs++;
+    }
+    if (nargs > 6) {
+        return TAIL_NONE;
+    }
+    int32_t nparams = 0;
+    for (LVar *var = fn->params; var; var = var->next) {
+        nparams++;
+    }
+    // 名前はインターンされているのでポインタで比べられる
+    return call->symbolname == fn->name && nargs == nparams ? TAIL_SELF : TAIL_SIBLING;
+}
+
+static bool has_self_call(const Function *fn, const Node *node, const CompileOptions *opts) {
+    if (!node) {
+        return false;
+    }
+    switch (node->kind) {
+        case ND_RETURN:
+            return tail_call_kind(fn, node, opts) == TAIL_SELF;
+        case ND_BLOCK:
+            for (Node *n = node->body; n; n = n->next) {
+                if (has_self_call(fn, n, opts)) {
+                    return true;
+                }
+            }
+            return false;
+        case ND_IF:
+            return has_self_call(fn, node->then, opts) || has_self_call(fn, node->els, opts);
+        case ND_WHILE:
+        case ND_FOR:
+            return has_self_call(fn, node->then, opts);
+        default:
+            // 式の中のreturnはインライン展開した本体のものだけ
+            return false;
+    }
+}
+
+// 関数の先頭へ戻る末尾呼び出しがあるか
+bool has_self_tail_call(const Function *fn, const CompileOptions *opts) {
+    return has_self_call(fn, fn->body, opts);
+}
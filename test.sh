@@ -10,21 +10,96 @@ int add6(int a, int b, int c, int d, int e, int f) {
 }
 EOF
 
+# スタックマシン版 (のぞき穴最適化の有無) とレジスタ割り当て版の両方のバックエンドで確認する。
+# -cは組み込みのアセンブラで書いたオブジェクトをそのままリンクする
 assert() {
     expected="$1"
     input="$2"
 
-    ./9cc "$input" >tmp.s
-    cc -static -o tmp tmp.s tmp2.o
-    set +e
-    ./tmp
-    actual="$?"
-    set -e
+    for flags in "" "--no-peephole" "--regalloc" "-c" "-c --regalloc"; do
+        out=tmp.s
+        if [ "${flags#-c}" != "$flags" ]; then
+            out=tmp.o
+        fi
+        echo "$input" | ./9cc $flags -o $out -
+        cc -static -o tmp $out tmp2.o
+        set +e
+        ./tmp
+        actual="$?"
+        set -e
 
-    if [ "$actual" = "$expected" ]; then
+        if [ "$actual" = "$expected" ]; then
+            echo "$input $flags => $actual"
+        else
+            echo "$input $flags => $expected expected, but got $actual"
+            exit 1
+        fi
+    done
+}
+
+# 定数畳み込みで取り除かれるノード数を確認する
+assert_folded() {
+    expected="$1"
+    input="$2"
+
+    actual=$(echo "$input" | ./9cc --fold-stats -o /dev/null - 2>&1)
+    if [ "$actual" = "fold: removed $expected nodes" ]; then
         echo "$input => $actual"
     else
-        echo "$input => $expected expected, but got $actual"
+        echo "$input => $expected removed nodes expected, but got: $actual"
+        exit 1
+    fi
+}
+
+# ループ最適化で書き換えた数を確認する。3つ目の引数は追加のオプション
+assert_loop() {
+    expected="$1"
+    input="$2"
+
+    actual=$(echo "$input" | ./9cc --loop-stats ${3:-} -o /dev/null - 2>&1)
+    if [ "$actual" = "loop: $expected" ]; then
+        echo "$input ${3:-} => $actual"
+    else
+        echo "$input ${3:-} => 'loop: $expected' expected, but got: $actual"
+        exit 1
+    fi
+}
+
+# インライン展開の報告に期待する行が含まれることを確認する。3つ目の引数は追加のオプション
+assert_inline() {
+    expected="$1"
+    input="$2"
+
+    if echo "$input" | ./9cc --inline-report ${3:-} -o /dev/null - 2>&1 | grep -qxF "$expected"; then
+        echo "$input ${3:-} => $expected"
+    else
+        echo "$input ${3:-} => '$expected' expected in the inline report"
+        exit 1
+    fi
+}
+
+# スタックマシン版の出力に期待する行が含まれることを確認する
+assert_asm() {
+    expected="$1"
+    input="$2"
+
+    if echo "$input" | ./9cc - | grep -qF -- "$expected"; then
+        echo "$input => $expected"
+    else
+        echo "$input => '$expected' expected in output"
+        exit 1
+    fi
+}
+
+# --dump-irで最適化後のSSA形式に期待する行が含まれることを確認する
+assert_ir() {
+    expected="$1"
+    input="$2"
+
+    if echo "$input" | ./9cc --regalloc --dump-ir -o /dev/null - 2>&1 | grep -qF -- "$expected"; then
+        echo "$input => $expected"
+    else
+        echo "$input => '$expected' expected in IR dump"
         exit 1
     fi
 }
@@ -71,6 +146,9 @@ assert 8 'main() { a=3; z=5; return a+z; }'
 assert 6 'main() { a=3;b=3; return a+b; }'
 assert 3 'main() { foo=3; return foo; }'
 assert 8 'main() { foo123=3; bar=5; return foo123+bar; }'
+assert 3 'main() { if_x=3; return_=if_x; return return_; }'
+assert 7 'main() { a_very_long_identifier_that_spans_several_simd_blocks_0123456789=7; return a_very_long_identifier_that_spans_several_simd_blocks_0123456789; }'
+assert 42 "$(printf 'main()\t{\n\n    return\t\t  00042 ;\r\n}\n')"
 
 assert 3 'main() { if (0) return 2; return 3; }'
 assert 3 'main() { if (1-1) return 2; return 3; }'
@@ -96,6 +174,23 @@ assert 5 'main(){ x=3; y=&x; *y=5; return x; }'
 assert 7 'main(){ x=3; y=5; *(&x-8)=7; return y; }'
 assert 7 'main(){ x=3; y=5; *(&y+8)=7; return x; }'
 
+# 畳み込まれない算術演算
+assert 15 'main() { a=5; b=9; return a*(b-6); }'
+assert 4 'main() { a=3; b=5; return (a+b)/2; }'
+assert 7 'main() { a=0-7; return a/2+10; }'
+assert 3 'main() { a=0-9; return a/4+5; }'
+assert 12 'main() { a=3; return a*4; }'
+assert 6 'main() { a=3; return 8*a/4; }'
+assert 3 'main() { a=3; return 0-(0-a)+0; }'
+assert 5 'main() { a=5; b=0; if (b) return a/b; return a*1/1; }'
+
+assert_folded 4 'main() { return 5+20-4; }'
+assert_folded 4 'main() { return - -10; }'
+assert_folded 4 'main() { a=3; return - -a; }'
+assert_folded 4 'main() { a=3; return a*1+0; }'
+assert_folded 1 'main() { a=3; return a*8; }'
+assert_folded 0 'main() { a=3; return a/0; }'
+
 assert 3 'main() { return ret3(); }'
 assert 5 'main() { return ret5(); }'
 assert 8 'main() { return add(3, 5); }'
@@ -107,6 +202,369 @@ assert 32 'main() { return ret32(); } ret32() { return 32; }'
 
 assert 7 'main() { return add2(3,4); } add2(x, y) { return x+y; }'
 assert 1 'main() { return sub2(4,3); } sub2(x, y) { return x-y; }'
+assert 7 'main() { x=5; y=g(1); return x+y; } g(x) { return x+1; } h() { x=9; return x; }'
 assert 55 'main() { return fib(9); } fib(x) { if (x<=1) return 1; return fib(x-1) + fib(x-2); }'
 
+# レジスタが足りずにスピルする場合と、callをまたいで値を保持する場合
+assert 78 'main() { a=1;b=2;c=3;d=4;e=5;f=6;g=7;h=8;i=9;j=10;k=11;l=12; return a+b+c+d+e+f+g+h+i+j+k+l; }'
+assert 78 'main() { a=1;b=2;c=3;d=4;e=5;f=6;g=7;h=8;i=9;j=10;k=11;l=12; m=ret3(); return a+b+c+d+e+f+g+h+i+j+k+l+m-3; }'
+assert 21 'main() { a=1;b=2;c=3;d=4;e=5;f=6; return add6(f,e,d,c,b,a); }'
+assert 4 'main() { return swap(1, 2); } swap(x, y) { return sub(y, x) + add(y, x); }'
+# 畳み込みで32ビットに収まらなくなった定数をスピルする場合
+assert 12 'main() { x = 65536; v0 = x * 65537; v1 = x * 65539; v2 = x * 65541; v3 = x * 65543; v4 = x * 65545; v5 = x * 65547; v6 = x * 65549; v7 = x * 65551; v8 = x * 65553; v9 = x * 65555; v10 = x * 65557; v11 = x * 65559; return (ret3() + v0 + v1 + v2 + v3 + v4 + v5 + v6 + v7 + v8 + v9 + v10 + v11) / 65536 / 65536; }'
+
+# 使う範囲が重ならない変数はスタックのスロットを共有する
+assert_asm 'sub rsp, 16 # num_lvar: 4' 'main() { a=1; b=a+1; c=b+1; d=c+1; return d; }'
+assert_asm 'sub rsp, 32 # num_lvar: 4' 'main() { a=1; b=2; c=3; d=4; return a+b+c+d; }'
+assert 4 'main() { a=1; b=a+1; c=b+1; d=c+1; return d; }'
+assert 10 'main() { x=0; for (i=0; i<5; i=i+1) { t=i; x=x+t; } y=x; return y; }'
+assert 12 'main() { a=0; i=0; while (i<3) { b=a; a=b+4; i=i+1; } c=a; return c; }'
+assert 3 'main() { a=1; b=2; p=&b; return *(p+8)+*p; }'
+
+# のぞき穴最適化で即値やメモリを直接オペランドにし、push/popを消す
+assert_asm 'add rax, 4' 'main() { a=3; return a+4; }'
+assert_asm 'mov [rbp-8], rax' 'main() { a=3; return a; }'
+assert_asm 'imul rax, [rbp-16]' 'main() { a=3; b=4; return a*b; }'
+assert_asm 'cmp rax, 10' 'main() { i=0; while (i<10) i=i+1; return i; }'
+assert_asm 'mov rsi, [rbp-8]' 'main() { a=3; return add(1, a); }'
+if echo 'main() { a=3; b=a+1; return add(a, b); }' | ./9cc - | grep -qE 'push rax|pop r[ads]'; then
+    echo "push/pop left after peephole"
+    exit 1
+fi
+actual=$(echo 'main() { a=3; return a+4; }' | ./9cc --peephole-stats -o /dev/null - 2>&1 | tr '\n' ' ')
+expected='peephole: lea-load 1 peephole: operand 1 peephole: imm-operand 1 peephole: mem-operand 0 peephole: push-pop 1 peephole: mov-retarget 1 peephole: store-direct 1 '
+if [ "$actual" = "$expected" ]; then
+    echo "--peephole-stats => OK"
+else
+    echo "--peephole-stats => '$expected' expected, but got '$actual'"
+    exit 1
+fi
+
+# --statsはフェーズごとの時間と確保量、オブジェクトの個数、出力したバイト数を1行のJSONで書く
+stats=$(echo 'main() { a=3; return a+4; }' | ./9cc --stats -o tmp.s - 2>&1)
+for key in '"input":"-"' '"backend":"stack"' '"tokenize":{"ns":' '"parse":{"ns":' '"add_type":{"ns":' \
+    '"generate_code":{"ns":' '"counts":{"tokens":15,"nodes":8,"lvars":1,"types":1}' "\"asm_bytes\":$(wc -c <tmp.s)}"; do
+    if [ "${stats#*"$key"}" = "$stats" ]; then
+        echo "--stats => '$key' expected in '$stats'"
+        exit 1
+    fi
+done
+echo "--stats => OK"
+
+# 条件の比較はsetccで値にせず、フラグで直接分岐する。ループの条件は末尾に置く
+assert 2 'main() { a=3; if (a>3) return 1; if (a>=3) return 2; return 0; }'
+assert 3 'main() { a=3; if (a<=2) return 1; else if (a!=3) return 2; else return 3; }'
+assert 5 'main() { a=0; for (i=0; i!=5; i=i+1) a=a+1; return a; }'
+assert 7 'main() { a=7; while (a==3) a=0; return a; }'
+assert 4 'main() { i=0; for (;;) { i=i+1; if (i==4) return i; } }'
+assert 1 'main() { while (0) return 9; if (1) return 1; return 2; }'
+assert 2 'main() { x=2; if (x) return x; return 9; }'
+assert_asm 'jge .Lend.main.1' 'main() { a=3; if (a<5) a=1; return a; }'
+assert_asm 'jl  .Lbegin.main.1' 'main() { i=0; while (i<10) i=i+1; return i; }'
+if echo 'main() { i=0; while (i<10) i=i+1; return i; }' | ./9cc - | grep -qE 'setl|cmp rax, 0'; then
+    echo "comparison not fused into the branch"
+    exit 1
+fi
+
+# ループ不変式の移動、誘導変数の乗算の加算への置き換え、回数が定数のループの展開
+assert 13 'main() { s=0; n=7; m=3; for (i=0; i<10; i=i+1) s = s + i*n + m*n; return s; }'
+assert 45 'main() { s=0; for (i=10; 0<i; i=i-1) s=s+i-1; return s; }'
+assert 60 'main() { s=0; for (i=0; i!=10; i=i+2) s=s+i*3; return s; }'
+assert 12 'main() { s=0; for (i=0; i<=5; i=i+1) for (j=0; j<2; j=j+1) s=s+j*2; return s; }'
+assert 7 'main() { n=3; t=0; while (t < n*2+1) t=t+1; return t; }'
+assert 10 'main() { for (i=0; i<100; i=i+1) if (i*4 == 40) return i; return 0; }'
+assert 9 'main() { for (i=0; i<5; i=i+1) a=i; return i+a; }'
+assert 7 'main() { a=2; for (i=5; i<3; i=i+1) a=a*10; return a+i; }'
+assert 47 'main() { s=0; k=3; n=2; for (i=0; i<n+4; i=i+1) s=s+i*k; return s+n; }'
+assert_loop 'hoisted 1, reduced 1, unrolled 1' 'main() { s=0; n=7; m=3; for (i=0; i<10; i=i+1) s = s + i*n + m*n; return s; }'
+assert_loop 'hoisted 1, reduced 1, unrolled 0' 'main() { s=0; n=7; m=3; for (i=0; i<10; i=i+1) s = s + i*n + m*n; return s; }' '--unroll 1'
+assert_loop 'hoisted 0, reduced 0, unrolled 0' 'main() { s=0; p=&s; for (i=0; i<10; i=i+1) *p = *p + i*7; return s; }'
+assert_loop 'hoisted 0, reduced 0, unrolled 0' 'main() { for (i=0; i<10; i=i+1) i=i*2; return i; }'
+assert_loop 'hoisted 0, reduced 0, unrolled 1' 'main() { a=0; b=9; n=2; for (i=0; i<1000; i=i+1) a = b / n; return a; }'
+
+# 小さな葉関数のインライン展開。途中のreturn、仮引数への代入、引数の中の代入、入れ子の呼び出し
+assert 20 'sgn(x) { if (x < 0) return 0-1; if (x == 0) return 0; return 1; } main() { return sgn(0-5) + sgn(0)*10 + sgn(7)*20 + 1; }'
+assert 54 'dec(x) { x = x - 1; return x; } main() { a=5; b=dec(a); return a*10 + b; }'
+assert 45 'f(x, y) { return x*10 + y; } main() { a=1; return f(a, a=2) + f(a=3, a); }'
+assert 4 'sum(n) { s=0; for (i=0; i<n; i=i+1) s=s+i; return s; } main() { t=0; for (k=0; k<4; k=k+1) t=t+sum(k); return t; }'
+assert 14 'g(x) { t = x * 2; return t + 1; } main() { return g(1) + g(g(2)); }'
+assert 10 'add3(x, y, z) { return add(x, y) + z; } id(x) { return x; } main() { return id(id(3)) + add3(1, 2, id(4)); }'
+assert 7 'f(x) { if (x) return 3; else return 4; } main() { a=0; b=0; for (i=0; i<2; i=i+1) { a=a+f(i); } return a; }'
+assert_inline 'inline: sq into main: 2 calls, 5 nodes' 'sq(x) { return x*x; } main() { return sq(2) + sq(3); }'
+assert_inline 'inline: 0 calls inlined' 'sq(x) { return x*x; } main() { return sq(2) + sq(3); }' '--no-inline'
+assert_inline 'inline: 1 calls inlined' 'sq(x) { return x*x; } sgn(x) { if (x < 0) return 0-1; if (x == 0) return 0; return 1; } main() { return sq(2) + sgn(3); }' '--inline-budget 0'
+assert_inline 'inline: 0 calls inlined' 'f(x) { y = x + 1; } main() { return f(4); }'
+assert_inline 'inline: 0 calls inlined' 'f(x) { p = &x; return *p; } main() { return f(3); }'
+assert_inline 'inline: 0 calls inlined' 'f(x) { return y + x; } main() { return f(3); }'
+
+# 末尾呼び出し。自分自身はループに、ほかの関数へはjmpになり、深い再帰でもスタックが伸びない
+assert 32 'sum(n, acc) { if (n == 0) return acc; return sum(n - 1, acc + n); } main() { return sum(1000000, 0); }'
+assert 1 'even(n) { if (n == 0) return 1; return odd(n - 1); } odd(n) { if (n == 0) return 0; return even(n - 1); } main() { return even(1000000); }'
+assert 6 'gcd(a, b) { if (b == 0) return a; return gcd(b, a - a / b * b); } main() { return gcd(48, 18); }'
+assert 21 'main() { return add6(1, 2, 3, 4, 5, 6); }'
+assert 7 'f(a, b) { x = a * 2; return sub(x, b); } main() { return f(4, 3) + f(1, 0); }'
+assert 10 'f(n, acc) { p = &acc; if (n == 0) return *p; return f(n - 1, acc + 1); } main() { return f(10, 0); }'
+assert_asm 'jmp .Lbody.sum.0' 'sum(n, acc) { if (n == 0) return acc; return sum(n - 1, acc + n); } main() { return sum(3, 0); }'
+assert_asm 'jmp add6' 'main() { return add6(1, 2, 3, 4, 5, 6); }'
+assert_asm 'call f' 'f(n, acc) { p = &acc; if (n == 0) return *p; return f(n - 1, acc + 1); } main() { return f(10, 0); }'
+if echo 'main() { return add6(1, 2, 3, 4, 5, 6); }' | ./9cc --no-tail-calls - | grep -qF 'jmp add6'; then
+    echo "tail call emitted with --no-tail-calls"
+    exit 1
+fi
+
+# SSA形式でのコピー伝播、定数畳み込み、到達不能なブロックと不要な命令の削除
+assert_ir 'imm 7' 'main() { a=3; b=a; c=b+4; return c; }'
+assert_ir 'bb1: preds bb0 bb2' 'main() { i=0; while (i<10) i=i+1; return i; }'
+assert_ir ' = phi ' 'main() { i=0; while (i<10) i=i+1; return i; }'
+assert_ir 'bb0:' 'main() { x=1; if (x) return 2; return 3; y=5; }'
+if echo 'main() { x=1; if (x) return 2; return 3; y=5; }' | ./9cc --regalloc --dump-ir -o /dev/null - 2>&1 |
+    grep -qE 'bb1|imm (3|5)'; then
+    echo "dead branch not removed"
+    exit 1
+fi
+assert 21 'main() { return swap(3); } swap(n) { x=1; y=2; while (n>0) { t=x; x=y; y=t; n=n-1; } return x*10+y; }'
+assert 12 'main() { return swap(4); } swap(n) { x=1; y=2; while (n>0) { t=x; x=y; y=t; n=n-1; } return x*10+y; }'
+assert 55 'main() { return fib(10); } fib(n) { a=0; b=1; for (i=0; i<n; i=i+1) { t=a; a=b; b=t+b; } return a; }'
+assert 5 'main() { if (1<2) x=5; else x=7; return x; }'
+# returnなしで末尾まで来たら、どのバックエンドでも最後の式文の値を返す
+assert 7 'main() { a = 7; }'
+assert 9 'main() { return f(2); } f(x) { y = x + 7; }'
+assert 9 'main() { return f(2); } f(x) { if (x) x = x * 3; y = x + 3; }'
+# 末尾のifは通った枝の最後の式文の値を返す
+assert 5 'main() { x=3; if (x) 5; else 6; }'
+assert 6 'main() { x=0; if (x) 5; else 6; }'
+assert 7 'main() { x=3; if (x) { y=2; y+5; } else 6; }'
+assert 7 'main() { return f(3); } f(x) { if (x) if (x-3) 4; else 7; else 6; }'
+assert 4 'main() { x=3; p=&x; if (x) *p+1; else 6; }'
+
+# --no-asm-comments ではコメントを出力しない
+for input in 'main() { x=0; for (i=0; i<5; i=i+1) x=x+i; return x; }' 'main() { return add(3, 4); }'; do
+    echo "$input" >tmp.9cc
+    if ./9cc --no-asm-comments tmp.9cc | grep -q '#'; then
+        echo "$input => comments found with --no-asm-comments"
+        exit 1
+    fi
+    ./9cc --no-asm-comments -o tmp.s tmp.9cc
+    ./9cc tmp.9cc | sed -e 's/ *#.*//' -e '/^$/d' | diff - tmp.s
+    echo "$input --no-asm-comments => OK"
+done
+
+# ファイルから読み、エラーは問題の行だけを file:line:col 付きで表示する
+printf 'main() {\n  x = 1;\n  return x +;\n}\n' >tmp.9cc
+expected="tmp.9cc:3:13:   return x +;
+                          ^ 数ではありません"
+set +e
+actual=$(./9cc -o tmp.s tmp.9cc 2>&1)
+set -e
+if [ "$actual" = "$expected" ]; then
+    echo "error_at => OK"
+else
+    echo "error_at => expected:"
+    echo "$expected"
+    echo "but got:"
+    echo "$actual"
+    exit 1
+fi
+
+# -cに.sを渡すとアセンブルだけする。メモリに書く即値は32ビットに収まらなければ切り詰めずにエラーにする
+asm_store() {
+    printf '.intel_syntax noprefix\n.global main\nmain:\n  push rbp\n  mov rbp, rsp\n  sub rsp, 16\n'
+    printf '  mov QWORD PTR [rbp-8], %s\n  mov rax, QWORD PTR [rbp-8]\n  mov rsp, rbp\n  pop rbp\n  ret\n' "$1"
+}
+asm_store 42 >tmp.s
+./9cc -c -o tmp.o tmp.s
+cc -static -o tmp tmp.o
+set +e
+./tmp
+actual="$?"
+set -e
+if [ "$actual" = 42 ]; then
+    echo "-c tmp.s => OK"
+else
+    echo "-c tmp.s => 42 expected, but got $actual"
+    exit 1
+fi
+asm_store 4294967338 >tmp.s
+if ./9cc -c -o tmp.o tmp.s 2>/dev/null; then
+    echo "-c tmp.s => mov QWORD PTR [rbp-8], 4294967338 should be rejected"
+    exit 1
+fi
+echo "-c tmp.s (imm64 store) => rejected"
+
+# ページの倍数の長さのファイルでも末尾で止まる
+{
+    printf 'main() { return 7; }'
+    head -c $((4096 - 20)) /dev/zero | tr '\0' ' '
+} >tmp.9cc
+./9cc -o tmp.s tmp.9cc
+cc -static -o tmp tmp.s tmp2.o
+set +e
+./tmp
+actual="$?"
+set -e
+if [ "$actual" = 7 ]; then
+    echo "page-sized file => OK"
+else
+    echo "page-sized file => 7 expected, but got $actual"
+    exit 1
+fi
+
+# -jで複数のファイルを並列にコンパイルしても、1つずつコンパイルした出力と同じになる
+rm -rf tmp.d
+mkdir tmp.d
+for i in $(seq 1 16); do
+    echo "main() { x=$i; for (i=0; i<$i; i=i+1) if (x<100) x=x+i; return fib(x - x + 9) + add(x, 1); }
+fib(x) { if (x<=1) return 1; return fib(x-1) + fib(x-2); }" >tmp.d/t$i.c
+    ./9cc -o tmp.d/t$i.expected tmp.d/t$i.c
+done
+./9cc -j 4 tmp.d/t*.c
+for i in $(seq 1 16); do
+    cmp tmp.d/t$i.s tmp.d/t$i.expected
+done
+cc -static -o tmp tmp.d/t3.s tmp2.o
+set +e
+./tmp
+actual="$?"
+set -e
+if [ "$actual" = 62 ]; then
+    echo "-j 4 => OK"
+else
+    echo "-j 4 => 62 expected, but got $actual"
+    exit 1
+fi
+
+# 1つのファイルでも-jなら関数ごとに並列に生成し、出力は変わらない
+for i in $(seq 1 16); do
+    echo "f$i(x) { y=0; for (i=0; i<x; i=i+1) if (i<$i) y=y+i; else y=y-1; while (y>100) y=y-$i; return y; }"
+done >tmp.d/all.c
+echo 'main() { return 0; }' >>tmp.d/all.c
+for flags in "" "--regalloc"; do
+    ./9cc $flags -o tmp.d/serial.s tmp.d/all.c
+    ./9cc $flags -j 4 -o tmp.d/parallel.s tmp.d/all.c
+    cmp tmp.d/serial.s tmp.d/parallel.s
+    echo "all.c $flags -j 4 => OK"
+done
+rm -rf tmp.d
+
+# 深い式の入れ子や長い連鎖でもCのスタックを使い切らない
+depth=100000
+{
+    printf 'main() { a = 1; p = &a; b = '
+    printf '(%.0s' $(seq $depth)
+    printf '*p'
+    printf ' + 1)%.0s' $(seq $depth)
+    printf '; return b - a'
+    printf ' - -1%.0s' $(seq $depth)
+    printf '; }\n'
+} >tmp.9cc
+for flags in "" "--regalloc" "--no-inline --no-loop-opt"; do
+    ./9cc $flags -o tmp.s tmp.9cc
+    cc -static -o tmp tmp.s tmp2.o
+    set +e
+    ./tmp
+    actual="$?"
+    set -e
+    if [ "$actual" = 64 ]; then
+        echo "depth $depth $flags => $actual"
+    else
+        echo "depth $depth $flags => 64 expected, but got $actual"
+        exit 1
+    fi
+done
+
+# --serveは1つのプロセスで要求を続けてコンパイルし、エラーの後もコンパイルを続ける
+good='f(x) { return x * 2; } main() { return f(add(20, 1)); }'
+bad='main() { x = 1; while (x) { return 1 +; } }'
+{
+    printf '%d\n%s' ${#good} "$good"
+    printf '%d\n%s' ${#bad} "$bad"
+    printf '%d\n%s' ${#good} "$good"
+} | ./9cc --serve >tmp.serve
+echo "$good" | ./9cc -o tmp.expected -
+statuses=
+{
+    for i in 1 2 3; do
+        read -r status len
+        head -c "$len" >tmp.response$i.s
+        statuses="$statuses$status "
+    done
+} <tmp.serve
+[ "$statuses" = "ok error ok " ]
+cmp tmp.response1.s tmp.expected
+cmp tmp.response3.s tmp.expected
+grep -q '^<input>:1:39: ' tmp.response2.s
+grep -q '\^ 数ではありません' tmp.response2.s
+cc -static -o tmp tmp.response3.s tmp2.o
+set +e
+./tmp
+actual="$?"
+set -e
+if [ "$actual" = 42 ]; then
+    echo "--serve => OK"
+else
+    echo "--serve => 42 expected, but got $actual"
+    exit 1
+fi
+rm -f tmp.serve tmp.expected tmp.response*
+
+# --serveはコマンドラインで指定したオプションでコンパイルする
+src='f(n) { if (n == 0) return 0; return f(n - 1); } main() { x = 3; return f(x); }'
+for flags in "--no-peephole --no-tail-calls" "--regalloc --no-tail-calls"; do
+    printf '%d\n%s' ${#src} "$src" | ./9cc $flags --serve | tail -n +2 >tmp.response.s
+    echo "$src" | ./9cc $flags -o tmp.expected -
+    cmp tmp.response.s tmp.expected
+    echo "$src" | ./9cc ${flags%% *} - | cmp -s - tmp.expected && exit 1
+    echo "--serve $flags => OK"
+done
+rm -f tmp.expected tmp.response.s
+
+# --cacheは同じソースとオプションなら前の出力をそのまま書き、オプションが違えば作り直す
+rm -rf tmp.cache
+echo 'f(x) { return x * 3; } main() { return f(14); }' >tmp.9cc
+./9cc -o tmp.expected tmp.9cc
+for expected in miss hit; do
+    ./9cc --cache tmp.cache --stats -o tmp.s tmp.9cc 2>tmp.stats
+    grep -q "\"cache\":{\"result\":\"$expected\"," tmp.stats
+    cmp tmp.s tmp.expected
+    echo "--cache => $expected"
+done
+./9cc --cache tmp.cache --stats --regalloc -o tmp.s tmp.9cc 2>tmp.stats
+grep -q '"cache":{"result":"miss",' tmp.stats
+./9cc --cache tmp.cache --stats tmp.9cc 2>tmp.stats | cmp - tmp.expected
+grep -q '"cache":{"result":"hit",' tmp.stats
+[ "$(ls tmp.cache | wc -l)" = 2 ]
+rm -rf tmp.cache tmp.stats tmp.expected
+
+# --incrementalは変わった関数と、それを展開する関数だけをコンパイルし直す
+rm -rf tmp.cache
+echo 'sq(x) { return x * x; } other(x) { return x - 1; } main() { return sq(3) + other(5); }' >tmp.9cc
+./9cc --cache tmp.cache --incremental --stats -o tmp.s tmp.9cc 2>tmp.stats
+grep -q '"functions":{"reused":0,"compiled":3}' tmp.stats
+sed 's/x \* x/x * x + 1/' tmp.9cc >tmp.edit.9cc
+./9cc -o tmp.expected tmp.edit.9cc
+./9cc --cache tmp.cache --incremental --stats -o tmp.s tmp.edit.9cc 2>tmp.stats
+grep -q '"functions":{"reused":1,"compiled":2}' tmp.stats
+cmp tmp.s tmp.expected
+echo "--incremental => reused 1, compiled 2"
+rm -rf tmp.cache tmp.stats tmp.expected tmp.edit.9cc tmp.9cc
+
+# --runはアセンブラとリンカを通さずにメモリ上でmainを呼び、その戻り値で終了する。
+# 定義のない関数はputcharなどのホストの関数に解決する
+for flags in "" "--regalloc"; do
+    set +e
+    echo 'main() { return fib(10); } fib(x) { if (x<=1) return 1; return fib(x-1) + fib(x-2); }' | ./9cc $flags --run -
+    actual="$?"
+    output=$(echo 'main() { putchar(79); putchar(75); return putchar(10) - 10; }' | ./9cc $flags --run -)
+    status="$?"
+    echo 'main() { return undefined(); }' | ./9cc $flags --run - 2>/dev/null
+    undefined="$?"
+    set -e
+    if [ "$actual" = 89 ] && [ "$output" = OK ] && [ "$status" = 0 ] && [ "$undefined" = 1 ]; then
+        echo "--run $flags => OK"
+    else
+        echo "--run $flags => 89, OK, 0, 1 expected, but got $actual, $output, $status, $undefined"
+        exit 1
+    fi
+done
+
 echo OK
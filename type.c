@@ -1,53 +1,128 @@
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "9cc.h"
 
-Type *ty_int = &(Type){TY_INT};
+Type *ty_int = &(Type){TY_INT, .size = 8, .align = 8};
 
 bool is_integer(Type *ty) { return ty->kind == TY_INT; }
 
 Type *copy_type(Type *ty) {
-    Type *ret = calloc(1, sizeof(Type));
+    Type *ret = arena_new(OBJ_TYPE, sizeof(Type));
     *ret = *ty;
     return ret;
 }
 
 Type *pointer_to(Type *base) {
-    Type *ty = calloc(1, sizeof(Type));
+    Type *ty = arena_new(OBJ_TYPE, sizeof(Type));
     ty->kind = TY_PTR;
+    ty->size = 8;
+    ty->align = 8;
     ty->base = base;
     return ty;
 }
 
 Type *func_type(Type *return_ty) {
-    Type *ty = calloc(1, sizeof(Type));
+    Type *ty = arena_new(OBJ_TYPE, sizeof(Type));
     ty->kind = TY_FUNC;
     ty->return_ty = return_ty;
     return ty;
 }
 
-void add_type(Node *node) {
+// 型を付ける途中のノード。子を積んだらexpandedにし、子が全て終わってから型を決める
+typedef struct {
+    Node *node;
+    bool expanded;
+} TypeFrame;
+
+// 深い式でもCのスタックを使い切らないよう、明示的なスタックで後行順にたどる。
+// スタックはアリーナ上に置き、アリーナが解放されたら作り直す
+static _Thread_local TypeFrame *s_stack;
+static _Thread_local int32_t s_cap;
+static _Thread_local uint64_t s_generation;
+
+static void push(int32_t *len, Node *node) {
     if (!node || node->ty) {
         return;
     }
+    if (*len == s_cap) {
+        s_cap = s_cap ? s_cap * 2 : 256;
+        TypeFrame *p = arena_alloc(sizeof(TypeFrame) * s_cap);
+        if (*len > 0) {
+            memcpy(p, s_stack, sizeof(TypeFrame) * *len);
+        }
+        s_stack = p;
+    }
+    s_stack[(*len)++] = (TypeFrame){node, false};
+}
 
-    add_type(node->lhs);
-    add_type(node->rhs);
-    add_type(node->cond);
-    add_type(node->then);
-    add_type(node->els);
-    add_type(node->init);
-    add_type(node->inc);
+// unionに重ねているのでkindごとに子を積む
+static void push_children(int32_t *len, Node *node) {
+    switch (node->kind) {
+        case ND_NUM:
+        case ND_LVAR:
+            break;
+        case ND_IF:
+        case ND_WHILE:
+        case ND_FOR:
+            push(len, node->cond);
+            push(len, node->then);
+            if (node->kind == ND_IF) {
+                push(len, node->els);
+            } else if (node->kind == ND_FOR) {
+                push(len, node->init);
+                push(len, node->inc);
+            }
+            break;
+        case ND_BLOCK:
+            for (Node *n = node->body; n; n = n->next) push(len, n);
+            break;
+        case ND_FUNCALL:
+            for (Node *n = node->args; n; n = n->next) push(len, n);
+            break;
+        case ND_INLINE:
+            for (Node *n = node->inlined; n; n = n->next) push(len, n);
+            break;
+        default:
+            push(len, node->lhs);
+            push(len, node->rhs);
+            break;
+    }
+}
+
+static void set_type(Node *node);
 
-    for (Node *n = node->body; n; n = n->next) add_type(n);
-    for (Node *n = node->args; n; n = n->next) add_type(n);
+void add_type(Node *node) {
+    if (s_generation != arena_generation()) {
+        s_generation = arena_generation();
+        s_stack = NULL;
+        s_cap = 0;
+    }
+    int32_t len = 0;
+    push(&len, node);
+    while (len > 0) {
+        TypeFrame *f = &s_stack[len - 1];
+        if (f->expanded) {
+            set_type(f->node);
+            len--;
+            continue;
+        }
+        f->expanded = true;
+        push_children(&len, f->node);
+    }
+}
 
+// 子の型が決まってからnodeの型を決める
+static void set_type(Node *node) {
     switch (node->kind) {
         case ND_ADD:
         case ND_SUB:
         case ND_MUL:
         case ND_DIV:
+        case ND_SHL:
+        case ND_SAR:
         case ND_ASSIGN:
             node->ty = node->lhs->ty;
             return;
@@ -57,6 +132,7 @@ void add_type(Node *node) {
         case ND_LE:
         case ND_NUM:
         case ND_FUNCALL:
+        case ND_INLINE:
             node->ty = ty_int;
             return;
         case ND_LVAR: